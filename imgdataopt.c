@@ -41,7 +41,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zlib.h>  /* crc32(), adler32(), deflateInit(), deflate(), deflateEnd(), inflateInit(), inflate(), inflateEnd(). */
+#include <time.h>  /* clock(). */
+#include <zlib.h>  /* crc32(), adler32(), deflateInit(), deflate(), deflateReset(), deflateEnd(), inflateInit(), inflate(), inflateReset(), inflateEnd(). */
+#include "imgdataopt.h"
+#endif
+#include <setjmp.h>  /* setjmp(), longjmp(). Also for tcc. */
+#if USE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>  /* sysconf(). */
+#include <sys/time.h>  /* gettimeofday(). */
+#endif
+/* Input files are read with mmap(2) on Unix. Compile with -DNO_MMAP to use
+ * only stdio.
+ */
+#if !NO_MMAP && (defined(__unix__) || defined(__APPLE__)) && \
+    !defined(__TINYC__)
+#define USE_MMAP 1
+#include <fcntl.h>  /* open(). */
+#include <sys/mman.h>  /* mmap(), munmap(). */
+#include <sys/stat.h>  /* fstat(). */
+#include <unistd.h>  /* close(). */
+#endif
+#ifdef _WIN32
+#include <fcntl.h>  /* _O_BINARY. */
+#include <io.h>  /* _setmode(). */
+#endif
+/* SSE2 is always available on amd64. The SSSE3 code is selected at
+ * runtime. Compile with -DNO_SIMD to use only the portable code.
+ */
+#if !NO_SIMD && defined(__SSE2__) && !defined(__TINYC__)
+#define USE_SSE2 1
+#include <emmintrin.h>  /* _mm_add_epi8() etc. */
+#if defined(__clang__) ? __clang_major__ >= 4 : __GNUC__ >= 5
+#define USE_SSSE3 1  /* Needs __attribute__((target(...))). */
+#include <tmmintrin.h>  /* _mm_abs_epi16(). */
+#endif
 #endif
 
 /* Disable some GCC alternate keywords
@@ -71,16 +105,21 @@ typedef long long int32_t;
 typedef unsigned int size_t;  /* TODO(pts): 64-bit tcc. */
 #define NULL ((void*)0)
 void ATTRIBUTE_NORETURN exit(int status);
+void ATTRIBUTE_NORETURN abort(void);
 /* string.h */
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
 int strcmp(const char *s1, const char *s2);
+int strncmp(const char *s1, const char *s2, size_t n);
 size_t strlen(const char *s);
 /* stdio.h */
 #define SEEK_SET 0
+#define SEEK_END 2
 typedef struct FILE FILE;
+extern FILE *stdin;
+extern FILE *stdout;
 extern FILE *stderr;
 void *malloc(size_t size);
 void free(void *ptr);
@@ -92,16 +131,31 @@ int putc(int c, FILE *stream);
 int getc(FILE *stream);
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 int fseek(FILE *stream, long offset, int whence);
+long ftell(FILE *stream);
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 int fflush(FILE *stream);
 int ferror(FILE *stream);
 int fclose(FILE *stream);
+int rename(const char *oldpath, const char *newpath);
+int remove(const char *pathname);
+/* time.h */
+typedef long clock_t;
+#define CLOCKS_PER_SEC 1000000L
+clock_t clock(void);
 /* zlib.h */
 #define Z_NO_FLUSH 0
+#define Z_SYNC_FLUSH 2
+#define Z_BLOCK 5
 #define Z_FINISH 4
 #define Z_OK 0
 #define Z_STREAM_END 1
 #define Z_DATA_ERROR (-3)
+#define Z_BUF_ERROR (-5)
+#define Z_DEFLATED 8
+#define Z_FILTERED 1
+#define Z_HUFFMAN_ONLY 2
+#define Z_RLE 3
+#define Z_DEFAULT_STRATEGY 0
 typedef unsigned int uInt;
 typedef unsigned long uLong;
 typedef unsigned char Bytef;
@@ -124,13 +178,23 @@ typedef struct z_stream_s {
 #define ZLIB_VERSION "1.0"  /* Doesn't matter, "1.2.8" also works. */
 int deflateInit_(z_stream *strm, int level, const char *version, int stream_size);
 #define deflateInit(strm, level) deflateInit_((strm), (level), ZLIB_VERSION, (int)sizeof(z_stream))
+int deflateInit2_(z_stream *strm, int level, int method, int windowBits, int memLevel, int strategy, const char *version, int stream_size);
+#define deflateInit2(strm, level, method, windowBits, memLevel, strategy) deflateInit2_((strm), (level), (method), (windowBits), (memLevel), (strategy), ZLIB_VERSION, (int)sizeof(z_stream))
+int deflateSetDictionary(z_stream *strm, const Bytef *dictionary, uInt dictLength);
 int deflate(z_stream *strm, int flush);
+int deflateReset(z_stream *strm);
+int deflateParams(z_stream *strm, int level, int strategy);
+int deflateTune(z_stream *strm, int good_length, int max_lazy, int nice_length, int max_chain);
 int deflateEnd(z_stream *strm);
 int inflateInit_(z_stream *strm, const char *version, int stream_size);
 #define inflateInit(strm) inflateInit_((strm), ZLIB_VERSION, (int)sizeof(z_stream))
 int inflate(z_stream *strm, int flush);
+int inflateReset(z_stream *strm);
 int inflateEnd(z_stream *strm);
 uLong crc32(uLong crc, const Bytef *buf, uInt len);
+uLong crc32_combine(uLong crc1, uLong crc2, long len2);
+uLong adler32(uLong adler, const Bytef *buf, uInt len);
+uLong adler32_combine(uLong adler1, uLong adler2, long len2);
 #endif
 
 /* Otherwise no use of printf, sprintf and fprintf in the code, so
@@ -141,7 +205,139 @@ uLong crc32(uLong crc, const Bytef *buf, uInt len);
 
 typedef char xbool_t;
 
+/* A function to call on a trapped die(), see push_die_cleanup. */
+typedef struct DieCleanup {
+  void (*func)(void *arg);
+  void *arg;
+  struct DieCleanup *prev;
+} DieCleanup;
+
+/* A die() within the scope of a DieTrap (in the same thread) longjmps to
+ * jb instead of exiting.
+ */
+typedef struct DieTrap {
+  jmp_buf jb;
+  const char *msg;  /* Set by die(). */
+  FILE *f;  /* If not NULL, die() closes it. */
+#if USE_MMAP
+  const char *map;  /* If not NULL, die() unmaps map[:map_size]. */
+  uint32_t map_size;
+#endif
+  /* die() calls these first, the last pushed first (e.g. to stop helper
+   * threads, or to free memory of the job).
+   */
+  DieCleanup *cleanups;
+} DieTrap;
+
+/* Slots of per-thread pointers. */
+#define TS_DIE_TRAP 0  /* DieTrap*. */
+#define TS_ZCACHE 1  /* ZCache*. */
+#define TS_JOB_STATS 2  /* JobStats*. */
+#define TS_DEADLINE 3  /* Deadline*. */
+#define TS_COUNT 4
+
+#if USE_PTHREAD
+static pthread_key_t thread_keys[TS_COUNT];
+static pthread_once_t thread_keys_once = PTHREAD_ONCE_INIT;
+
+static void init_thread_keys(void) {
+  uint8_t slot;
+  for (slot = 0; slot < TS_COUNT; ++slot) {
+    if (pthread_key_create(thread_keys + slot, NULL)) abort();
+  }
+}
+
+static void *get_thread_ptr(uint8_t slot) {
+  pthread_once(&thread_keys_once, init_thread_keys);
+  return pthread_getspecific(thread_keys[slot]);
+}
+
+/* Returns the previous pointer of the calling thread. */
+static void *set_thread_ptr(uint8_t slot, void *ptr) {
+  void *old_ptr = get_thread_ptr(slot);
+  pthread_setspecific(thread_keys[slot], ptr);
+  return old_ptr;
+}
+#else
+static void *thread_ptrs[TS_COUNT];
+
+static void *get_thread_ptr(uint8_t slot) { return thread_ptrs[slot]; }
+
+static void *set_thread_ptr(uint8_t slot, void *ptr) {
+  void *old_ptr = thread_ptrs[slot];
+  thread_ptrs[slot] = ptr;
+  return old_ptr;
+}
+#endif
+
+static DieTrap *get_die_trap(void) {
+  return (DieTrap*)get_thread_ptr(TS_DIE_TRAP);
+}
+
+/* Returns the previous DieTrap of the calling thread. */
+static DieTrap *set_die_trap(DieTrap *trap) {
+  return (DieTrap*)set_thread_ptr(TS_DIE_TRAP, trap);
+}
+
+/* Makes a subsequent trapped die() close f. Call it with NULL before
+ * closing f.
+ */
+static void set_die_file(FILE *f) {
+  DieTrap *trap = get_die_trap();
+  if (trap) trap->f = f;
+}
+
+#if USE_MMAP
+/* Makes a subsequent trapped die() unmap map[:map_size]. Call it with NULL
+ * before unmapping it.
+ */
+static void set_die_map(const char *map, uint32_t map_size) {
+  DieTrap *trap = get_die_trap();
+  if (trap) {
+    trap->map = map;
+    trap->map_size = map_size;
+  }
+}
+#endif
+
+/* Makes a subsequent trapped die() call func(arg). dc is the storage, it
+ * must be valid until pop_die_cleanup(dc). Pop them in reverse push order.
+ */
+static void push_die_cleanup(DieCleanup *dc, void (*func)(void *arg),
+                             void *arg) {
+  DieTrap *trap = get_die_trap();
+  dc->func = func;
+  dc->arg = arg;
+  dc->prev = trap ? trap->cleanups : NULL;
+  if (trap) trap->cleanups = dc;
+}
+
+static void pop_die_cleanup(DieCleanup *dc) {
+  DieTrap *trap = get_die_trap();
+  if (trap) trap->cleanups = dc->prev;
+}
+
 static ATTRIBUTE_NORETURN void die(const char *msg) {
+  DieTrap *trap = get_die_trap();
+  if (trap) {
+    trap->msg = msg;
+    while (trap->cleanups) {
+      DieCleanup *dc = trap->cleanups;
+      trap->cleanups = dc->prev;  /* Prevent recursion if it die()s. */
+      dc->func(dc->arg);
+    }
+    if (trap->f) {
+      fclose(trap->f);
+      trap->f = NULL;
+    }
+#if USE_MMAP
+    if (trap->map) {
+      munmap((void*)trap->map, trap->map_size);
+      trap->map = NULL;
+    }
+#endif
+    longjmp(trap->jb, 1);
+  }
   fwrite("fatal: ", 1, 7, stderr);
   fwrite(msg, 1, strlen(msg), stderr);
   putc('\n', stderr);
@@ -181,6 +377,689 @@ static void *xmalloc(size_t size) {
   return result;
 }
 
+/* --- Threads. */
+
+#if USE_PTHREAD
+typedef struct TaskPool {
+  void (*func)(void *arg, uint32_t task_idx);
+  void *arg;
+  uint32_t task_count;
+  /* Protected by mutex. */
+  uint32_t next_task_idx;
+  /* Protected by mutex. The first die() message in a task, or NULL. */
+  const char *die_msg;
+  pthread_mutex_t mutex;
+  void *job_stats;  /* TS_JOB_STATS of the calling thread. */
+  void *deadline;  /* TS_DEADLINE of the calling thread. */
+} TaskPool;
+
+/* Runs a task, catching its die(). */
+static void run_task_trapped(TaskPool *pool, uint32_t task_idx) {
+  DieTrap trap;
+  DieTrap *old_trap;
+  trap.f = NULL;
+#if USE_MMAP
+  trap.map = NULL;
+#endif
+  trap.cleanups = NULL;
+  old_trap = set_die_trap(&trap);
+  if (setjmp(trap.jb) == 0) {
+    pool->func(pool->arg, task_idx);
+  } else {
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->die_msg) pool->die_msg = trap.msg;
+    pool->next_task_idx = pool->task_count;  /* Don't start more tasks. */
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  set_die_trap(old_trap);
+}
+
+static void *task_pool_worker(void *pool_arg) {
+  TaskPool *pool = (TaskPool*)pool_arg;
+  uint32_t task_idx;
+  set_thread_ptr(TS_JOB_STATS, pool->job_stats);
+  set_thread_ptr(TS_DEADLINE, pool->deadline);
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    if ((task_idx = pool->next_task_idx) < pool->task_count) {
+      ++pool->next_task_idx;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (task_idx >= pool->task_count) break;
+    run_task_trapped(pool, task_idx);
+  }
+  return NULL;
+}
+#endif
+
+/* Calls func(arg, task_idx) for each 0 <= task_idx < task_count, in any
+ * order, using at most thread_count threads (including the calling thread).
+ * Returns when all calls have returned.
+ *
+ * Without USE_PTHREAD, it calls func in the calling thread, in increasing
+ * task_idx order. Callers must produce the same result in both cases.
+ *
+ * If func calls die(), then run_tasks calls die() with the same message in
+ * the calling thread, after waiting for the running tasks.
+ */
+static void run_tasks(void (*func)(void *arg, uint32_t task_idx), void *arg,
+                      uint32_t task_count, uint32_t thread_count) {
+  uint32_t i;
+#if USE_PTHREAD
+  if (thread_count > task_count) thread_count = task_count;
+  if (thread_count > 1) {
+    TaskPool pool;
+    uint32_t started;
+    pthread_t *threads = (pthread_t*)xmalloc(
+        multiply_check(thread_count - 1, sizeof(pthread_t)));
+    pool.func = func;
+    pool.arg = arg;
+    pool.task_count = task_count;
+    pool.next_task_idx = 0;
+    pool.die_msg = NULL;
+    pool.job_stats = get_thread_ptr(TS_JOB_STATS);
+    pool.deadline = get_thread_ptr(TS_DEADLINE);
+    if (pthread_mutex_init(&pool.mutex, NULL)) die("error in pthread_mutex_init");
+    for (started = 0; started < thread_count - 1; ++started) {
+      /* If we can't start more threads, continue with what we have. */
+      if (pthread_create(threads + started, NULL, task_pool_worker, &pool)) break;
+    }
+    task_pool_worker(&pool);
+    for (i = 0; i < started; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.mutex);
+    free(threads);
+    /* Report it in the calling thread, after all threads have finished. */
+    if (pool.die_msg) die(pool.die_msg);
+    return;
+  }
+#else
+  (void)thread_count;
+#endif
+  for (i = 0; i < task_count; ++i) {
+    func(arg, i);
+  }
+}
+
+/* --- Arena. */
+
+/* A malloc fallback of an Arena, followed by the allocation. */
+typedef struct ArenaFallback {
+  struct ArenaFallback *prev, *next;
+} ArenaFallback;
+
+/* A memory block for stack-like (LIFO) allocations, reused between images
+ * (see ZCache). Freeing an allocation other than the last one is a no-op,
+ * its memory is released by reset_arena. Allocations which don't fit fall
+ * back to malloc, and the next reset_arena grows the block so that they
+ * would fit.
+ */
+typedef struct Arena {
+  char *data;  /* The block: data[:size]. */
+  uint32_t size;
+  uint32_t used;  /* data[:used] is allocated. */
+  uint32_t top;  /* Offset of the header of the last allocation in data. */
+  uint32_t missed;  /* Total size of the malloc fallbacks since the reset. */
+  uint32_t peak;  /* Block size needed by the allocations since the reset. */
+  /* Malloc fallbacks not freed yet (e.g. because of a die()). */
+  ArenaFallback *fallbacks;
+} Arena;
+
+/* Each allocation is preceded by a header: the previous used and top
+ * values. Also keeps the allocations 16-byte aligned (for SSE2).
+ */
+#define ARENA_HEADER_SIZE 16
+
+static void free_arena_fallbacks(Arena *arena) {
+  ArenaFallback *fallback;
+  while ((fallback = arena->fallbacks) != NULL) {
+    arena->fallbacks = fallback->next;
+    free(fallback);
+  }
+}
+
+static void init_arena(Arena *arena) {
+  arena->data = NULL;
+  arena->size = arena->used = arena->top = arena->missed = arena->peak = 0;
+  arena->fallbacks = NULL;
+}
+
+static void dealloc_arena(Arena *arena) {
+  free_arena_fallbacks(arena);
+  free(arena->data);
+  init_arena(arena);
+}
+
+/* Returns the number of bytes an allocation of size bytes takes in the
+ * block.
+ */
+static uint32_t get_arena_alloc_size(uint32_t size) {
+  return add_check(size, ARENA_HEADER_SIZE + 15) & ~(uint32_t)15;
+}
+
+/* Grows the block to at least size bytes, if the arena is empty. */
+static void reserve_arena(Arena *arena, uint32_t size) {
+  if (arena->used == 0 && arena->size < size) {
+    free(arena->data);
+    arena->data = NULL;
+    arena->size = 0;
+    arena->data = (char*)xmalloc(size);
+    arena->size = size;
+  }
+}
+
+/* Releases all allocations in the arena. */
+static void reset_arena(Arena *arena) {
+  free_arena_fallbacks(arena);
+  arena->used = 0;
+  reserve_arena(arena, arena->peak);
+  arena->top = arena->missed = arena->peak = 0;
+}
+
+/* Returns NULL if out of memory. */
+static void *arena_alloc(Arena *arena, uint32_t size) {
+  const uint32_t asize = get_arena_alloc_size(size);
+  const uint32_t need = add_check(add_check(arena->used, arena->missed), asize);
+  uint32_t *header;
+  if (arena->peak < need) arena->peak = need;
+  reserve_arena(arena, need);  /* Sizes an empty arena for the image. */
+  if (asize > arena->size - arena->used) {
+    ArenaFallback *fallback =
+        (ArenaFallback*)malloc(add_check(size, ARENA_HEADER_SIZE));
+    if (!fallback) return NULL;
+    arena->missed += asize;
+    fallback->prev = NULL;
+    if ((fallback->next = arena->fallbacks) != NULL) {
+      fallback->next->prev = fallback;
+    }
+    arena->fallbacks = fallback;
+    return (char*)fallback + ARENA_HEADER_SIZE;
+  }
+  header = (uint32_t*)(arena->data + arena->used);
+  header[0] = arena->used;
+  header[1] = arena->top;
+  arena->top = arena->used;
+  arena->used += asize;
+  return (char*)header + ARENA_HEADER_SIZE;
+}
+
+static void arena_free(Arena *arena, void *ptr) {
+  char *p = (char*)ptr;
+  if (!p) return;
+  if (p < arena->data || p >= arena->data + arena->size) {
+    /* A malloc fallback. */
+    ArenaFallback *fallback = (ArenaFallback*)(p - ARENA_HEADER_SIZE);
+    if (fallback->prev) {
+      fallback->prev->next = fallback->next;
+    } else {
+      arena->fallbacks = fallback->next;
+    }
+    if (fallback->next) fallback->next->prev = fallback->prev;
+    free(fallback);
+  } else if (p == arena->data + arena->top + ARENA_HEADER_SIZE) {
+    const uint32_t *header = (const uint32_t*)(p - ARENA_HEADER_SIZE);
+    arena->used = header[0];
+    arena->top = header[1];
+  }
+}
+
+/* --- Output. */
+
+/* An output byte stream: a FILE, or (if f is NULL) a growable memory buffer
+ * data[:size].
+ */
+typedef struct Sink {
+  FILE *f;
+  char *data;
+  uint32_t size;
+  uint32_t alloced;
+} Sink;
+
+static void nofile_sink(Sink *sink) {
+  sink->f = NULL;
+  sink->data = NULL;
+  sink->size = sink->alloced = 0;
+}
+
+/* Frees the memory buffer of a Sink, for push_die_cleanup. */
+static void free_sink_data(void *sink_arg) {
+  free(((Sink*)sink_arg)->data);
+}
+
+static void sink_write(Sink *sink, const char *p, uint32_t size) {
+  if (sink->f) {
+    fwrite(p, 1, size, sink->f);
+  } else {
+    if (size > sink->alloced - sink->size) {
+      const uint32_t new_size = add_check(sink->size, size);
+      uint32_t new_alloced = sink->alloced < 4096 ? 4096 : sink->alloced;
+      while (new_alloced < new_size) {
+        new_alloced = new_alloced > (uint32_t)-1 >> 1 ?
+            new_size : new_alloced << 1;
+      }
+      if (!(sink->data = (char*)realloc(sink->data, new_alloced))) {
+        die("out of memory");
+      }
+      sink->alloced = new_alloced;
+    }
+    memcpy(sink->data + sink->size, p, size);
+    sink->size += size;
+  }
+}
+
+static void sink_write_u32(Sink *sink, uint32_t u) {
+  char tmp[10], *p = tmp + sizeof(tmp);
+  do {
+    *--p = u % 10 + '0';
+  } while ((u /= 10) != 0);
+  sink_write(sink, p, tmp + sizeof(tmp) - p);
+}
+
+/* Creates file filename, and makes sink write to it. On error, dies with
+ * msg.
+ */
+static void open_file_sink(Sink *sink, const char *filename, const char *msg) {
+  nofile_sink(sink);
+  if (!(sink->f = fopen(filename, "wb"))) die(msg);
+  set_die_file(sink->f);
+}
+
+/* Flushes and closes the file of sink. On error, dies with msg. */
+static void close_file_sink(Sink *sink, const char *msg) {
+  fflush(sink->f);
+  if (ferror(sink->f)) die(msg);
+  set_die_file(NULL);
+  fclose(sink->f);
+}
+
+/* --- Input. */
+
+/* An input byte stream: a FILE, or (if f is NULL) memory p[:pend - p]. */
+typedef struct Source {
+  FILE *f;
+  const char *p;
+  const char *pend;
+} Source;
+
+static void file_source(Source *src, FILE *f) {
+  src->f = f;
+  src->p = src->pend = NULL;
+}
+
+static void memory_source(Source *src, const char *data, uint32_t size) {
+  src->f = NULL;
+  src->p = data;
+  src->pend = data + size;
+}
+
+#if !NO_PNM
+/* Returns the next byte (0..255), or -1 on EOF. */
+static int source_getc(Source *src) {
+  if (src->f) return getc(src->f);
+  return src->p == src->pend ? -1 : *(const unsigned char*)src->p++;
+}
+#endif
+
+/* Reads at most size bytes to buf. Returns the number of bytes read. */
+static uint32_t source_read(Source *src, char *buf, uint32_t size) {
+  if (src->f) return fread(buf, 1, size, src->f);
+  if (size > (uint32_t)(src->pend - src->p)) size = src->pend - src->p;
+  memcpy(buf, src->p, size);
+  src->p += size;
+  return size;
+}
+
+/* Reads exactly size bytes. Returns a pointer to them: buf for a FILE, and
+ * the bytes themselves (without copying) for memory. Returns NULL on EOF.
+ */
+static const char *source_next(Source *src, char *buf, uint32_t size) {
+  if (src->f) return fread(buf, 1, size, src->f) == size ? buf : NULL;
+  if (size > (uint32_t)(src->pend - src->p)) return NULL;
+  src->p += size;
+  return src->p - size;
+}
+
+#if USE_MMAP
+/* Maps the regular file filename to memory. Returns NULL if it's not
+ * possible (e.g. a pipe or an empty file), then the caller should use
+ * stdio.
+ */
+static const char *map_file(const char *filename, uint32_t *size) {
+  struct stat st;
+  void *map = MAP_FAILED;
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      st.st_size <= 0x7fffffffL) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  *size = st.st_size;
+  return (const char*)map;
+}
+#endif
+
+/* --- Job statistics (--stats). */
+
+/* Stages of a job. The inflate stage is part of the read stage, and the
+ * filter and deflate stages are part of the compress stage.
+ */
+#define STAGE_READ 0  /* Reading the input, including inflate and unfilter. */
+#define STAGE_INFLATE 1
+#define STAGE_ANALYZE 2  /* finish_image_stats. */
+#define STAGE_CONVERT 3  /* Color type and bpc conversion. */
+#define STAGE_COMPRESS 4  /* Filtering and compressing the PNG output. */
+#define STAGE_FILTER 5  /* Predictor selection and filtering. */
+#define STAGE_DEFLATE 6
+#define STAGE_WRITE 7  /* Writing the output file. */
+#define STAGE_COUNT 8
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "read", "inflate", "analyze", "convert", "compress", "filter", "deflate",
+    "write"};
+
+/* Timing and counters of a job, collected with --stats. The job thread
+ * (and the threads of its run_tasks calls) finds it in the TS_JOB_STATS
+ * slot.
+ */
+typedef struct JobStats {
+  /* Wall time in seconds. For the inflate, filter and deflate stages it's
+   * summed over the threads.
+   */
+  double wall[STAGE_COUNT];
+  /* Process CPU time in seconds, only for the other stages. */
+  double cpu[STAGE_COUNT];
+  /* Bytes read and written by inflate() and deflate(). */
+  double inflate_in, inflate_out, deflate_in, deflate_out;
+  /* Output color type and bpc chosen by optimize_for_png (or
+   * encode_best_png, as candidate_idx out of candidate_count), "cached"
+   * with a --cache-dir hit, or NULL.
+   */
+  const char *branch;
+  uint32_t candidate_idx, candidate_count;
+  /* img->alloced at the end of the job. It only grows within a job. */
+  uint32_t peak_alloced;
+  xbool_t is_degraded;  /* See Deadline. */
+#if USE_PTHREAD
+  pthread_mutex_t mutex;  /* Protects the fields above. */
+#endif
+} JobStats;
+
+typedef struct StageClock {
+  double wall;
+  double cpu;
+} StageClock;
+
+/* Returns the wall time in seconds. */
+static double get_wall_time(void) {
+#if USE_PTHREAD  /* POSIX. */
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#else  /* C89 has no portable wall clock with subsecond resolution. */
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void init_job_stats(JobStats *stats) {
+  uint8_t stage;
+  for (stage = 0; stage < STAGE_COUNT; ++stage) {
+    stats->wall[stage] = stats->cpu[stage] = 0;
+  }
+  stats->inflate_in = stats->inflate_out = 0;
+  stats->deflate_in = stats->deflate_out = 0;
+  stats->branch = NULL;
+  stats->candidate_idx = stats->candidate_count = 0;
+  stats->peak_alloced = 0;
+  stats->is_degraded = 0;
+#if USE_PTHREAD
+  if (pthread_mutex_init(&stats->mutex, NULL)) die("error in pthread_mutex_init");
+#endif
+}
+
+static void dealloc_job_stats(JobStats *stats) {
+#if USE_PTHREAD
+  pthread_mutex_destroy(&stats->mutex);
+#else
+  (void)stats;
+#endif
+}
+
+/* For push_die_cleanup. */
+static void abort_job_stats(void *stats_arg) {
+  set_thread_ptr(TS_JOB_STATS, NULL);
+  dealloc_job_stats((JobStats*)stats_arg);
+}
+
+/* Returns the JobStats of the calling thread, or NULL without --stats. */
+static JobStats *get_job_stats(void) {
+  return (JobStats*)get_thread_ptr(TS_JOB_STATS);
+}
+
+/* Starts clk if stats is not NULL. */
+static void start_stage_clock(const JobStats *stats, StageClock *clk) {
+  clk->wall = stats ? get_wall_time() : 0;
+  clk->cpu = stats ? (double)clock() / CLOCKS_PER_SEC : 0;
+}
+
+/* If stats is not NULL, adds the time elapsed since clk to stage, and
+ * restarts clk for the next stage. Call it from the job thread only.
+ */
+static void add_stage_clock(JobStats *stats, uint8_t stage, StageClock *clk) {
+  if (stats) {
+    const double wall = get_wall_time();
+    const double cpu = (double)clock() / CLOCKS_PER_SEC;
+    stats->wall[stage] += wall - clk->wall;
+    stats->cpu[stage] += cpu - clk->cpu;
+    clk->wall = wall;
+    clk->cpu = cpu;
+  }
+}
+
+/* Adds wall time and zlib byte counts from any thread. in and out are
+ * added to the counters of stage STAGE_INFLATE or STAGE_DEFLATE.
+ */
+static void add_stage_wall(JobStats *stats, uint8_t stage, double wall,
+                           uint32_t in, uint32_t out) {
+#if USE_PTHREAD
+  pthread_mutex_lock(&stats->mutex);
+#endif
+  stats->wall[stage] += wall;
+  if (stage == STAGE_INFLATE) {
+    stats->inflate_in += in;
+    stats->inflate_out += out;
+  } else if (stage == STAGE_DEFLATE) {
+    stats->deflate_in += in;
+    stats->deflate_out += out;
+  }
+#if USE_PTHREAD
+  pthread_mutex_unlock(&stats->mutex);
+#endif
+}
+
+/* Adds the wall time elapsed since *t to *sum, and sets *t to now. */
+static INLINE void add_wall_lap(double *t, double *sum) {
+  const double now = get_wall_time();
+  *sum += now - *t;
+  *t = now;
+}
+
+/* Writes a nonnegative integer smaller than 1e18. */
+static void sink_write_count(Sink *sink, double count) {
+  const uint32_t hi = count / 1e9;
+  uint32_t lo = count - hi * 1e9;
+  char tmp[9];
+  int i;
+  if (hi == 0) {
+    sink_write_u32(sink, lo);
+  } else {
+    sink_write_u32(sink, hi);
+    for (i = 9; i > 0; lo /= 10) {
+      tmp[--i] = lo % 10 + '0';
+    }
+    sink_write(sink, tmp, 9);
+  }
+}
+
+/* Writes seconds as milliseconds, with 3 decimals. */
+static void sink_write_ms(Sink *sink, double seconds) {
+  double us = seconds * 1e6 + 0.5;
+  uint32_t frac;
+  char tmp[4];
+  if (us < 0) us = 0;
+  sink_write_count(sink, (double)(uint32_t)(us / 1000));
+  frac = us - (uint32_t)(us / 1000) * 1000.0;
+  tmp[0] = '.';
+  tmp[1] = frac / 100 + '0';
+  tmp[2] = frac / 10 % 10 + '0';
+  tmp[3] = frac % 10 + '0';
+  sink_write(sink, tmp, 4);
+}
+
+/* Writes s as a JSON string literal. */
+static void sink_write_json_str(Sink *sink, const char *s) {
+  char tmp[6];
+  sink_write(sink, "\"", 1);
+  for (; *s; ++s) {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      tmp[0] = '\\'; tmp[1] = c;
+      sink_write(sink, tmp, 2);
+    } else if (c < 32) {
+      memcpy(tmp, "\\u00", 4);
+      tmp[4] = "0123456789abcdef"[c >> 4];
+      tmp[5] = "0123456789abcdef"[c & 15];
+      sink_write(sink, tmp, 6);
+    } else {
+      sink_write(sink, s, 1);
+    }
+  }
+  sink_write(sink, "\"", 1);
+}
+
+/* Writes ` key=' or (if is_json) `,"key":'. */
+static void sink_write_stats_key(Sink *sink, const char *key,
+                                 xbool_t is_json) {
+  sink_write(sink, is_json ? ",\"" : " ", is_json ? 2 : 1);
+  sink_write(sink, key, strlen(key));
+  sink_write(sink, is_json ? "\":" : "=", is_json ? 2 : 1);
+}
+
+/* Writes the --stats report of the job converting inputfn to stderr, as
+ * `stats: ...' lines, or (if is_json) as a single line of JSON.
+ */
+static void write_job_stats(const JobStats *stats, const char *inputfn,
+                            xbool_t is_json) {
+  Sink out;
+  uint8_t stage;
+  nofile_sink(&out);
+  if (is_json) {
+    sink_write(&out, "{\"input\":", 9);
+    sink_write_json_str(&out, inputfn);
+    sink_write(&out, ",\"stages\":{", 11);
+  }
+  for (stage = 0; stage < STAGE_COUNT; ++stage) {
+    const char *name = stage_names[stage];
+    if (is_json) {
+      if (stage != 0) sink_write(&out, ",", 1);
+      sink_write_json_str(&out, name);
+      sink_write(&out, ":{\"wall_ms\":", 12);
+    } else {
+      sink_write(&out, "stats: stage=", 13);
+      sink_write(&out, name, strlen(name));
+      sink_write_stats_key(&out, "wall_ms", 0);
+    }
+    sink_write_ms(&out, stats->wall[stage]);
+    if (stage != STAGE_INFLATE && stage != STAGE_FILTER &&
+        stage != STAGE_DEFLATE) {
+      sink_write_stats_key(&out, "cpu_ms", is_json);
+      sink_write_ms(&out, stats->cpu[stage]);
+    }
+    sink_write(&out, is_json ? "}" : "\n", 1);
+  }
+  sink_write(&out, is_json ? "}" : "stats:", is_json ? 1 : 6);
+  sink_write_stats_key(&out, "inflate_in", is_json);
+  sink_write_count(&out, stats->inflate_in);
+  sink_write_stats_key(&out, "inflate_out", is_json);
+  sink_write_count(&out, stats->inflate_out);
+  sink_write_stats_key(&out, "deflate_in", is_json);
+  sink_write_count(&out, stats->deflate_in);
+  sink_write_stats_key(&out, "deflate_out", is_json);
+  sink_write_count(&out, stats->deflate_out);
+  sink_write_stats_key(&out, "branch", is_json);
+  if (!stats->branch) {
+    sink_write(&out, is_json ? "null" : "none", 4);
+  } else if (is_json) {
+    sink_write_json_str(&out, stats->branch);
+  } else {
+    sink_write(&out, stats->branch, strlen(stats->branch));
+  }
+  sink_write_stats_key(&out, "candidate", is_json);
+  sink_write_u32(&out, stats->candidate_idx);
+  sink_write_stats_key(&out, "candidate_count", is_json);
+  sink_write_u32(&out, stats->candidate_count);
+  sink_write_stats_key(&out, "peak_alloced", is_json);
+  sink_write_u32(&out, stats->peak_alloced);
+  sink_write_stats_key(&out, "degraded", is_json);
+  sink_write_u32(&out, stats->is_degraded);
+  sink_write(&out, is_json ? "}\n" : "\n", is_json ? 2 : 1);
+  /* A single fwrite, so that the reports of concurrent jobs don't mix. */
+  fwrite(out.data, 1, out.size, stderr);
+  free(out.data);
+}
+
+/* --- Deadline (--deadline-ms). */
+
+/* The wall time budget of a job. The job thread (and the threads of its
+ * run_tasks calls) finds it in the TS_DEADLINE slot. When the budget is at
+ * risk, the job switches to cheaper settings, and sets is_degraded.
+ */
+typedef struct Deadline {
+  double start;  /* get_wall_time() at the start of the job. */
+  double end;
+  /* Only ever changed from 0 to 1, possibly by multiple threads. */
+  volatile xbool_t is_degraded;
+} Deadline;
+
+/* Below this fraction of the budget left, convert_image_file switches to
+ * cheaper settings before compressing.
+ */
+#define DEADLINE_COMPRESS_LEFT 0.5
+/* Below this fraction of the budget left, compression continues with
+ * level 1.
+ */
+#define DEADLINE_DEFLATE_LEFT 0.25
+/* Exit code if a job has succeeded, but it has used cheaper settings. */
+#define EXIT_DEGRADED 3
+
+static void init_deadline(Deadline *deadline, uint32_t deadline_ms) {
+  deadline->start = get_wall_time();
+  deadline->end = deadline->start + deadline_ms * 1e-3;
+  deadline->is_degraded = 0;
+}
+
+/* Returns the Deadline of the calling thread, or NULL without
+ * --deadline-ms.
+ */
+static Deadline *get_deadline(void) {
+  return (Deadline*)get_thread_ptr(TS_DEADLINE);
+}
+
+/* Returns whether less than fraction left of the budget is left, and if
+ * so, marks the job degraded (the caller is expected to switch to
+ * cheaper settings). Returns 0 if deadline is NULL.
+ */
+static xbool_t is_deadline_at_risk(Deadline *deadline, double left) {
+  if (!deadline || get_wall_time() <
+      deadline->end - left * (deadline->end - deadline->start)) {
+    return 0;
+  }
+  deadline->is_degraded = 1;
+  return 1;
+}
+
 /* --- */
 
 /* color_type constants. Must be same as PNG. */
@@ -210,7 +1089,10 @@ typedef struct Image {
    * 0 if no palette.
    */
   uint32_t palette_size;
-  /* Bits per color component. At most 85, typically 1, 2, 4 or 8. */
+  /* Bits per color component. At most 85, typically 1, 2, 4 or 8. It's 16
+   * only for CT_GRAY and CT_RGB PNG input which can't be reduced to 8
+   * losslessly.
+   */
   uint8_t bpc;
   /* CT_... */
   uint8_t color_type;
@@ -222,8 +1104,10 @@ static void noalloc_image(Image *img) {
   img->data = img->palette = NULL;
 }
 
-/* Keeps the bytes in img->data and img->palette uninitialized. */
-static void alloc_image(
+/* Sets all fields of img except for data, palette and alloced. Returns
+ * the number of bytes needed in img->data.
+ */
+static uint32_t set_image_shape(
     Image *img, uint32_t width, uint32_t height, uint8_t bpc,
     uint8_t color_type, uint32_t palette_size, xbool_t do_alloc_bpc8) {
   const uint8_t cpp = (color_type == CT_RGB ? 3 : 1);
@@ -232,126 +1116,300 @@ static void alloc_image(
   const uint32_t rlen = bpc == 8 ? samples_per_row :
       bpc == 4 ? ((samples_per_row + 1) >> 1) :
       bpc == 2 ? ((samples_per_row + 3) >> 2) :
-      bpc == 1 ? ((samples_per_row + 7) >> 3) : 0;
+      bpc == 1 ? ((samples_per_row + 7) >> 3) :
+      bpc == 16 ? multiply_check(samples_per_row, 2) : 0;
   const uint32_t alloced =
-      multiply_check(do_alloc_bpc8 ? samples_per_row : rlen, height);
-  if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8) die("bad bpc");
+      multiply_check(do_alloc_bpc8 && bpc < 8 ? samples_per_row : rlen,
+                     height);
+  if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16) {
+    die("bad bpc");
+  }
   if (color_type != CT_RGB && color_type != CT_GRAY &&
       color_type != CT_INDEXED_RGB) die("bad color_type");
+  if (bpc == 16 && color_type == CT_INDEXED_RGB) die("bad bpc");
   add_check(multiply_check(rlen, 7), 1);  /* Early upper limit. */
-  img->width = width;
-  img->height = height;
-  img->rlen = rlen;
-  img->alloced = alloced;
-  img->bpc = bpc;
-  img->color_type = color_type;
-  img->cpp = cpp;
   if (color_type == CT_INDEXED_RGB) {
     if (palette_size == 0) die("missing palette");
     if (palette_size % 3 != 0) die("bad palette_size");
   } else {
     if (palette_size != 0) die("unexpected palette");
   }
+  img->width = width;
+  img->height = height;
+  img->rlen = rlen;
+  img->bpc = bpc;
+  img->color_type = color_type;
+  img->cpp = cpp;
   img->palette_size = palette_size;
-  img->data = (char*)xmalloc(alloced);
-  img->palette = (char*)xmalloc(palette_size);
+  return alloced;
 }
 
-static INLINE void dealloc_image(Image *img) {
-  free(img->data); img->data = NULL;
-  free(img->palette); img->palette = NULL;
-  img->palette_size = 0;
+#if !NO_REGTEST
+/* Keeps the bytes in img->data and img->palette uninitialized. */
+static void alloc_image(
+    Image *img, uint32_t width, uint32_t height, uint8_t bpc,
+    uint8_t color_type, uint32_t palette_size, xbool_t do_alloc_bpc8) {
+  img->alloced = set_image_shape(
+      img, width, height, bpc, color_type, palette_size, do_alloc_bpc8);
+  img->data = (char*)xmalloc(img->alloced);
+  img->palette = (char*)xmalloc(palette_size);
+}
+#endif
+
+/* Like alloc_image, but img must be initialized (at least noalloc_image),
+ * and it reuses img->data if it's large enough (e.g. in --serve).
+ */
+static void realloc_image(
+    Image *img, uint32_t width, uint32_t height, uint8_t bpc,
+    uint8_t color_type, uint32_t palette_size, xbool_t do_alloc_bpc8) {
+  const uint32_t alloced = set_image_shape(
+      img, width, height, bpc, color_type, palette_size, do_alloc_bpc8);
+  if (!img->data || img->alloced < alloced) {
+    free(img->data);
+    img->data = NULL;
+    img->data = (char*)xmalloc(alloced);
+    img->alloced = alloced;
+  }
+  /* Reuse the palette buffer. It's 3 * 256 bytes, so it fits any palette. */
+  if (!img->palette) img->palette = (char*)xmalloc(3 * 256);
+}
+
+static INLINE void dealloc_image(Image *img) {
+  free(img->data); img->data = NULL;
+  free(img->palette); img->palette = NULL;
+  img->palette_size = 0;
 }
 
 static void convert_to_bpc(Image *img, uint8_t to_bpc);
+static void unpack_row_to_bpc8(char *op, const char *p, uint32_t spr,
+                               uint8_t bpc, xbool_t is_indexed);
 
-/* --- PNM */
+/* --- Image statistics. */
 
-#if !NO_PNM
-static void fwrite_dec32(FILE *f, uint32_t u) {
-  char tmp[9], *p = tmp;
-  do {
-    const uint32_t m = u % 10;
-    u /= 10;
-    *p++ = m + '0';
-  } while (u != 0);
-  while (p != tmp) {
-    const char c = *--p;
-    putc(c, f);
+/* Properties of an image with bpc == 8 which optimize_for_png needs. The
+ * image readers collect them row by row (while the row is still in the
+ * cache), so that they don't need extra passes over the image data.
+ */
+typedef struct ImageStats {
+  /* Set by the image reader if it has added all rows of the image.
+   * Otherwise finish_image_stats scans the image data.
+   */
+  xbool_t is_complete;
+  /* Same as is_gray_ok(img). Computed by finish_image_stats. */
+  xbool_t is_gray_ok;
+  /* Same as get_min_rgb_bpc(img). Computed by finish_image_stats. */
+  uint8_t min_rgb_bpc;
+  /* Same as get_color_count(img). Computed by finish_image_stats. */
+  uint16_t color_count;
+  /* used[v] is nonzero iff byte v is in the image data. Not updated
+   * anymore for CT_RGB if is_rgb_bpc8.
+   */
+  unsigned char used[256];
+  /* CT_RGB only: some byte in used needs bpc=8 (e.g. it's not 0x11 * k). */
+  xbool_t is_rgb_bpc8;
+  /* An open addressing hashtable of RGB colors. See
+   * build_palette_from_rgb8 for more.
+   */
+  uint32_t hashtable[1409];
+} ImageStats;
+
+/* read_pnm_stream reads and adds this many bytes (rounded up to whole
+ * rows) at a time.
+ */
+#define IMAGE_STATS_CHUNK_SIZE 32768
+
+static void init_image_stats(ImageStats *st) {
+  st->is_complete = 0;
+  st->is_gray_ok = 1;
+  st->min_rgb_bpc = 8;
+  st->color_count = 0;
+  st->is_rgb_bpc8 = 0;
+  memset(st->used, '\0', sizeof(st->used));
+  /* All slots in the hashtable are empty (0). */
+  memset(st->hashtable, '\0', sizeof(st->hashtable));
+}
+
+/* Adds the RGB colors in pu[:puend - pu] to st->hashtable, and increments
+ * st->color_count for each new color. Stops after 257 colors.
+ */
+static void add_rgb_colors(ImageStats *st, const unsigned char *pu,
+                           const unsigned char *puend) {
+  uint32_t *hashtable = st->hashtable, hk, hik, hv;
+  uint16_t color_count = st->color_count;
+  for (; pu != puend; pu += 3) {
+    uint32_t v = (uint32_t)pu[0] << 16 | pu[1] << 8 | pu[2];
+    hk = v % 1409;
+    hik = 1 + v % 1408;
+    v |= (uint32_t)1 << 24;
+    for (;; hk -= hk >= hik ? hik : hik - 1409) {
+      hv = hashtable[hk];
+      if (hv == 0) {  /* Free slot. */
+        /* Without stopping here, the hashtable would become full, and
+         * we'd get an infinite loop.
+         */
+        if (++color_count > 256) goto done;
+        hashtable[hk] = v;
+        break;
+      } else if (hv == v) {  /* Found color v. */
+        break;
+      }
+    }
   }
+ done:
+  st->color_count = color_count;
 }
 
-static void write_pnm(const char *filename, const Image *img) {
+/* Adds image data p[:size] (whole pixels of an image with bpc == 8) to
+ * st.
+ */
+static void add_image_stats_rows(ImageStats *st, uint8_t color_type,
+                                 const char *p, uint32_t size) {
+  const unsigned char *pu = (const unsigned char*)p, *puend = pu + size;
+  unsigned char *used = st->used;
+  if (color_type == CT_RGB) {
+    if (st->is_gray_ok) {
+      for (; pu != puend && pu[0] == pu[1] && pu[0] == pu[2]; pu += 3) {}
+      if (pu != puend) st->is_gray_ok = 0;
+      pu = (const unsigned char*)p;
+    }
+    if (st->color_count <= 256) add_rgb_colors(st, pu, puend);
+    if (st->is_rgb_bpc8) return;  /* Only min_rgb_bpc needs used. */
+  }
+  for (; pu != puend; used[*pu++] = 1) {}
+  if (color_type == CT_RGB) {
+    uint32_t v;
+    for (v = 0; v < 256 && (used[v] == 0 || (v >> 4) == (v & 15)); ++v) {}
+    st->is_rgb_bpc8 = v < 256;
+  }
+}
+
+/* Computes the results in st for img. If the image reader hasn't added
+ * all rows to st, it scans the image data first.
+ *
+ * Only works if img->bpc == 8.
+ */
+static void finish_image_stats(ImageStats *st, const Image *img) {
+  const uint8_t color_type = img->color_type;
+  const unsigned char *pu;
+  unsigned char used[256];
+  uint8_t bpc1 = 0;
+  uint32_t v;
+  if (img->bpc != 8) die("ASSERT: finish_image_stats needs bpc=8");
+  if (!st->is_complete) {
+    init_image_stats(st);
+    add_image_stats_rows(st, color_type, img->data, img->rlen * img->height);
+    st->is_complete = 1;
+  }
+  pu = st->used;
+  if (color_type == CT_GRAY) {
+    st->is_gray_ok = 1;
+    for (st->color_count = v = 0; v < 256; st->color_count += pu[v++]) {}
+  } else if (color_type == CT_INDEXED_RGB) {
+    const char *p = img->palette, *pend = p + img->palette_size;
+    char palette[3 * 256], *pp = palette;
+    st->is_gray_ok = 1;
+    memset(used, '\0', sizeof(used));
+    for (; p != pend; p += 3) {
+      /* Like is_gray_ok, this also checks the unused palette entries. */
+      if (p[0] != p[1] || p[0] != p[2]) st->is_gray_ok = 0;
+      if (*pu++ != 0) {  /* This palette entry is used. */
+        used[(unsigned char)p[0]] = 1;
+        used[(unsigned char)p[1]] = 1;
+        used[(unsigned char)p[2]] = 1;
+        *pp++ = p[0]; *pp++ = p[1]; *pp++ = p[2];
+      }
+    }
+    st->color_count = 0;
+    memset(st->hashtable, '\0', sizeof(st->hashtable));
+    add_rgb_colors(st, (const unsigned char*)palette,
+                   (const unsigned char*)pp);
+    pu = used;
+  }
+  for (v = 0; v < 256; ++v) {
+    if (pu[v] != 0) {
+      if ((v >> 4) != (v & 15)) { bpc1 = 7; break; }
+      if ((((v >> 2) ^ v) & 3) != 0) bpc1 |= 3;
+      if ((((v >> 1) ^ v) & 1) != 0) bpc1 |= 1;
+    }
+  }
+  st->min_rgb_bpc = bpc1 + 1;
+}
+
+/* --- PNM */
+
+#if !NO_PNM
+/* Writes img as PBM (Gray1), PGM (Gray8) or PPM (Indexed8 or RGB8) to sink.
+ */
+static void write_pnm_to_sink(Sink *sink, const Image *img) {
   const uint32_t width = img->width;
   uint32_t height = img->height;
   const char *p = img->data, *pend = p + img->rlen * height;
-  FILE *f;
+  char buf[8192], *q = buf;
   if (img->bpc == 1 && img->color_type == CT_GRAY) {  /* PBM. */
-    if (!(f = fopen(filename, "wb"))) die("error writing pnm");
-    fwrite("P4 ", 1, 3, f);
-    fwrite_dec32(f, width);
-    putc(' ', f);
-    fwrite_dec32(f, height);
-    putc('\n', f);
-    if ((width & 7) == 0) {
-      while (p != pend) {
-        const char c = ~*p++;
-        putc(c, f);
-      }
-    } else {
-      const uint32_t rlen1 = img->rlen - 1;
-      const char right_and_byte = (uint16_t)0x7f00 >> (width & 7);
-      for (; height > 0; --height) {
-        for (pend = p + rlen1; p != pend;) {
-          const char c = ~*p++;
-          putc(c, f);
-        }
-        {
-          const char c = ~*p++ & right_and_byte;
-          putc(c, f);
+    const uint32_t rlen = img->rlen;
+    const char right_and_byte = (uint16_t)0x7f00 >> (width & 7);
+    sink_write(sink, "P4 ", 3);
+    sink_write_u32(sink, width);
+    sink_write(sink, " ", 1);
+    sink_write_u32(sink, height);
+    sink_write(sink, "\n", 1);
+    for (; height > 0; --height) {
+      for (pend = p + rlen; p != pend;) {
+        if (q == buf + sizeof(buf)) {
+          sink_write(sink, buf, q - buf);
+          q = buf;
         }
+        *q++ = ~*p++;
       }
+      if ((width & 7) != 0) q[-1] &= right_and_byte;
     }
   } else {
-    if (img->bpc != 8) die("need bpc=8 for writing pnm");
+    /* PNM with maxval 65535 has the same big endian samples as PNG. */
+    if (img->bpc != 8 && img->bpc != 16) die("need bpc=8 for writing pnm");
     if (img->cpp != 1 && img->cpp != 3) die("need cpp=1 or =3 for writing pnm");
-    if (!(f = fopen(filename, "wb"))) die("error writing pnm");
-    putc('P', f);
-    {
-      const char c = img->color_type == CT_GRAY ? '5' : '6';
-      putc(c, f);
-    }
-    putc(' ', f);
-    fwrite_dec32(f, width);
-    putc(' ', f);
-    fwrite_dec32(f, height);
-    fwrite(" 255\n", 1, 5, f);
     if (pend < p) die("image too large");
+    sink_write(sink, img->color_type == CT_GRAY ? "P5 " : "P6 ", 3);
+    sink_write_u32(sink, width);
+    sink_write(sink, " ", 1);
+    sink_write_u32(sink, height);
+    if (img->bpc == 16) {
+      sink_write(sink, " 65535\n", 7);
+    } else {
+      sink_write(sink, " 255\n", 5);
+    }
     if (img->color_type == CT_INDEXED_RGB) {
       const char *palette = img->palette;
-      while (p != pend) {
-        const char *cp = palette + 3 * *(unsigned char*)p++;
-        char c = *cp++;
-        putc(c, f);
-        c = *cp++; putc(c, f);
-        c = *cp; putc(c, f);
+      for (; p != pend; ++p) {
+        const char *cp = palette + 3 * *(const unsigned char*)p;
+        if (q > buf + sizeof(buf) - 3) {
+          sink_write(sink, buf, q - buf);
+          q = buf;
+        }
+        *q++ = cp[0]; *q++ = cp[1]; *q++ = cp[2];
       }
     } else {
-      fwrite(p, 1, pend - p, f);
+      sink_write(sink, p, pend - p);
     }
   }
-  fflush(f);
-  if (ferror(f)) die("error writing pnm");
-  fclose(f);
+  sink_write(sink, buf, q - buf);
+}
+
+#if !NO_REGTEST
+static void write_pnm(const char *filename, const Image *img) {
+  Sink sink;
+  open_file_sink(&sink, filename, "error writing pnm");
+  write_pnm_to_sink(&sink, img);
+  close_file_sink(&sink, "error writing pnm");
 }
+#endif
 
 /* Returns the following character (by getc(f)). */
-static int parse_u32_decimal(FILE *f, int c, uint32_t *result) {
+static int parse_u32_decimal(Source *src, int c, uint32_t *result) {
   uint32_t r;
   if ((c -= '0') + 0U > 9U) die("decimal expected");
   r = c;
   for (;;) {
-    if ((c = getc(f)) < 0 || (c - '0') + 0U > 9U) {
+    if ((c = source_getc(src)) < 0 || (c - '0') + 0U > 9U) {
       *result = r;
       return c;
     }
@@ -363,29 +1421,50 @@ static int parse_u32_decimal(FILE *f, int c, uint32_t *result) {
  *
  * Doesn't support all features of PNM (e.g. ASCII, comments, multiple
  * separator whitespace bytes, and maxval != 255).
+ *
+ * If stats is not NULL, adds the image data to it.
  */
-static void read_pnm_stream(FILE *f, Image *img, xbool_t force_bpc8) {
+static void read_pnm_stream(Source *src, Image *img, xbool_t force_bpc8,
+                            ImageStats *stats) {
   const uint32_t palette_size = 0;
   uint32_t width, height, maxval;
   int c, st;
   uint32_t rlen_height;
-  if ((c = getc(f)) != 'P' ||
-      ((st = getc(f)) != '4' && st != '5' && st != '6')
+  if ((c = source_getc(src)) != 'P' ||
+      ((st = source_getc(src)) != '4' && st != '5' && st != '6')
      ) die("bad signature in pnm");
-  if ((c = getc(f)) != ' ' && c != '\n' && c != '\r' && c != '\t'
+  if ((c = source_getc(src)) != ' ' && c != '\n' && c != '\r' && c != '\t'
      ) die("whitespace expected in pnm");
-  c = parse_u32_decimal(f, getc(f), &width);
+  c = parse_u32_decimal(src, source_getc(src), &width);
   if (c != ' ' && c != '\n' && c != '\r' && c != '\t'
      ) die("whitespace expected in pnm");
-  c = parse_u32_decimal(f, getc(f), &height);
+  c = parse_u32_decimal(src, source_getc(src), &height);
   if (c != ' ' && c != '\n' && c != '\r' && c != '\t'
      ) die("whitespace expected in pnm");
-  if (st == '4') {
+  if (st == '4' && force_bpc8) {
+    /* Read the packed rows to the end of img->data, and unpack them to
+     * bpc=8 in place, without a separate convert_to_bpc pass.
+     */
+    const uint32_t prlen = (width >> 3) + ((width & 7) != 0);
+    char *op, *p, *pend;
+    realloc_image(img, width, height, 8, CT_GRAY, palette_size, force_bpc8);
+    rlen_height = prlen * height;
+    op = img->data;
+    p = op + (img->rlen * height - rlen_height);
+    if (rlen_height != source_read(src, p, rlen_height)
+       ) die("eof in pnm data");
+    for (; height > 0; --height, op += img->rlen) {
+      for (pend = p + prlen; p != pend; *p++ ^= -1) {}  /* Invert. */
+      unpack_row_to_bpc8(op, p - prlen, width, 1, 0);
+      if (stats) add_image_stats_rows(stats, CT_GRAY, op, img->rlen);
+    }
+    if (stats) stats->is_complete = 1;
+  } else if (st == '4') {
     char *p, *pend;
-    alloc_image(img, width, height, 1, CT_GRAY, palette_size, force_bpc8);
+    realloc_image(img, width, height, 1, CT_GRAY, palette_size, force_bpc8);
     rlen_height = img->rlen * height;
     p = img->data; pend = p + rlen_height;
-    if (rlen_height != fread(p, 1, rlen_height, f)
+    if (rlen_height != source_read(src, p, rlen_height)
        ) die("eof in pnm data");
     if ((width & 7) == 0) {
       for (; p != pend; *p++ ^= -1) {}  /* Invert in place. */
@@ -399,15 +1478,29 @@ static void read_pnm_stream(FILE *f, Image *img, xbool_t force_bpc8) {
       }
     }
   } else {
-    c = parse_u32_decimal(f, getc(f), &maxval);
+    c = parse_u32_decimal(src, source_getc(src), &maxval);
     if (c != ' ' && c != '\n' && c != '\r' && c != '\t'
        ) die("whitespace expected in pnm");
     if (maxval != 255) die("not supported pnm maxval");
-    alloc_image(img, width, height, 8, st == '5' ? CT_GRAY : CT_RGB,
+    realloc_image(img, width, height, 8, st == '5' ? CT_GRAY : CT_RGB,
                 palette_size, force_bpc8);
     rlen_height = img->rlen * height;
-    if (rlen_height != fread(img->data, 1, rlen_height, f)
-       ) die("eof in pnm data");
+    if (stats) {
+      /* Read a few rows at a time, and add them while they are hot. */
+      const uint32_t chunk_rows = IMAGE_STATS_CHUNK_SIZE / img->rlen + 1;
+      char *p = img->data;
+      uint32_t rows, size;
+      for (; height > 0; height -= rows, p += size) {
+        rows = chunk_rows < height ? chunk_rows : height;
+        size = rows * img->rlen;
+        if (size != source_read(src, p, size)) die("eof in pnm data");
+        add_image_stats_rows(stats, img->color_type, p, size);
+      }
+      stats->is_complete = 1;
+    } else {
+      if (rlen_height != source_read(src, img->data, rlen_height)
+         ) die("eof in pnm data");
+    }
   }
   if (force_bpc8) convert_to_bpc(img, 8);
 }
@@ -418,6 +1511,7 @@ static void read_pnm_stream(FILE *f, Image *img, xbool_t force_bpc8) {
 #define PNG_COMPRESSION_DEFAULT 0
 #define PNG_FILTER_DEFAULT 0
 #define PNG_INTERLACE_NONE 0
+#define PNG_INTERLACE_ADAM7 1
 
 /* PNG predictors. */
 #define PNG_PR_NONE 0
@@ -435,6 +1529,16 @@ static void read_pnm_stream(FILE *f, Image *img, xbool_t force_bpc8) {
 #define PM_PNGAUTO 15
 #define PM_SMART 25  /* Default of sam2p. */
 
+/* Flate strategies (-j:strategy:...). The first 4 are the same as the zlib
+ * strategies.
+ */
+#define FS_DEFAULT 0  /* Z_DEFAULT_STRATEGY. */
+#define FS_FILTERED 1  /* Z_FILTERED. */
+#define FS_HUFFMAN 2  /* Z_HUFFMAN_ONLY. */
+#define FS_RLE 3  /* Z_RLE. */
+#define FS_TUNED 4  /* FS_DEFAULT with memLevel=9 and longer matches. */
+#define FS_SEARCH 5  /* Try all of the above, keep the smallest. */
+
 uint32_t get_u32be(char *p) {
   register unsigned char *pu = (unsigned char *)p;
   register uint32_t result = *pu++;
@@ -494,380 +1598,2068 @@ static void* xzalloc(void *opaque, uInt items, uInt size) {
   return calloc(items, size);
 }
 
-/* --- */
+static void* arena_zalloc(void *opaque, uInt items, uInt size) {
+  return arena_alloc((Arena*)opaque, multiply_check(items, size));
+}
 
-/* Returns the payload size of the IDAT chunk.
- * flate_level: 0 is uncompressed, 1..9 is compressed, 9 is maximum compression
- *   (slow, but produces slow output).
+static void arena_zfree(void *opaque, void *ptr) {
+  arena_free((Arena*)opaque, ptr);
+}
+
+/* zlib streams and scratch buffers kept between images (see --serve). The
+ * streams are reused by deflateReset and inflateReset, to avoid the
+ * allocation and initialization costs. In steady state (with images of
+ * similar size), converting an image doesn't call malloc for them. Each
+ * --batch job and imgdataopt_optimize call has its own, which also frees
+ * them after a die().
  */
-static uint32_t write_png_img_data(
-    FILE *f, const char *img_data, register uint32_t rlen, uint32_t height,
-    uint8_t predictor_mode, uint8_t bpc, uint8_t cpp, uint8_t flate_level) {
-  const uint32_t rlen1 = rlen + 1;
-  char obuf[8192];
-  uint32_t crc32v = 900662814UL;  /* zlib.crc32("IDAT"). */
-  z_stream zs;
-  int zr;
-  uInt zoutsize;
-  /* If more than 24 bits, then rowsum would overflow. */
-  if (rlen >> 24) die("image rlen too large");
-  zs.zalloc = xzalloc;  /* calloc to pacify valgrind. */
-  zs.zfree = NULL;
-  zs.opaque = NULL;
-  /* !! Preallocate buffers in 1 big chunk, see deflateInit in sam2p. Everywhere. */
-  if (deflateInit(&zs, flate_level)) die("error in deflateInit");
-  fwrite("\0\0\0\0IDAT", 1, 8, f);
-  zs.next_in = (Bytef*)img_data;
-  zs.avail_in = 0;
-  if (predictor_mode == PM_NONE) {
-    const uint32_t usize = multiply_check(rlen, height);
-    zs.avail_in = usize;  /* TODO(pts): Check for overflow. */
-    /* Z_FINISH below will do all the compression. */
-#if !NO_PMTIFF
-  } else if (predictor_mode == PM_TIFF2) {
-    /* Implemented in TIFFPredictor2::vi_write in encoder.cpp in sam2p. */
-    const uint8_t bpx = (cpp - 1) * bpc;
-    char *tmp = (char*)xmalloc(rlen);
-    for (; height > 0; img_data += rlen, --height) {
-      uint32_t h = 0;
-      char *op = tmp;
-      const char *p = img_data, *pend = p + rlen;
-      unsigned char d, o;
-      if (bpc == 1) {
-        while (p != pend) {
-          const unsigned char i = *p++;
-          d = (i >> 7); o  = ((d - (h >> bpx)) & 1) << 7; h = (h << 1) | d;
-          d = (i >> 6); o |= ((d - (h >> bpx)) & 1) << 6; h = (h << 1) | (d & 1);
-          d = (i >> 5); o |= ((d - (h >> bpx)) & 1) << 5; h = (h << 1) | (d & 1);
-          d = (i >> 4); o |= ((d - (h >> bpx)) & 1) << 4; h = (h << 1) | (d & 1);
-          d = (i >> 3); o |= ((d - (h >> bpx)) & 1) << 3; h = (h << 1) | (d & 1);
-          d = (i >> 2); o |= ((d - (h >> bpx)) & 1) << 2; h = (h << 1) | (d & 1);
-          d = (i >> 1); o |= ((d - (h >> bpx)) & 1) << 1; h = (h << 1) | (d & 1);
-          d = (i     ); o |= ((d - (h >> bpx)) & 1)     ; h = (h << 1) | (d & 1);
-          *op++ = o;
-        }
-      } else if (bpc == 2) {
-        while (p != pend) {
-          const unsigned char i = *p++;
-          d = (i >> 6); o  = ((d - (h >> bpx)) & 3) << 6; h = (h << 2) | d;
-          d = (i >> 4); o |= ((d - (h >> bpx)) & 3) << 4; h = (h << 2) | (d & 3);
-          d = (i >> 2); o |= ((d - (h >> bpx)) & 3) << 2; h = (h << 2) | (d & 3);
-          d = (i     ); o |= ((d - (h >> bpx)) & 3)     ; h = (h << 2) | (d & 3);
-          *op++ = o;
-        }
-      } else if (bpc == 4) {
-        while (p != pend) {
-          const unsigned char i = *p++;
-          d = (i >> 4); o  = ((d - (h >> bpx)) & 15) << 4; h = (h << 4) | d;
-          d = (i     ); o |= ((d - (h >> bpx)) & 15)     ; h = (h << 4) | (d & 15);
-          *op++ = o;
-        }
-      } else if (bpc == 8) {
-        while (p != pend) {
-          const unsigned char i = *p++;
-          *op++ = ((i - ((h  >> bpx)))/* & 255*/); h = (h << 8) | i;
-        }
-      } else {
-        die("ASSERT: bad bpc for writing PM_TIFF2");
-      }
-      zs.next_in = (Bytef*)tmp;
-      zs.avail_in = rlen;
-      do {
-        zs.next_out = (Bytef*)obuf;
-        zs.avail_out = sizeof(obuf);
-        if (deflate(&zs, Z_NO_FLUSH) != Z_OK) die("deflate failed");
-        zoutsize = zs.next_out - (Bytef*)obuf;
-        crc32v = crc32(crc32v, (const Bytef*)obuf, zoutsize);
-        fwrite(obuf, 1, zoutsize, f);
-      } while (zs.avail_out == 0);
-      if (zs.avail_in != 0) die("deflate has not processed all input");
-    }
-    free(tmp);
-#endif
-  } else if (predictor_mode == PM_PNGAUTO) {
-    /* 1 for the predictor identifier in the row, 6 for the 5 predictors + copy
-     * of the previous row.
-     */
-    char *tmp = (char*)xmalloc(add_check(multiply_check(rlen, 6), 1));
-    const int32_t left_delta = -((bpc * cpp + 7) >> 3);
-    /* Since 1 <= bpc * cpp <= 24, so -3 <= left_delta <= -1. */
-    memset(tmp + 1 + rlen * 5, '\0', rlen);  /* Previous row. */
-    for (; height > 0; img_data += rlen, --height) {
-      char *p, *pend, *best_predicted;
-      uint32_t best_rowsum, rowsum, pi;
-      pend = (p = tmp + 1) + rlen;
-      memcpy(p, img_data, rlen);  /* PNG_PR_NONE */
-      /* 1, 2 or 3 iterations of this loop. */
-      for (; p != pend && tmp - p >= left_delta; ++p) {
-        const unsigned char v = *p, vpr = p[rlen * 5];  /* Sign is important. */
-        p += rlen; *p = v;  /* PNG_PR_SUB */
-        p += rlen; *p = v - vpr;  /* PNG_PR_UP */
-        p += rlen; *p = v - (vpr >> 1);  /* PNG_PR_AVERAGE */
-        /* After the -, same as paeth_predictor(0, vpr, 0); .*/
-        p += rlen; *p = v - vpr;  /* PNG_PR_PAETH */
-        p -= rlen * 4;
-      }
-      for (; p != pend; ++p) {
-        const unsigned char v = *p, vpr = p[rlen * 5];  /* Sign is important. */
-        const unsigned char vpc = p[left_delta];  /* Sign is important. */
-        p += rlen; *p = v - vpc;  /* PNG_PR_SUB */
-        p += rlen; *p = v - vpr;  /* PNG_PR_UP */
-        /* It's important to use tmp (not tmp) here. */
-        p += rlen; *p = v - ((vpc + vpr) >> 1);  /* PNG_PR_AVERAGE */
-        /* It's important to use tmp (not tmp) here. */
-        p += rlen; *p = v - paeth_predictor(vpc, vpr, ((unsigned char*)p)[(int32_t)rlen + left_delta]);  /* PNG_PR_PAETH */
-        p -= rlen * 4;
-      }
-
-      best_predicted = tmp + 1;
-      /* Copy the current row as the previous row for the next iteration. */
-      memcpy(p + rlen * 4, best_predicted, rlen);
-      for (best_rowsum = 0, p = best_predicted; p != pend; ++p) {
-        const signed char c = *p;  /* Sign is important. */
-        best_rowsum += (signed char)c < 0 ? (c * -1) : c;
-      }
-      for (pi = 1; pi <= 4; ++pi) {
-        for (pend = p + rlen, rowsum = 0; p != pend; ++p) {
-          const signed char c = *p;  /* Sign is important. */
-          rowsum += (signed char)c < 0 ? (c * -1) : c;
-        }
-        if (rowsum < best_rowsum) {
-          best_rowsum = rowsum;
-          best_predicted = p - rlen;
-        }
-      }
+typedef struct ZCache {
+  z_stream deflate_zs;
+  xbool_t has_deflate;
+  int deflate_level;
+  int deflate_window_bits;
+  int deflate_strategy;
+  z_stream inflate_zs;
+  xbool_t has_inflate;
+  /* The zlib allocations of the streams above. Separate from scratch,
+   * because it can't be reset or grown while the streams are in use.
+   */
+  Arena zlib_arena;
+  /* Per-image buffers (see scratch_alloc), reset between images. */
+  Arena scratch;
+} ZCache;
 
-      --best_predicted;
-      best_predicted[0] = (best_predicted - tmp) / rlen;
-      /* DEBUGF("best_predictor=%d min_weight=%d\n", *best_predicted, best_rowsum); */
-      zs.next_in = (Bytef*)best_predicted;
-      zs.avail_in = rlen1;
-      do {
-        zs.next_out = (Bytef*)obuf;
-        zs.avail_out = sizeof(obuf);
-        if (deflate(&zs, Z_NO_FLUSH) != Z_OK) die("deflate failed");
-        zoutsize = zs.next_out - (Bytef*)obuf;
-        crc32v = crc32(crc32v, (const Bytef*)obuf, zoutsize);
-        fwrite(obuf, 1, zoutsize, f);
-      } while (zs.avail_out == 0);
-      if (zs.avail_in != 0) die("deflate has not processed all input");
-    }
-    free(tmp);
-  } else if (predictor_mode == PM_PNGNONE) {
-    for (; height > 0; img_data += rlen, --height) {
-      char predictor = PNG_PR_NONE;
-      zs.next_in = (Bytef*)&predictor;
-      zs.avail_in = 1;
-      for (;;) {  /* Write the predictor; write rlen bytes from img_data. */
-        do {
-          zs.next_out = (Bytef*)obuf;
-          zs.avail_out = sizeof(obuf);
-          if (deflate(&zs, Z_NO_FLUSH) != Z_OK) die("deflate failed");
-          zoutsize = zs.next_out - (Bytef*)obuf;
-          crc32v = crc32(crc32v, (const Bytef*)obuf, zoutsize);
-          fwrite(obuf, 1, zoutsize, f);
-        } while (zs.avail_out == 0);
-        if (zs.avail_in != 0) die("deflate has not processed all input");
-        if (predictor != PNG_PR_NONE || rlen == 0) break;
-        ++predictor;
-        zs.next_in = (Bytef*)img_data;
-        zs.avail_in = rlen;  /* TODO(pts): Check for overflow. */
-      }
-    }
-  } else {
-    die("unknown predictor");
-  }
-  do {  /* Flush deflate output. */
-    zs.next_out = (Bytef*)obuf;
-    zs.avail_out = sizeof(obuf);
-    if ((zr = deflate(&zs, Z_FINISH)) != Z_STREAM_END && zr != Z_OK) {
-      die("deflate failed");
-    }
-    zoutsize = zs.next_out - (Bytef*)obuf;
-    crc32v = crc32(crc32v, (const Bytef*)obuf, zoutsize);
-    fwrite(obuf, 1, zoutsize, f);
-  } while (zr == Z_OK && zs.avail_out == 0);
-  if (zs.avail_in != 0) die("deflate has not processed all input");
-  deflateEnd(&zs);
-  /* No need to append zs.adler, deflate() does it for us. */
-  put_u32be(obuf, crc32v);
-  fwrite(obuf, 1, 4, f);
-  return zs.total_out;
+/* Ends the zlib streams, and releases their memory. */
+static void end_zcache_streams(ZCache *zcache) {
+  if (zcache->has_deflate) deflateEnd(&zcache->deflate_zs);
+  if (zcache->has_inflate) inflateEnd(&zcache->inflate_zs);
+  zcache->has_deflate = zcache->has_inflate = 0;
+  reset_arena(&zcache->zlib_arena);
 }
 
-static const char kPngHeader[16 + 1] = "\x89PNG\r\n\x1a\n\0\0\0\rIHDR";
+/* Enough for the deflate stream (windowBits=15, memLevel=8) and the inflate
+ * stream (windowBits=15): (1 << 17) + (1 << 17) + (1 << 15) bytes, and
+ * less than 16 KiB for the states.
+ */
+#define ZCACHE_ZLIB_ARENA_SIZE ((1 << 17) + (1 << 17) + (1 << 15) + (1 << 14))
 
-static void write_png_header(
-    FILE *f,
-    uint32_t width, uint32_t height, uint8_t bpc, uint8_t color_type,
-    uint8_t filter) {
-  char buf[33], *p = buf;
-  memcpy(p, kPngHeader, 16); p += 16;
-  p = put_u32be(p, width);
-  p = put_u32be(p, height);
-  *p++ = bpc;
-  *p++ = color_type;
-  *p++ = PNG_COMPRESSION_DEFAULT;
-  *p++ = filter;
-  *p++ = PNG_INTERLACE_NONE;
-  put_u32be(p, crc32(0, (const Bytef*)(buf + 12), 17));
-  fwrite(buf, 1, 33, f);
+/* Doesn't allocate memory, the first stream sizes zlib_arena. */
+static void init_zcache(ZCache *zcache) {
+  zcache->has_deflate = zcache->has_inflate = 0;
+  init_arena(&zcache->zlib_arena);
+  init_arena(&zcache->scratch);
 }
 
-/* size is the number of bytes in the palette, typically 3 * color_count.
- * data[:size] looks like RGBRGBRGB...
- */
-static void write_png_palette(
-    FILE *f, const char *data, uint32_t size) {
-  const uint32_t crc32v_plte = 1269336405UL;  /* crc32(0, "PLTE", 4). */
-  char buf[8];
-  put_u32be(buf, size);
-  memcpy(buf + 4, "PLTE", 4);
-  fwrite(buf, 1, 8, f);
-  fwrite(data, 1, size, f);
-  put_u32be(buf, crc32(crc32v_plte, (const Bytef*)data, size));
-  fwrite(buf, 1, 4, f);
+static void dealloc_zcache(ZCache *zcache) {
+  end_zcache_streams(zcache);
+  dealloc_arena(&zcache->zlib_arena);
+  dealloc_arena(&zcache->scratch);
 }
 
-static void write_png_end(FILE *f) {
-  fwrite("\0\0\0\0IEND\xae""B`\x82", 1, 12, f);
+/* Allocates a per-image buffer of size bytes, from the scratch arena of
+ * the ZCache of the calling thread (if any). Free it with scratch_free in
+ * the same thread, in reverse allocation order.
+ */
+static void *scratch_alloc(uint32_t size) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  void *p = zcache ? arena_alloc(&zcache->scratch, size) : malloc(size);
+  if (!p) die("out of memory");
+  return p;
 }
 
-/* tmp is preallocated to rlen * 6 + 1 bytes.
- * If is_extended is true, that can produce an invalid PNG (e.g. with PM_NONE).
+/* Grows the scratch arena of the calling thread (if any) to at least size
+ * bytes, if it's empty. Size it with get_arena_alloc_size.
  */
-static void write_png(const char *filename, const Image *img,
-                      xbool_t is_extended, uint8_t predictor_mode,
-                      uint8_t flate_level) {
-  const uint8_t bpc = img->bpc;
-  const uint8_t color_type = img->color_type;
-  uint8_t filter;
-  xbool_t do_palette = color_type == CT_INDEXED_RGB;
-  const uint32_t idat_size_ofs = do_palette ?
-      add_check(45, img->palette_size) : 33;
-  uint32_t idat_size;
-  FILE *f;
-  char buf[4];
+static void reserve_scratch(uint32_t size) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (zcache) reserve_arena(&zcache->scratch, size);
+}
 
-  if (!is_extended && color_type == CT_RGB && bpc != 8) {
-    die("rgb png must have bpc=8");
-  }
-  if (predictor_mode < PM_NONE) {
-    predictor_mode = PM_NONE;
-  } else if (predictor_mode == PM_SMART) {
-    predictor_mode =
-        /* This condition comes from the is_predictor_recommended = ...
-         * assignment in sam2p 0.49.4, which comes from the do_filter = ...
-         * assignment in png_write_IHDR() in pngwutil.c of libpng-1.2.15 .
-         */
-        bpc == 8 && (color_type == CT_RGB || color_type == CT_GRAY) ?
-        PM_PNGAUTO : PM_NONE;
-  }
-  if (!is_extended && predictor_mode != PM_PNGAUTO) {
-    predictor_mode = PM_PNGNONE;
+static void scratch_free(void *p) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (zcache) {
+    arena_free(&zcache->scratch, p);
+  } else {
+    free(p);
   }
-  /* Only PNG_FILTER_DEFAULT (0) is standard PNG. 1 is PM_NONE, 2 is PM_TIFF2.
-   */
-  filter = predictor_mode < PM_PNGNONE ? predictor_mode : PNG_FILTER_DEFAULT;
+}
 
-  if (!(f = fopen(filename, "wb"))) die("error writing png");
-  write_png_header(f, img->width, img->height, bpc, color_type, filter);
-  if (do_palette) {
-    write_png_palette(f, img->palette, img->palette_size);
+/* Sets the parameters of FS_TUNED, after deflateInit2 or deflateReset. */
+static void tune_deflate(z_stream *zs, int strategy) {
+  /* Like level 9, but without the lazy match shortcut (good_length), and
+   * with a longer hash chain.
+   */
+  if (strategy == FS_TUNED &&
+      deflateTune(zs, 258, 258, 258, 16384) != Z_OK) {
+    die("error in deflateTune");
   }
-  idat_size = write_png_img_data(
-      f, img->data, img->rlen, img->height, predictor_mode,
-      img->bpc, img->cpp, flate_level);
-  write_png_end(f);
-  if (fseek(f, idat_size_ofs, SEEK_SET)) die("error seeking to idat_size_ofs");
-  put_u32be(buf, idat_size);
-  fwrite(buf, 1, 4, f);
-  fflush(f);
-  if (ferror(f)) die("error writing png");
-  fclose(f);
 }
 
-static void check_palette(const Image *img) {
-  const uint32_t palette_size = img->palette_size;
-  const uint8_t max_color_idx = (palette_size / 3) - 1;
-  const uint8_t bpc = img->bpc;
-  if (img->color_type != CT_INDEXED_RGB) return;
-  if (palette_size == 0 || palette_size > 3 * 256 ||
-      palette_size % 3 != 0) die("bad palette size");
-  if (!img->palette) die("missing palette");
-  if (max_color_idx < (1 << img->bpc) - 1) {
-    /* Now check that the image doesn't contain too high color indexes. */
-    const unsigned char *p = (const unsigned char*)img->data;
-    const unsigned char *pend = p + img->height * img->rlen;
-    /* DEBUGF("mci=%d bpc=%d\n", max_color_idx, img->bpc); */
-    /* The loops below assume that unused bits at the end of each row are 0. */
-    if (bpc == 8) {
-      for (; p != pend; ++p) {
-        if (*p > max_color_idx) {
-         too_much:
-          die("image has color index too large");
-        }
-      }
-    } else if (bpc == 4) {
-      while (p != pend) {
-        const unsigned char v = *p++;
-        if ((v >> 4) > max_color_idx || (v & 15) > max_color_idx) goto too_much;
-      }
-    } else if (bpc == 2) {
-      while (p != pend) {
-        const unsigned char v = *p++;
-        if ((v >> 6) > max_color_idx || ((v >> 4) & 3) > max_color_idx ||
-            ((v >> 2) & 3) > max_color_idx || (v & 3) > max_color_idx
-           ) goto too_much;
-      }
-    } else if (bpc == 1) {
-      /* This assumes max_color_idx == 0, which is true, because of
-       * (max_color_idx < (1 << img->bpc) - 1) above.
-       */
-      for (; p != pend; ++p) {
-        if (*p != 0) goto too_much;
+/* Returns an initialized deflate stream: zs, or a stream reused from the
+ * ZCache of the calling thread. Call end_deflate when done.
+ *
+ * strategy is FS_..., but not FS_SEARCH.
+ */
+static z_stream *start_deflate(z_stream *zs, int level, int window_bits,
+                               int strategy) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (zcache) {
+    zs = &zcache->deflate_zs;
+    if (zcache->has_deflate) {
+      if (zcache->deflate_level == level &&
+          zcache->deflate_window_bits == window_bits &&
+          zcache->deflate_strategy == strategy) {
+        if (deflateReset(zs) != Z_OK) die("error in deflateReset");
+        tune_deflate(zs, strategy);
+        return zs;
       }
+      end_zcache_streams(zcache);
     }
+    reserve_arena(&zcache->zlib_arena, ZCACHE_ZLIB_ARENA_SIZE);
+    zs->zalloc = arena_zalloc;
+    zs->zfree = arena_zfree;
+    zs->opaque = &zcache->zlib_arena;
+  } else {
+    zs->zalloc = xzalloc;  /* calloc to pacify valgrind. */
+    zs->zfree = NULL;
+    zs->opaque = NULL;
+  }
+  if (deflateInit2(zs, level, Z_DEFLATED, window_bits,
+                   strategy == FS_TUNED ? 9 : 8,
+                   strategy == FS_TUNED ? Z_DEFAULT_STRATEGY : strategy)) {
+    die("error in deflateInit2");
   }
+  tune_deflate(zs, strategy);
+  if (zcache) {
+    zcache->has_deflate = 1;
+    zcache->deflate_level = level;
+    zcache->deflate_window_bits = window_bits;
+    zcache->deflate_strategy = strategy;
+  }
+  return zs;
 }
 
-/* img must be initialized (at least noalloc_image). */
-static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
-  uint32_t width, height, palette_size = 0;
-  uint8_t bpc, color_type, filter;
-#if !NO_PMTIFF
-  uint8_t bpx = 0;
-#endif
-  char right_and_byte = 0;
-  /* Must be large enough for the PNG header (33 bytes), for the palette (3
-   * * 256 bytes), and must be fast enough for inflate, and must be at least
+static void end_deflate(z_stream *zs) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (!zcache || zs != &zcache->deflate_zs) deflateEnd(zs);
+}
+
+/* Like start_deflate, but for inflate. */
+static z_stream *start_inflate(z_stream *zs) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (zcache) {
+    zs = &zcache->inflate_zs;
+    if (zcache->has_inflate) {
+      if (inflateReset(zs) != Z_OK) die("error in inflateReset");
+      return zs;
+    }
+    reserve_arena(&zcache->zlib_arena, ZCACHE_ZLIB_ARENA_SIZE);
+    zs->zalloc = arena_zalloc;
+    zs->zfree = arena_zfree;
+    zs->opaque = &zcache->zlib_arena;
+  } else {
+    zs->zalloc = xzalloc;  /* calloc to pacify valgrind. */
+    zs->zfree = NULL;
+    zs->opaque = NULL;
+  }
+  zs->next_in = NULL;
+  zs->avail_in = 0;
+  if (inflateInit(zs)) die("error in inflateInit");
+  if (zcache) zcache->has_inflate = 1;
+  return zs;
+}
+
+static void end_inflate(z_stream *zs) {
+  ZCache *zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (!zcache || zs != &zcache->inflate_zs) inflateEnd(zs);
+}
+
+/* --- */
+
+/* Returns the number of bytes filter_png_row needs in tmp. */
+static uint32_t get_png_filter_tmp_size(uint32_t rlen, uint8_t predictor_mode) {
+  /* For PM_PNGAUTO: 1 for the predictor identifier in the row, 6 for the 5
+   * predictors + copy of the previous row.
+   */
+  return predictor_mode == PM_PNGAUTO ? add_check(multiply_check(rlen, 6), 1) :
+      predictor_mode == PM_PNGNONE ? add_check(rlen, 1) : rlen;
+}
+
+/* Returns the number of bytes filter_png_row returns for each row. */
+static INLINE uint32_t get_png_filtered_row_size(
+    uint32_t rlen, uint8_t predictor_mode) {
+  return predictor_mode < PM_PNGNONE ? rlen : rlen + 1;
+}
+
+/* Prepares tmp for filtering rows with filter_png_row. prev_row is the row
+ * above the first row to be filtered, or NULL if the first row to be filtered
+ * is the first row of the image.
+ */
+static void start_png_filter(char *tmp, const char *prev_row, uint32_t rlen,
+                             uint8_t predictor_mode) {
+  if (predictor_mode == PM_PNGAUTO) {
+    if (prev_row) {
+      memcpy(tmp + 1 + rlen * 5, prev_row, rlen);  /* Previous row. */
+    } else {
+      memset(tmp + 1 + rlen * 5, '\0', rlen);  /* Previous row. */
+    }
+  }
+}
+
+/* Computes the 4 PM_PNGAUTO predictions (besides PNG_PR_NONE) of byte i of
+ * the row p[:rlen], and writes them to p[i + rlen * k]. a, b and c are the
+ * bytes left, above and upper left.
+ */
+static INLINE void filter_png_auto_byte(
+    unsigned char *p, uint32_t rlen, uint32_t i, unsigned char a,
+    unsigned char b, unsigned char c) {
+  const unsigned char v = p[i];
+  p[i += rlen] = v - a;  /* PNG_PR_SUB */
+  p[i += rlen] = v - b;  /* PNG_PR_UP */
+  p[i += rlen] = v - ((a + b) >> 1);  /* PNG_PR_AVERAGE */
+  p[i += rlen] = v - paeth_predictor(a, b, c);  /* PNG_PR_PAETH */
+}
+
+/* Adds the sum of the absolute values (as signed char) of
+ * p[i + rlen * k : j + rlen * k] to rowsums[k], for 0 <= k < 5.
+ */
+static void add_png_auto_rowsums(const unsigned char *p, uint32_t rlen,
+                                 uint32_t i, uint32_t j, uint32_t *rowsums) {
+  const signed char *q, *qend;  /* Sign is important. */
+  uint32_t k, rowsum;
+  for (k = 0; k < 5; ++k) {
+    q = (const signed char*)p + rlen * k;
+    for (qend = q + j, q += i, rowsum = 0; q != qend; ++q) {
+      rowsum += *q < 0 ? (*q * -1) : *q;
+    }
+    rowsums[k] += rowsum;
+  }
+}
+
+#if USE_SSE2
+static INLINE __m128i if_then_else_sse2(__m128i c, __m128i t, __m128i e) {
+  return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+/* Returns paeth_predictor(a, b, c) for 16-bit components. */
+static INLINE __m128i paeth_predictor_sse2(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);  /* p - a. */
+  __m128i pb = _mm_sub_epi16(a, c);  /* p - b. */
+  __m128i pc = _mm_add_epi16(pa, pb);  /* p - c. */
+  __m128i smallest;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  return if_then_else_sse2(_mm_cmpeq_epi16(smallest, pa), a,
+         if_then_else_sse2(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+/* Stores x to p, and adds the sum of its absolute values (as signed char)
+ * to *sum.
+ */
+static INLINE void store_sum_abs_sse2(unsigned char *p, __m128i x,
+                                      __m128i *sum) {
+  const __m128i zero = _mm_setzero_si128();
+  _mm_storeu_si128((__m128i*)p, x);
+  *sum = _mm_add_epi64(*sum, _mm_sad_epu8(
+      _mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+}
+
+/* Like filter_png_auto_byte followed by add_png_auto_rowsums, for bytes
+ * left_bytes, left_bytes + 1, ... of the row, 16 bytes at a time, in one
+ * sweep. Returns the index of the first byte not processed. The sums are
+ * computed modulo 2 ** 32, just like in add_png_auto_rowsums, so the
+ * predictor choice is the same.
+ */
+static uint32_t filter_png_auto_sse2(
+    unsigned char *p, const unsigned char *pr, uint32_t rlen,
+    uint32_t left_bytes, uint32_t *rowsums) {
+  const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+  __m128i sums[5], v, a, b, c, x;
+  uint32_t i, k;
+  for (k = 0; k < 5; ++k) sums[k] = zero;
+  for (i = left_bytes; i + 16 <= rlen; i += 16) {
+    v = _mm_loadu_si128((const __m128i*)(p + i));
+    a = _mm_loadu_si128((const __m128i*)(p + i - left_bytes));
+    b = _mm_loadu_si128((const __m128i*)(pr + i));
+    c = _mm_loadu_si128((const __m128i*)(pr + i - left_bytes));
+    sums[0] = _mm_add_epi64(sums[0], _mm_sad_epu8(
+        _mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+    store_sum_abs_sse2(p + i + rlen, _mm_sub_epi8(v, a), sums + 1);
+    store_sum_abs_sse2(p + i + rlen * 2, _mm_sub_epi8(v, b), sums + 2);
+    /* _mm_avg_epu8 rounds up, we need rounding down. */
+    x = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                     _mm_and_si128(_mm_xor_si128(a, b), one));
+    store_sum_abs_sse2(p + i + rlen * 3, _mm_sub_epi8(v, x), sums + 3);
+    x = _mm_packus_epi16(
+        paeth_predictor_sse2(_mm_unpacklo_epi8(a, zero),
+                             _mm_unpacklo_epi8(b, zero),
+                             _mm_unpacklo_epi8(c, zero)),
+        paeth_predictor_sse2(_mm_unpackhi_epi8(a, zero),
+                             _mm_unpackhi_epi8(b, zero),
+                             _mm_unpackhi_epi8(c, zero)));
+    store_sum_abs_sse2(p + i + rlen * 4, _mm_sub_epi8(v, x), sums + 4);
+  }
+  for (k = 0; k < 5; ++k) {
+    rowsums[k] += (uint32_t)_mm_cvtsi128_si32(sums[k]) +
+        (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sums[k], 8));
+  }
+  return i;
+}
+#endif
+
+/* Filters (applies the predictor to) the row img_data[:rlen], and returns
+ * a pointer to the filtered row, which has
+ * get_png_filtered_row_size(rlen, predictor_mode) bytes. The returned
+ * pointer points to tmp or img_data.
+ *
+ * Rows must be filtered in order, tmp must have been prepared by
+ * start_png_filter.
+ */
+static const char *filter_png_row(
+    char *tmp, const char *img_data, register uint32_t rlen,
+    uint8_t predictor_mode, uint8_t bpc, uint8_t cpp) {
+  if (predictor_mode == PM_NONE) {
+    return img_data;
+#if !NO_PMTIFF
+  } else if (predictor_mode == PM_TIFF2) {
+    /* Implemented in TIFFPredictor2::vi_write in encoder.cpp in sam2p. */
+    const uint8_t bpx = (cpp - 1) * bpc;
+    uint32_t h = 0;
+    char *op = tmp;
+    const char *p = img_data, *pend = p + rlen;
+    unsigned char d, o;
+    if (bpc == 1) {
+      while (p != pend) {
+        const unsigned char i = *p++;
+        d = (i >> 7); o  = ((d - (h >> bpx)) & 1) << 7; h = (h << 1) | d;
+        d = (i >> 6); o |= ((d - (h >> bpx)) & 1) << 6; h = (h << 1) | (d & 1);
+        d = (i >> 5); o |= ((d - (h >> bpx)) & 1) << 5; h = (h << 1) | (d & 1);
+        d = (i >> 4); o |= ((d - (h >> bpx)) & 1) << 4; h = (h << 1) | (d & 1);
+        d = (i >> 3); o |= ((d - (h >> bpx)) & 1) << 3; h = (h << 1) | (d & 1);
+        d = (i >> 2); o |= ((d - (h >> bpx)) & 1) << 2; h = (h << 1) | (d & 1);
+        d = (i >> 1); o |= ((d - (h >> bpx)) & 1) << 1; h = (h << 1) | (d & 1);
+        d = (i     ); o |= ((d - (h >> bpx)) & 1)     ; h = (h << 1) | (d & 1);
+        *op++ = o;
+      }
+    } else if (bpc == 2) {
+      while (p != pend) {
+        const unsigned char i = *p++;
+        d = (i >> 6); o  = ((d - (h >> bpx)) & 3) << 6; h = (h << 2) | d;
+        d = (i >> 4); o |= ((d - (h >> bpx)) & 3) << 4; h = (h << 2) | (d & 3);
+        d = (i >> 2); o |= ((d - (h >> bpx)) & 3) << 2; h = (h << 2) | (d & 3);
+        d = (i     ); o |= ((d - (h >> bpx)) & 3)     ; h = (h << 2) | (d & 3);
+        *op++ = o;
+      }
+    } else if (bpc == 4) {
+      while (p != pend) {
+        const unsigned char i = *p++;
+        d = (i >> 4); o  = ((d - (h >> bpx)) & 15) << 4; h = (h << 4) | d;
+        d = (i     ); o |= ((d - (h >> bpx)) & 15)     ; h = (h << 4) | (d & 15);
+        *op++ = o;
+      }
+    } else if (bpc == 8) {
+      while (p != pend) {
+        const unsigned char i = *p++;
+        *op++ = ((i - ((h  >> bpx)))/* & 255*/); h = (h << 8) | i;
+      }
+    } else {
+      die("ASSERT: bad bpc for writing PM_TIFF2");
+    }
+    return tmp;
+#endif
+  } else if (predictor_mode == PM_PNGAUTO) {
+    const uint32_t left_bytes = (bpc * cpp + 7) >> 3;
+    /* Since 1 <= bpc * cpp <= 24, so 1 <= left_bytes <= 3. */
+    unsigned char *p = (unsigned char*)tmp + 1;
+    unsigned char *pr = p + rlen * 5;  /* Previous row. */
+    uint32_t rowsums[5], best_rowsum, i, j, pi, best_pi;
+    memcpy(p, img_data, rlen);  /* PNG_PR_NONE */
+    rowsums[0] = rowsums[1] = rowsums[2] = rowsums[3] = rowsums[4] = 0;
+    /* Since rlen >= left_bytes, there is no need to check i < rlen. */
+    for (i = 0; i < left_bytes; ++i) {
+      filter_png_auto_byte(p, rlen, i, 0, pr[i], 0);
+    }
+    add_png_auto_rowsums(p, rlen, 0, i, rowsums);
+#if USE_SSE2
+    if (rlen >= i + 16) i = filter_png_auto_sse2(p, pr, rlen, i, rowsums);
+#endif
+    for (j = i; j < rlen; ++j) {
+      filter_png_auto_byte(p, rlen, j, p[j - left_bytes], pr[j],
+                           pr[j - left_bytes]);
+    }
+    add_png_auto_rowsums(p, rlen, i, rlen, rowsums);
+
+    for (best_rowsum = rowsums[0], best_pi = 0, pi = 1; pi <= 4; ++pi) {
+      if (rowsums[pi] < best_rowsum) {
+        best_rowsum = rowsums[pi];
+        best_pi = pi;
+      }
+    }
+    /* Copy the current row as the previous row for the next iteration. */
+    memcpy(pr, p, rlen);
+    p += rlen * best_pi;
+    *--p = best_pi;
+    /* DEBUGF("best_predictor=%d min_weight=%d\n", *p, best_rowsum); */
+    return (const char*)p;
+  } else if (predictor_mode == PM_PNGNONE) {
+    *tmp = PNG_PR_NONE;
+    memcpy(tmp + 1, img_data, rlen);
+    return tmp;
+  } else {
+    die("unknown predictor");
+  }
+}
+
+/* Calls deflate(zs, flush) until it stops producing output, writes the
+ * output to sink, and updates *crc32v with the output. zs->next_in and
+ * zs->avail_in must be set by the caller.
+ */
+static void deflate_to_sink(z_stream *zs, int flush, Sink *sink,
+                            uint32_t *crc32v) {
+  char obuf[8192];
+  uInt zoutsize;
+  int zr;
+  do {
+    zs->next_out = (Bytef*)obuf;
+    zs->avail_out = sizeof(obuf);
+    /* Z_BUF_ERROR means that no progress was possible, that's fine. */
+    if ((zr = deflate(zs, flush)) != Z_OK && zr != Z_BUF_ERROR &&
+        zr != Z_STREAM_END) {
+      die("deflate failed");
+    }
+    zoutsize = zs->next_out - (Bytef*)obuf;
+    *crc32v = crc32(*crc32v, (const Bytef*)obuf, zoutsize);
+    sink_write(sink, obuf, zoutsize);
+  } while (zr == Z_OK && zs->avail_out == 0);
+  if (zs->avail_in != 0) die("deflate has not processed all input");
+}
+
+/* If the deadline is at risk (see DEADLINE_DEFLATE_LEFT), makes zs
+ * compress the rest of the input with level 1, after writing the output
+ * for the input so far to sink and updating *crc32v. zs->avail_in must be
+ * 0. Returns whether it has done so; then don't call it again for zs.
+ */
+static xbool_t downgrade_deflate_if_late(z_stream *zs, Deadline *deadline,
+                                         Sink *sink, uint32_t *crc32v) {
+  ZCache *zcache;
+  char obuf[64];
+  int zr;
+  if (!is_deadline_at_risk(deadline, DEADLINE_DEFLATE_LEFT)) return 0;
+  /* End the current block, so deflateParams has nothing to flush. */
+  deflate_to_sink(zs, Z_BLOCK, sink, crc32v);
+  zs->next_out = (Bytef*)obuf;
+  zs->avail_out = sizeof(obuf);
+  /* Z_BUF_ERROR means that there was nothing to flush, that's fine. */
+  if ((zr = deflateParams(zs, 1, Z_DEFAULT_STRATEGY)) != Z_OK &&
+      zr != Z_BUF_ERROR) {
+    die("error in deflateParams");
+  }
+  *crc32v = crc32(*crc32v, (const Bytef*)obuf, zs->next_out - (Bytef*)obuf);
+  sink_write(sink, obuf, zs->next_out - (Bytef*)obuf);
+  zcache = (ZCache*)get_thread_ptr(TS_ZCACHE);
+  if (zcache && zs == &zcache->deflate_zs) {
+    zcache->deflate_level = -1;  /* Make start_deflate start a new one. */
+  }
+  return 1;
+}
+
+/* The minimum number of filtered image data bytes in a strip with
+ * -j:threads:N. Smaller strips would make compression worse, and the
+ * thread overhead would dominate.
+ */
+#define IDAT_STRIP_MIN_SIZE 131072
+/* The deflate sliding window size, with windowBits == 15. */
+#define DEFLATE_WINDOW_SIZE 32768
+
+/* Returns the number of strips the IDAT data should be compressed in. The
+ * result depends only on the image dimensions, predictor_mode and
+ * thread_count, so that the output is reproducible.
+ */
+static uint32_t get_idat_strip_count(
+    uint32_t rlen, uint32_t height, uint8_t predictor_mode,
+    uint32_t thread_count) {
+  const uint32_t row_size = get_png_filtered_row_size(rlen, predictor_mode);
+  uint32_t max_strip_count;
+  if (thread_count <= 1 || row_size == 0) return 1;
+  /* Divide first to avoid overflow. */
+  max_strip_count =
+      height / ((IDAT_STRIP_MIN_SIZE + row_size - 1) / row_size);
+  return max_strip_count < thread_count ?
+      (max_strip_count == 0 ? 1 : max_strip_count) : thread_count;
+}
+
+/* A horizontal strip of the image, compressed independently of other
+ * strips, as a raw deflate stream.
+ */
+typedef struct IdatStrip {
+  uint32_t y;  /* First row of the strip. */
+  uint32_t height;
+  Sink out;  /* Raw deflate output. */
+  uint32_t crc32v;  /* Of out.data[:out.size]. */
+  uint32_t adler32v;  /* Of the filtered (uncompressed) rows. */
+  uint32_t usize;  /* Size of the filtered (uncompressed) rows. */
+} IdatStrip;
+
+typedef struct IdatStripJob {
+  const char *img_data;
+  uint32_t rlen;
+  uint8_t predictor_mode;
+  uint8_t bpc;
+  uint8_t cpp;
+  uint8_t flate_level;
+  uint8_t flate_strategy;
+  uint32_t strip_count;
+  IdatStrip *strips;
+} IdatStripJob;
+
+/* Compresses a single strip, called by run_tasks. Uses the filtered data
+ * of the last up to 32 KiB of the previous strip as a dictionary, so the
+ * compression ratio is almost as good as with a single deflate stream. To
+ * do so, it filters these rows again, instead of waiting for the previous
+ * strip.
+ */
+static void deflate_idat_strip(void *job_arg, uint32_t strip_idx) {
+  const IdatStripJob *job = (const IdatStripJob*)job_arg;
+  IdatStrip *strip = job->strips + strip_idx;
+  const uint32_t rlen = job->rlen;
+  const uint8_t predictor_mode = job->predictor_mode;
+  const uint32_t row_size = get_png_filtered_row_size(rlen, predictor_mode);
+  const char *img_data = job->img_data + rlen * strip->y;
+  char *tmp = (char*)scratch_alloc(
+      get_png_filter_tmp_size(rlen, predictor_mode));
+  const char *p;
+  uint32_t y;
+  z_stream zs_storage;
+  /* Negative windowBits: raw deflate, without zlib header and adler32. */
+  z_stream *zs = start_deflate(&zs_storage, job->flate_level, -15,
+                               job->flate_strategy);
+  JobStats *job_stats = get_job_stats();
+  Deadline *deadline = get_deadline();
+  double filter_wall = 0, deflate_wall = 0, t = 0;
+  if (job_stats) t = get_wall_time();
+  if (strip->y == 0) {
+    start_png_filter(tmp, NULL, rlen, predictor_mode);
+  } else {
+    uint32_t dict_rows = (DEFLATE_WINDOW_SIZE + row_size - 1) / row_size;
+    uint32_t dict_size = 0;
+    char *dict;
+    if (dict_rows > strip->y) dict_rows = strip->y;
+    dict = (char*)scratch_alloc(dict_rows * row_size);
+    p = img_data - rlen * dict_rows;
+    start_png_filter(tmp, dict_rows == strip->y ? NULL : p - rlen, rlen,
+                     predictor_mode);
+    for (y = dict_rows; y > 0; p += rlen, --y) {
+      memcpy(dict + dict_size, filter_png_row(
+          tmp, p, rlen, predictor_mode, job->bpc, job->cpp), row_size);
+      dict_size += row_size;
+    }
+    p = dict;
+    if (dict_size > DEFLATE_WINDOW_SIZE) {
+      p += dict_size - DEFLATE_WINDOW_SIZE;
+      dict_size = DEFLATE_WINDOW_SIZE;
+    }
+    if (deflateSetDictionary(zs, (const Bytef*)p, dict_size) != Z_OK) {
+      die("error in deflateSetDictionary");
+    }
+    scratch_free(dict);
+  }
+  strip->crc32v = 0;
+  strip->adler32v = adler32(0, NULL, 0);
+  strip->usize = multiply_check(strip->height, row_size);
+  for (y = strip->height; y > 0; img_data += rlen, --y) {
+    p = filter_png_row(tmp, img_data, rlen, predictor_mode, job->bpc, job->cpp);
+    if (job_stats) add_wall_lap(&t, &filter_wall);
+    strip->adler32v = adler32(strip->adler32v, (const Bytef*)p, row_size);
+    zs->next_in = (Bytef*)p;
+    zs->avail_in = row_size;
+    deflate_to_sink(zs, Z_NO_FLUSH, &strip->out, &strip->crc32v);
+    if (deadline && downgrade_deflate_if_late(
+        zs, deadline, &strip->out, &strip->crc32v)) {
+      deadline = NULL;
+    }
+    if (job_stats) add_wall_lap(&t, &deflate_wall);
+  }
+  /* Z_SYNC_FLUSH ends the strip on a byte boundary without setting the
+   * final-block bit, so the next strip can be appended.
+   */
+  deflate_to_sink(zs, strip_idx + 1 == job->strip_count ? Z_FINISH :
+                  Z_SYNC_FLUSH, &strip->out, &strip->crc32v);
+  if (job_stats) {
+    add_wall_lap(&t, &deflate_wall);
+    add_stage_wall(job_stats, STAGE_FILTER, filter_wall, 0, 0);
+    add_stage_wall(job_stats, STAGE_DEFLATE, deflate_wall, zs->total_in,
+                   zs->total_out);
+  }
+  end_deflate(zs);
+  scratch_free(tmp);
+}
+
+/* Writes the zlib stream of the IDAT chunk payload to sink, compressing
+ * strips of rows in parallel, as separate raw deflate streams. The
+ * concatenation of these streams (with Z_SYNC_FLUSH between them) is a
+ * valid deflate stream. Updates *crc32v with the bytes written. Returns
+ * the number of bytes written.
+ */
+static uint32_t write_png_img_data_strips(
+    Sink *sink, uint32_t *crc32v, const char *img_data, uint32_t rlen,
+    uint32_t height, uint8_t predictor_mode, uint8_t bpc, uint8_t cpp,
+    uint8_t flate_level, uint8_t flate_strategy, uint32_t strip_count,
+    uint32_t thread_count) {
+  IdatStripJob job;
+  IdatStrip *strip, *strip_end;
+  uint32_t strip_height = height / strip_count;
+  uint32_t y = 0, extra_rows = height % strip_count, size, adler32v;
+  char buf[4];
+  /* zlib header, same as what deflateInit2 writes. */
+  const uint16_t zlib_header =
+      flate_level < 2 || flate_strategy == FS_HUFFMAN ||
+      flate_strategy == FS_RLE ? 0x7801 :
+      flate_level < 6 ? 0x785e : flate_level == 6 ? 0x789c : 0x78da;
+  job.img_data = img_data;
+  job.rlen = rlen;
+  job.predictor_mode = predictor_mode;
+  job.bpc = bpc;
+  job.cpp = cpp;
+  job.flate_level = flate_level;
+  job.flate_strategy = flate_strategy;
+  job.strip_count = strip_count;
+  /* The strips array, and tmp and dict of deflate_idat_strip (the calling
+   * thread runs its strips one by one).
+   */
+  reserve_scratch(add_check(add_check(
+      get_arena_alloc_size(multiply_check(strip_count, sizeof(IdatStrip))),
+      get_arena_alloc_size(get_png_filter_tmp_size(rlen, predictor_mode))),
+      get_arena_alloc_size(add_check(DEFLATE_WINDOW_SIZE,
+          get_png_filtered_row_size(rlen, predictor_mode)))));
+  job.strips = (IdatStrip*)scratch_alloc(
+      multiply_check(strip_count, sizeof(IdatStrip)));
+  strip_end = job.strips + strip_count;
+  for (strip = job.strips; strip != strip_end; ++strip) {
+    strip->y = y;
+    /* The first height % strip_count strips get 1 row more. */
+    strip->height = strip_height + (extra_rows > 0);
+    if (extra_rows > 0) --extra_rows;
+    y += strip->height;
+    nofile_sink(&strip->out);
+  }
+  run_tasks(deflate_idat_strip, &job, strip_count, thread_count);
+
+  buf[0] = zlib_header >> 8;
+  buf[1] = zlib_header;
+  sink_write(sink, buf, 2);
+  *crc32v = crc32(*crc32v, (const Bytef*)buf, 2);
+  size = 2;
+  adler32v = adler32(0, NULL, 0);
+  for (strip = job.strips; strip != strip_end; ++strip) {
+    sink_write(sink, strip->out.data, strip->out.size);
+    *crc32v = crc32_combine(*crc32v, strip->crc32v, strip->out.size);
+    adler32v = adler32_combine(adler32v, strip->adler32v, strip->usize);
+    size = add_check(size, strip->out.size);
+    free(strip->out.data);
+  }
+  scratch_free(job.strips);
+  put_u32be(buf, adler32v);
+  sink_write(sink, buf, 4);
+  *crc32v = crc32(*crc32v, (const Bytef*)buf, 4);
+  return add_check(size, 4);
+}
+
+/* Compresses the IDAT chunk payload row by row, as a single zlib stream. */
+typedef struct IdatWriter {
+  Sink *sink;
+  z_stream zs_storage, *zs;
+  char *tmp;  /* For filter_png_row. */
+  uint32_t crc32v;  /* Of the IDAT chunk type and the payload so far. */
+  uint32_t rlen;
+  uint8_t predictor_mode;
+  uint8_t bpc;
+  uint8_t cpp;
+  JobStats *job_stats;  /* NULL unless --stats. */
+  double filter_wall, deflate_wall;
+  Deadline *deadline;  /* NULL unless --deadline-ms, or after downgrade. */
+} IdatWriter;
+
+/* The caller must have written the IDAT chunk header to sink. */
+static void start_idat_writer(IdatWriter *iw, Sink *sink, uint32_t rlen,
+                              uint8_t predictor_mode, uint8_t bpc,
+                              uint8_t cpp, uint8_t flate_level,
+                              uint8_t flate_strategy) {
+  iw->sink = sink;
+  iw->zs = start_deflate(&iw->zs_storage, flate_level, 15, flate_strategy);
+  iw->zs->avail_in = 0;
+  iw->tmp = (char*)scratch_alloc(
+      get_png_filter_tmp_size(rlen, predictor_mode));
+  start_png_filter(iw->tmp, NULL, rlen, predictor_mode);
+  iw->crc32v = 900662814UL;  /* zlib.crc32("IDAT"). */
+  iw->rlen = rlen;
+  iw->predictor_mode = predictor_mode;
+  iw->bpc = bpc;
+  iw->cpp = cpp;
+  iw->job_stats = get_job_stats();
+  iw->filter_wall = iw->deflate_wall = 0;
+  iw->deadline = get_deadline();
+}
+
+/* Filters and compresses the next row img_data[:rlen]. */
+static void write_idat_row(IdatWriter *iw, const char *img_data) {
+  double t = 0;
+  if (iw->job_stats) t = get_wall_time();
+  iw->zs->next_in = (Bytef*)filter_png_row(
+      iw->tmp, img_data, iw->rlen, iw->predictor_mode, iw->bpc, iw->cpp);
+  if (iw->job_stats) add_wall_lap(&t, &iw->filter_wall);
+  iw->zs->avail_in = get_png_filtered_row_size(iw->rlen, iw->predictor_mode);
+  deflate_to_sink(iw->zs, Z_NO_FLUSH, iw->sink, &iw->crc32v);
+  if (iw->deadline && downgrade_deflate_if_late(
+      iw->zs, iw->deadline, iw->sink, &iw->crc32v)) {
+    iw->deadline = NULL;
+  }
+  if (iw->job_stats) add_wall_lap(&t, &iw->deflate_wall);
+}
+
+/* Flushes the compressed data (but doesn't write the CRC), and returns the
+ * payload size of the IDAT chunk.
+ */
+static uint32_t finish_idat_writer(IdatWriter *iw) {
+  uint32_t idat_size;
+  double t = 0;
+  if (iw->job_stats) t = get_wall_time();
+  deflate_to_sink(iw->zs, Z_FINISH, iw->sink, &iw->crc32v);
+  /* No need to append zs->adler, deflate() does it for us. */
+  idat_size = iw->zs->total_out;
+  if (iw->job_stats) {
+    add_wall_lap(&t, &iw->deflate_wall);
+    add_stage_wall(iw->job_stats, STAGE_FILTER, iw->filter_wall, 0, 0);
+    add_stage_wall(iw->job_stats, STAGE_DEFLATE, iw->deflate_wall,
+                   iw->zs->total_in, idat_size);
+  }
+  end_deflate(iw->zs);
+  scratch_free(iw->tmp);
+  return idat_size;
+}
+
+/* Returns the filtered rows of img_data: height * row_size bytes, in a
+ * buffer to be freed with scratch_free. height must be positive.
+ */
+static char *filter_png_rows(
+    const char *img_data, uint32_t rlen, uint32_t height,
+    uint8_t predictor_mode, uint8_t bpc, uint8_t cpp) {
+  const uint32_t row_size = get_png_filtered_row_size(rlen, predictor_mode);
+  char *filtered = (char*)scratch_alloc(multiply_check(row_size, height));
+  char *tmp = (char*)scratch_alloc(
+      get_png_filter_tmp_size(rlen, predictor_mode));
+  char *p = filtered;
+  start_png_filter(tmp, NULL, rlen, predictor_mode);
+  for (; height > 0; img_data += rlen, p += row_size, --height) {
+    memcpy(p, filter_png_row(tmp, img_data, rlen, predictor_mode, bpc, cpp),
+           row_size);
+  }
+  scratch_free(tmp);
+  return filtered;
+}
+
+/* The filtered image data and its compressed versions, one for each flate
+ * strategy, for write_png_img_data_search.
+ */
+typedef struct FlateSearchJob {
+  const char *data;
+  uint32_t size;
+  uint8_t flate_level;
+  /* zlib streams, indexed by flate strategy. Empty if skipped because of
+   * --deadline-ms.
+   */
+  Sink outs[FS_SEARCH];
+  uint32_t crc32vs[FS_SEARCH];  /* Of outs[...].data[:outs[...].size]. */
+} FlateSearchJob;
+
+/* Compresses the filtered image data with a single flate strategy, called
+ * by run_tasks.
+ */
+static void deflate_with_strategy(void *job_arg, uint32_t flate_strategy) {
+  FlateSearchJob *job = (FlateSearchJob*)job_arg;
+  Sink *out = job->outs + flate_strategy;
+  const char *p = job->data;
+  uint32_t left = job->size, chunk_size;
+  z_stream zs_storage, *zs;
+  JobStats *job_stats = get_job_stats();
+  Deadline *deadline = get_deadline();
+  double t = 0;
+  /* FS_DEFAULT is always compressed, so there is at least one output. */
+  if (flate_strategy != FS_DEFAULT &&
+      is_deadline_at_risk(deadline, DEADLINE_COMPRESS_LEFT)) {
+    return;
+  }
+  zs = start_deflate(&zs_storage, job->flate_level, 15, flate_strategy);
+  if (job_stats) t = get_wall_time();
+  job->crc32vs[flate_strategy] = 0;
+  /* In chunks, so that the deadline can be checked in between. */
+  for (;;) {
+    chunk_size = left < 65536 ? left : 65536;
+    zs->next_in = (Bytef*)p;
+    zs->avail_in = chunk_size;
+    p += chunk_size;
+    left -= chunk_size;
+    if (left == 0) break;
+    deflate_to_sink(zs, Z_NO_FLUSH, out, job->crc32vs + flate_strategy);
+    if (deadline && downgrade_deflate_if_late(
+        zs, deadline, out, job->crc32vs + flate_strategy)) {
+      deadline = NULL;
+    }
+  }
+  deflate_to_sink(zs, Z_FINISH, out, job->crc32vs + flate_strategy);
+  if (job_stats) {
+    add_stage_wall(job_stats, STAGE_DEFLATE, get_wall_time() - t,
+                   zs->total_in, zs->total_out);
+  }
+  end_deflate(zs);
+}
+
+/* Writes the zlib stream of the IDAT chunk payload to sink, trying each
+ * flate strategy (in parallel) on the same filtered rows, and keeping the
+ * smallest output (the earliest one on a tie). Updates *crc32v with the
+ * bytes written. Returns the number of bytes written.
+ */
+static uint32_t write_png_img_data_search(
+    Sink *sink, uint32_t *crc32v, const char *img_data, uint32_t rlen,
+    uint32_t height, uint8_t predictor_mode, uint8_t bpc, uint8_t cpp,
+    uint8_t flate_level, uint32_t thread_count) {
+  FlateSearchJob job;
+  char *filtered = NULL;
+  uint32_t i, best_i;
+  job.size = multiply_check(
+      get_png_filtered_row_size(rlen, predictor_mode), height);
+  job.flate_level = flate_level;
+  if (predictor_mode == PM_NONE || height == 0) {
+    job.data = img_data;
+  } else {
+    JobStats *job_stats = get_job_stats();
+    double t = 0;
+    if (job_stats) t = get_wall_time();
+    job.data = filtered = filter_png_rows(
+        img_data, rlen, height, predictor_mode, bpc, cpp);
+    if (job_stats) {
+      add_stage_wall(job_stats, STAGE_FILTER, get_wall_time() - t, 0, 0);
+    }
+  }
+  for (i = 0; i < FS_SEARCH; ++i) {
+    nofile_sink(job.outs + i);
+  }
+  run_tasks(deflate_with_strategy, &job, FS_SEARCH, thread_count);
+  for (best_i = 0, i = 1; i < FS_SEARCH; ++i) {
+    if (job.outs[i].size != 0 && job.outs[i].size < job.outs[best_i].size) {
+      best_i = i;
+    }
+  }
+  sink_write(sink, job.outs[best_i].data, job.outs[best_i].size);
+  *crc32v = crc32_combine(*crc32v, job.crc32vs[best_i],
+                          job.outs[best_i].size);
+  for (i = 0; i < FS_SEARCH; ++i) {
+    free(job.outs[i].data);
+  }
+  if (filtered) scratch_free(filtered);
+  return job.outs[best_i].size;
+}
+
+/* Returns the payload size of the IDAT chunk.
+ * flate_level: 0 is uncompressed, 1..9 is compressed, 9 is maximum compression
+ *   (slow, but produces slow output).
+ * flate_strategy: FS_...
+ * thread_count: If larger than 1, compress large images in strips, in
+ *   parallel, see write_png_img_data_strips. With FS_SEARCH, compress with
+ *   the flate strategies in parallel instead.
+ */
+static uint32_t write_png_img_data(
+    Sink *sink, const char *img_data, register uint32_t rlen, uint32_t height,
+    uint8_t predictor_mode, uint8_t bpc, uint8_t cpp, uint8_t flate_level,
+    uint8_t flate_strategy, uint32_t thread_count) {
+  const uint32_t strip_count = flate_strategy == FS_SEARCH ? 1 :
+      get_idat_strip_count(rlen, height, predictor_mode, thread_count);
+  uint32_t crc32v = 900662814UL;  /* zlib.crc32("IDAT"). */
+  uint32_t idat_size;
+  char buf[8];
+  /* If more than 24 bits, then rowsum would overflow. */
+  if (rlen >> 24) die("image rlen too large");
+  if (predictor_mode != PM_NONE &&
+#if !NO_PMTIFF
+      predictor_mode != PM_TIFF2 &&
+#endif
+      predictor_mode != PM_PNGAUTO && predictor_mode != PM_PNGNONE) {
+    die("unknown predictor");
+  }
+  sink_write(sink, "\0\0\0\0IDAT", 8);
+  if (flate_strategy == FS_SEARCH) {
+    idat_size = write_png_img_data_search(
+        sink, &crc32v, img_data, rlen, height, predictor_mode, bpc, cpp,
+        flate_level, thread_count);
+  } else if (strip_count > 1) {
+    idat_size = write_png_img_data_strips(
+        sink, &crc32v, img_data, rlen, height, predictor_mode, bpc, cpp,
+        flate_level, flate_strategy, strip_count, thread_count);
+  } else {
+    IdatWriter iw;
+    start_idat_writer(&iw, sink, rlen, predictor_mode, bpc, cpp, flate_level,
+                      flate_strategy);
+    /* With --deadline-ms, write_idat_row can check the time. */
+    if (predictor_mode == PM_NONE && !iw.deadline) {
+      iw.zs->next_in = (Bytef*)img_data;
+      iw.zs->avail_in = multiply_check(rlen, height);
+      /* Z_FINISH in finish_idat_writer will do all the compression. */
+    } else {
+      for (; height > 0; img_data += rlen, --height) {
+        write_idat_row(&iw, img_data);
+      }
+    }
+    idat_size = finish_idat_writer(&iw);
+    crc32v = iw.crc32v;
+  }
+  put_u32be(buf, crc32v);
+  sink_write(sink, buf, 4);
+  return idat_size;
+}
+
+static const char kPngHeader[16 + 1] = "\x89PNG\r\n\x1a\n\0\0\0\rIHDR";
+
+static void write_png_header(
+    Sink *sink,
+    uint32_t width, uint32_t height, uint8_t bpc, uint8_t color_type,
+    uint8_t filter) {
+  char buf[33], *p = buf;
+  memcpy(p, kPngHeader, 16); p += 16;
+  p = put_u32be(p, width);
+  p = put_u32be(p, height);
+  *p++ = bpc;
+  *p++ = color_type;
+  *p++ = PNG_COMPRESSION_DEFAULT;
+  *p++ = filter;
+  *p++ = PNG_INTERLACE_NONE;
+  put_u32be(p, crc32(0, (const Bytef*)(buf + 12), 17));
+  sink_write(sink, buf, 33);
+}
+
+/* size is the number of bytes in the palette, typically 3 * color_count.
+ * data[:size] looks like RGBRGBRGB...
+ */
+static void write_png_palette(
+    Sink *sink, const char *data, uint32_t size) {
+  const uint32_t crc32v_plte = 1269336405UL;  /* crc32(0, "PLTE", 4). */
+  char buf[8];
+  put_u32be(buf, size);
+  memcpy(buf + 4, "PLTE", 4);
+  sink_write(sink, buf, 8);
+  sink_write(sink, data, size);
+  put_u32be(buf, crc32(crc32v_plte, (const Bytef*)data, size));
+  sink_write(sink, buf, 4);
+}
+
+static void write_png_end(Sink *sink) {
+  sink_write(sink, "\0\0\0\0IEND\xae""B`\x82", 12);
+}
+
+/* Returns the predictor_mode write_png_to_sink would write img with. */
+static uint8_t get_png_predictor_mode(const Image *img, xbool_t is_extended,
+                                      uint8_t predictor_mode) {
+  const uint8_t bpc = img->bpc;
+  const uint8_t color_type = img->color_type;
+  if (predictor_mode < PM_NONE) {
+    predictor_mode = PM_NONE;
+  } else if (predictor_mode == PM_SMART) {
+    predictor_mode =
+        /* This condition comes from the is_predictor_recommended = ...
+         * assignment in sam2p 0.49.4, which comes from the do_filter = ...
+         * assignment in png_write_IHDR() in pngwutil.c of libpng-1.2.15 .
+         */
+        bpc >= 8 && (color_type == CT_RGB || color_type == CT_GRAY) ?
+        PM_PNGAUTO : PM_NONE;
+  }
+  if (!is_extended && predictor_mode != PM_PNGAUTO) {
+    predictor_mode = PM_PNGNONE;
+  }
+  return predictor_mode;
+}
+
+/* Writes the PNG header and palette of img to the beginning of sink (which
+ * must be empty). Returns the predictor_mode to write the IDAT chunk with.
+ *
+ * If is_extended is true, that can produce an invalid PNG (e.g. with PM_NONE).
+ */
+static uint8_t start_png_to_sink(Sink *sink, const Image *img,
+                                 xbool_t is_extended, uint8_t predictor_mode) {
+  const uint8_t bpc = img->bpc;
+  const uint8_t color_type = img->color_type;
+  uint8_t filter;
+
+  if (!is_extended && color_type == CT_RGB && bpc < 8) {
+    die("rgb png must have bpc=8");
+  }
+  predictor_mode = get_png_predictor_mode(img, is_extended, predictor_mode);
+  /* Only PNG_FILTER_DEFAULT (0) is standard PNG. 1 is PM_NONE, 2 is PM_TIFF2.
+   */
+  filter = predictor_mode < PM_PNGNONE ? predictor_mode : PNG_FILTER_DEFAULT;
+
+  write_png_header(sink, img->width, img->height, bpc, color_type, filter);
+  if (color_type == CT_INDEXED_RGB) {
+    write_png_palette(sink, img->palette, img->palette_size);
+  }
+  return predictor_mode;
+}
+
+/* Writes the end of the PNG file to sink, after the IDAT chunk, and fills
+ * in the size of the IDAT chunk.
+ */
+static void finish_png_to_sink(Sink *sink, const Image *img,
+                               uint32_t idat_size) {
+  const uint32_t idat_size_ofs = img->color_type == CT_INDEXED_RGB ?
+      add_check(45, img->palette_size) : 33;
+  char buf[4];
+  write_png_end(sink);
+  put_u32be(buf, idat_size);
+  if (sink->f) {
+    if (fseek(sink->f, idat_size_ofs, SEEK_SET)) die("error seeking to idat_size_ofs");
+    fwrite(buf, 1, 4, sink->f);
+  } else {
+    memcpy(sink->data + idat_size_ofs, buf, 4);
+  }
+}
+
+/* Writes the PNG file to the beginning of sink (which must be empty).
+ *
+ * If is_extended is true, that can produce an invalid PNG (e.g. with PM_NONE).
+ */
+static void write_png_to_sink(Sink *sink, const Image *img,
+                              xbool_t is_extended, uint8_t predictor_mode,
+                              uint8_t flate_level, uint8_t flate_strategy,
+                              uint32_t thread_count) {
+  predictor_mode = start_png_to_sink(sink, img, is_extended, predictor_mode);
+  finish_png_to_sink(sink, img, write_png_img_data(
+      sink, img->data, img->rlen, img->height, predictor_mode,
+      img->bpc, img->cpp, flate_level, flate_strategy, thread_count));
+}
+
+/* The image data of an input PNG, kept for --reuse-idat. */
+typedef struct IdatCopy {
+  Sink data;  /* The payloads of the IDAT chunks: a zlib stream. */
+  /* Is data valid (complete, without trailing garbage, with filter 0)? */
+  xbool_t is_ok;
+  uint8_t bpc;
+  uint8_t color_type;
+  uint32_t palette_size;
+  char palette[3 * 256];
+} IdatCopy;
+
+/* Returns whether write_png_to_sink can write img with the image data in
+ * ic instead of compressing img->data, i.e. the color type, bpc and palette
+ * are the same as in the input PNG, and it would write a standard PNG
+ * filter.
+ */
+static xbool_t can_reuse_idat(const IdatCopy *ic, const Image *img,
+                              xbool_t is_extended, uint8_t predictor_mode) {
+  predictor_mode = get_png_predictor_mode(img, is_extended, predictor_mode);
+  return ic->is_ok && ic->bpc == img->bpc &&
+         ic->color_type == img->color_type &&
+         ic->palette_size == img->palette_size &&
+         0 == memcmp(ic->palette, img->palette, img->palette_size) &&
+         (predictor_mode == PM_PNGAUTO || predictor_mode == PM_PNGNONE);
+}
+
+/* Like write_png_to_sink, but copies the image data from ic. */
+static void write_png_reusing_idat(Sink *sink, const Image *img,
+                                   xbool_t is_extended, const IdatCopy *ic) {
+  char buf[4];
+  start_png_to_sink(sink, img, is_extended, PM_PNGAUTO);
+  sink_write(sink, "\0\0\0\0IDAT", 8);
+  sink_write(sink, ic->data.data, ic->data.size);
+  put_u32be(buf, crc32(900662814UL,  /* zlib.crc32("IDAT"). */
+                       (const Bytef*)ic->data.data, ic->data.size));
+  sink_write(sink, buf, 4);
+  finish_png_to_sink(sink, img, ic->data.size);
+}
+
+#if !NO_REGTEST
+static void write_png(const char *filename, const Image *img,
+                      xbool_t is_extended, uint8_t predictor_mode,
+                      uint8_t flate_level, uint32_t thread_count) {
+  Sink sink;
+  open_file_sink(&sink, filename, "error writing png");
+  write_png_to_sink(&sink, img, is_extended, predictor_mode, flate_level,
+                    FS_DEFAULT, thread_count);
+  close_file_sink(&sink, "error writing png");
+}
+#endif
+
+/* Writes a PNG file row by row, as the rows are read by read_png_stream,
+ * keeping only a few rows in memory (-j:stream). The color type, bpc and
+ * palette are the same as in the input PNG.
+ */
+typedef struct PngRowWriter {
+  const char *filename;
+  Sink *out;  /* If not NULL, write here instead of filename. */
+  xbool_t is_extended;
+  xbool_t force_gray;
+  uint8_t predictor_mode;
+  uint8_t flate_level;
+  uint8_t flate_strategy;
+  xbool_t is_started;
+  Sink *sink;  /* out or &file_sink. */
+  Sink file_sink;
+  DieCleanup file_cleanup;  /* Closes file_sink.f. */
+  IdatWriter iw;
+} PngRowWriter;
+
+static void init_png_row_writer(PngRowWriter *rw, const char *filename,
+                                Sink *out, xbool_t is_extended, xbool_t force_gray,
+                                uint8_t predictor_mode, uint8_t flate_level,
+                                uint8_t flate_strategy) {
+  rw->filename = filename;
+  rw->out = out;
+  rw->is_extended = is_extended;
+  rw->force_gray = force_gray;
+  rw->predictor_mode = predictor_mode;
+  rw->flate_level = flate_level;
+  /* FS_SEARCH would need all rows. */
+  rw->flate_strategy = flate_strategy == FS_SEARCH ? FS_DEFAULT :
+      flate_strategy;
+  rw->is_started = 0;
+}
+
+/* Returns whether rw can write an image with bpc and color_type. */
+static xbool_t is_png_row_writer_ok(const PngRowWriter *rw, uint8_t bpc,
+                                    uint8_t color_type) {
+  return (!rw->force_gray || color_type == CT_GRAY) &&
+         (rw->is_extended || color_type != CT_RGB || bpc == 8);
+}
+
+static void abort_png_row_writer(void *rw_arg) {
+  fclose(((PngRowWriter*)rw_arg)->file_sink.f);
+}
+
+/* Creates the output file (unless rw->out is set), and writes everything
+ * before the image data. img must have its shape and palette set, but not
+ * its data.
+ */
+static void start_png_row_writer(PngRowWriter *rw, const Image *img) {
+  uint8_t predictor_mode;
+  /* If more than 24 bits, then rowsum would overflow. */
+  if (img->rlen >> 24) die("image rlen too large");
+  if (rw->out) {
+    rw->sink = rw->out;
+  } else {
+    rw->sink = &rw->file_sink;
+    nofile_sink(rw->sink);
+    if (!(rw->sink->f = fopen(rw->filename, "wb"))) die("error writing png");
+    push_die_cleanup(&rw->file_cleanup, abort_png_row_writer, rw);
+  }
+  rw->is_started = 1;
+  predictor_mode = start_png_to_sink(
+      rw->sink, img, rw->is_extended, rw->predictor_mode);
+  sink_write(rw->sink, "\0\0\0\0IDAT", 8);
+  start_idat_writer(&rw->iw, rw->sink, img->rlen, predictor_mode, img->bpc,
+                    img->cpp, rw->flate_level, rw->flate_strategy);
+}
+
+/* Writes the next row row[:img->rlen], with the unused bits at the end
+ * already cleared.
+ */
+static INLINE void write_png_row(PngRowWriter *rw, const char *row) {
+  write_idat_row(&rw->iw, row);
+}
+
+static void finish_png_row_writer(PngRowWriter *rw, const Image *img) {
+  char buf[4];
+  const uint32_t idat_size = finish_idat_writer(&rw->iw);
+  put_u32be(buf, rw->iw.crc32v);
+  sink_write(rw->sink, buf, 4);
+  finish_png_to_sink(rw->sink, img, idat_size);
+  if (rw->sink == &rw->file_sink) {
+    fflush(rw->sink->f);
+    if (ferror(rw->sink->f)) die("error writing png");
+    pop_die_cleanup(&rw->file_cleanup);
+    fclose(rw->sink->f);
+  }
+}
+
+/* Checks that the image rows data[:size] (with the unused bits at the end
+ * of each row cleared) don't contain too high color indexes.
+ */
+static void check_palette_rows(const Image *img, const char *data,
+                               uint32_t size) {
+  const uint8_t max_color_idx = (img->palette_size / 3) - 1;
+  const uint8_t bpc = img->bpc;
+  if (max_color_idx < (1 << img->bpc) - 1) {
+    const unsigned char *p = (const unsigned char*)data;
+    const unsigned char *pend = p + size;
+    /* DEBUGF("mci=%d bpc=%d\n", max_color_idx, img->bpc); */
+    if (bpc == 8) {
+      for (; p != pend; ++p) {
+        if (*p > max_color_idx) {
+         too_much:
+          die("image has color index too large");
+        }
+      }
+    } else if (bpc == 4) {
+      while (p != pend) {
+        const unsigned char v = *p++;
+        if ((v >> 4) > max_color_idx || (v & 15) > max_color_idx) goto too_much;
+      }
+    } else if (bpc == 2) {
+      while (p != pend) {
+        const unsigned char v = *p++;
+        if ((v >> 6) > max_color_idx || ((v >> 4) & 3) > max_color_idx ||
+            ((v >> 2) & 3) > max_color_idx || (v & 3) > max_color_idx
+           ) goto too_much;
+      }
+    } else if (bpc == 1) {
+      /* This assumes max_color_idx == 0, which is true, because of
+       * (max_color_idx < (1 << img->bpc) - 1) above.
+       */
+      for (; p != pend; ++p) {
+        if (*p != 0) goto too_much;
+      }
+    }
+  }
+}
+
+static void check_palette(const Image *img) {
+  const uint32_t palette_size = img->palette_size;
+  if (img->color_type != CT_INDEXED_RGB) return;
+  if (palette_size == 0 || palette_size > 3 * 256 ||
+      palette_size % 3 != 0) die("bad palette size");
+  if (!img->palette) die("missing palette");
+  check_palette_rows(img, img->data, img->height * img->rlen);
+}
+
+#if USE_SSE2
+/* SIMD unfilter kernels for bpc=8 Gray (left_delta_inv == 1) and RGB
+ * (left_delta_inv == 3). Like in libpng, Average and Paeth do one RGB
+ * pixel at a time (each pixel depends on the one on the left), and Sub
+ * computes prefix sums of 16 bytes.
+ */
+
+static INLINE __m128i load4_sse2(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return _mm_cvtsi32_si128((int)v);
+}
+
+static INLINE void store3_sse2(unsigned char *p, __m128i x) {
+  const uint32_t v = (uint32_t)_mm_cvtsi128_si32(x);
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16;
+}
+
+static void unfilter_up_sse2(unsigned char *dp, const unsigned char *sp,
+                             const unsigned char *dr, uint32_t rlen) {
+  for (; rlen >= 16; rlen -= 16, dp += 16, sp += 16, dr += 16) {
+    _mm_storeu_si128((__m128i*)dp, _mm_add_epi8(
+        _mm_loadu_si128((const __m128i*)sp),
+        _mm_loadu_si128((const __m128i*)dr)));
+  }
+  for (; rlen > 0; --rlen) *dp++ = *sp++ + *dr++;
+}
+
+static void unfilter_sub1_sse2(unsigned char *dp, const unsigned char *sp,
+                               uint32_t rlen) {
+  __m128i a = _mm_setzero_si128(), x;  /* a: The last byte, 16 times. */
+  uint32_t i;
+  for (i = 0; i + 16 <= rlen; i += 16) {
+    x = _mm_loadu_si128((const __m128i*)(sp + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, a);
+    _mm_storeu_si128((__m128i*)(dp + i), x);
+    a = _mm_shuffle_epi32(
+        _mm_shufflehi_epi16(_mm_unpackhi_epi8(x, x), 0xff), 0xff);
+  }
+  for (; i < rlen; ++i) dp[i] = sp[i] + (i >= 1 ? dp[i - 1] : 0);
+}
+
+static void unfilter_sub3_sse2(unsigned char *dp, const unsigned char *sp,
+                               uint32_t rlen) {
+  /* Each iteration does 5 pixels (15 bytes), and it keeps byte 15 intact
+   * (it may be the next input byte if sp == dp).
+   */
+  const __m128i mask = _mm_srli_si128(_mm_set1_epi8(-1), 1);
+  __m128i a = _mm_setzero_si128(), x;  /* a: The last pixel, 5 times. */
+  uint32_t i;
+  for (i = 0; i + 16 <= rlen; i += 15) {
+    x = _mm_loadu_si128((const __m128i*)(sp + i));
+    x = _mm_add_epi8(x, _mm_and_si128(_mm_slli_si128(x, 3), mask));
+    x = _mm_add_epi8(x, _mm_and_si128(_mm_slli_si128(x, 6), mask));
+    x = _mm_add_epi8(x, _mm_and_si128(_mm_slli_si128(x, 12), mask));
+    x = _mm_add_epi8(x, a);
+    _mm_storeu_si128((__m128i*)(dp + i), x);
+    a = _mm_srli_si128(_mm_slli_si128(x, 1), 13);  /* Bytes 12..14. */
+    a = _mm_or_si128(a, _mm_slli_si128(a, 3));
+    a = _mm_or_si128(a, _mm_slli_si128(a, 6));
+    a = _mm_and_si128(_mm_or_si128(a, _mm_slli_si128(a, 12)), mask);
+  }
+  for (; i < rlen; ++i) dp[i] = sp[i] + (i >= 3 ? dp[i - 3] : 0);
+}
+
+static void unfilter_average3_sse2(unsigned char *dp, const unsigned char *sp,
+                                   const unsigned char *dr, uint32_t rlen) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128(), b;  /* a: The last pixel. */
+  uint32_t i;
+  for (i = 0; i + 4 <= rlen; i += 3) {
+    b = load4_sse2(dr + i);
+    /* _mm_avg_epu8 rounds up, we need rounding down. */
+    a = _mm_add_epi8(load4_sse2(sp + i), _mm_sub_epi8(
+        _mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+    store3_sse2(dp + i, a);
+  }
+  for (; i < rlen; ++i) {
+    dp[i] = sp[i] + (((i >= 3 ? dp[i - 3] : 0) + dr[i]) >> 1);
+  }
+}
+
+static void unfilter_paeth3_sse2(unsigned char *dp, const unsigned char *sp,
+                                 const unsigned char *dr, uint32_t rlen) {
+  /* a (left), b (up) and c (up-left) have 16-bit components. */
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b, c = zero, pa, pb, pc, smallest;
+  uint32_t i;
+  for (i = 0; i + 4 <= rlen; i += 3, c = b) {
+    b = _mm_unpacklo_epi8(load4_sse2(dr + i), zero);
+    pa = _mm_sub_epi16(b, c);  /* p - a. */
+    pb = _mm_sub_epi16(a, c);  /* p - b. */
+    pc = _mm_add_epi16(pa, pb);  /* p - c. */
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    a = _mm_add_epi8(_mm_unpacklo_epi8(load4_sse2(sp + i), zero),
+        if_then_else_sse2(_mm_cmpeq_epi16(smallest, pa), a,
+        if_then_else_sse2(_mm_cmpeq_epi16(smallest, pb), b, c)));
+    store3_sse2(dp + i, _mm_packus_epi16(a, a));
+  }
+  for (; i < rlen; ++i) {
+    dp[i] = sp[i] + (i >= 3 ? paeth_predictor(dp[i - 3], dr[i], dr[i - 3]) :
+                     dr[i]);
+  }
+}
+
+#if USE_SSSE3
+/* Same as unfilter_paeth3_sse2, but with _mm_abs_epi16. */
+static __attribute__((target("ssse3"))) void unfilter_paeth3_ssse3(
+    unsigned char *dp, const unsigned char *sp, const unsigned char *dr,
+    uint32_t rlen) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b, c = zero, pa, pb, pc, smallest;
+  uint32_t i;
+  for (i = 0; i + 4 <= rlen; i += 3, c = b) {
+    b = _mm_unpacklo_epi8(load4_sse2(dr + i), zero);
+    pa = _mm_sub_epi16(b, c);
+    pb = _mm_sub_epi16(a, c);
+    pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    a = _mm_add_epi8(_mm_unpacklo_epi8(load4_sse2(sp + i), zero),
+        if_then_else_sse2(_mm_cmpeq_epi16(smallest, pa), a,
+        if_then_else_sse2(_mm_cmpeq_epi16(smallest, pb), b, c)));
+    store3_sse2(dp + i, _mm_packus_epi16(a, a));
+  }
+  for (; i < rlen; ++i) {
+    dp[i] = sp[i] + (i >= 3 ? paeth_predictor(dp[i - 3], dr[i], dr[i - 3]) :
+                     dr[i]);
+  }
+}
+#endif
+
+/* Like unfilter_png_row, but returns 0 (without doing anything) if there
+ * is no SIMD kernel for the arguments.
+ */
+static xbool_t unfilter_png_row_sse2(
+    char predictor, unsigned char *dp, const unsigned char *sp,
+    const unsigned char *dr, uint32_t rlen, uint32_t left_delta_inv) {
+  switch (predictor) {
+   case PNG_PR_SUB: do_sub:
+    if (left_delta_inv == 1) {
+      unfilter_sub1_sse2(dp, sp, rlen);
+    } else if (left_delta_inv == 3) {
+      unfilter_sub3_sse2(dp, sp, rlen);
+    } else {
+      return 0;
+    }
+    return 1;
+   case PNG_PR_UP:
+    if (!dr) return 0;  /* First row. */
+    unfilter_up_sse2(dp, sp, dr, rlen);
+    return 1;
+   case PNG_PR_AVERAGE:
+    /* There is no speedup for left_delta_inv == 1: 1 byte per pixel. */
+    if (!dr || left_delta_inv != 3) return 0;
+    unfilter_average3_sse2(dp, sp, dr, rlen);
+    return 1;
+   case PNG_PR_PAETH:
+    if (!dr) goto do_sub;  /* First row. */
+    if (left_delta_inv != 3) return 0;
+#if USE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+      unfilter_paeth3_ssse3(dp, sp, dr, rlen);
+      return 1;
+    }
+#endif
+    unfilter_paeth3_sse2(dp, sp, dr, rlen);
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+/* Unfilters a PNG row: sets dp[:rlen] to sp[:rlen] plus the prediction for
+ * predictor, based on the bytes already written to dp and on the previous
+ * (unfiltered) row dr[:rlen]. dr is NULL for the first row. sp can be the
+ * same as dp.
+ */
+static void unfilter_png_row(char predictor, unsigned char *dp,
+                             const unsigned char *sp, const unsigned char *dr,
+                             uint32_t rlen, uint32_t left_delta_inv) {
+  unsigned char *dpleft = dp + left_delta_inv;
+  unsigned char *dpend = dp + rlen;
+  register const unsigned char *dc;
+#if USE_SSE2
+  if (unfilter_png_row_sse2(predictor, dp, sp, dr, rlen, left_delta_inv)) {
+    return;
+  }
+#endif
+  /* It's important here that dr and dc are _unsigned_ char* */
+  switch (predictor) {
+   case PNG_PR_SUB: do_sub:
+    for (; dp != dpend && dp != dpleft; *dp++ = *sp++) {}
+    for (dc = dp - left_delta_inv; dp != dpend; *dp++ = *sp++ + *dc++) {}
+    break;
+   case PNG_PR_UP:
+    if (!dr) goto do_none;  /* First row. */
+    for (; dp != dpend; *dp++ = *sp++ + *dr++) {}
+    break;
+   case PNG_PR_AVERAGE:
+    if (!dr) {  /* First row. */
+      for (; dp != dpend && dp != dpleft; *dp++ = *sp++) {}
+      for (dc = dp - left_delta_inv; dp != dpend; *dp++ = *sp++ + (*dc++ >> 1)) {}
+    } else {
+      for (; dp != dpend && dp != dpleft; *dp++ = *sp++ + (*dr++ >> 1)) {}
+      for (dc = dp - left_delta_inv; dp != dpend; *dp++ = *sp++ + ((*dc++ + *dr++) >> 1)) {}
+    }
+    break;
+   case PNG_PR_PAETH:
+    if (!dr) goto do_sub;  /* First row. */
+    for (; dp != dpend && dp != dpleft; *dp++ = *sp++ + *dr++) {}
+    for (dc = dp - left_delta_inv; dp != dpend; *dp++ = *sp++ + paeth_predictor(*dc++, *dr, *(dr - left_delta_inv)), ++dr) {}
+    break;
+   default: do_none:  /* PNG_PR_NONE. */
+    if (sp != dp) memcpy(dp, sp, rlen);
+  }
+}
+
+#if USE_PTHREAD
+/* Don't pipeline the decoding of PNG image data smaller than this. */
+#define PNG_PIPE_MIN_SIZE 262144
+/* Approximate size of the ring of filtered rows in a PngPipe. */
+#define PNG_PIPE_RING_SIZE 262144
+
+/* Pipelined decoding of PNG_FILTER_DEFAULT image data: the calling thread
+ * inflates filtered rows (predictor byte + rlen bytes) to a ring of slots,
+ * and a helper thread unfilters them to dp0.
+ */
+typedef struct PngPipe {
+  unsigned char *ring;
+  uint32_t ring_rows, row_size;
+  unsigned char *dp0;
+  uint32_t rlen, left_delta_inv;
+  /* If not NULL, the helper thread adds the unfiltered rows to it. */
+  ImageStats *stats;
+  uint8_t color_type;
+  /* Row counts. Protected by mutex. */
+  uint32_t produced, consumed;
+  /* Protected by mutex. Set when no more rows will be produced. */
+  xbool_t is_done;
+  /* Protected by mutex. Set when the remaining rows should be dropped. */
+  xbool_t is_aborted;
+  pthread_mutex_t mutex;
+  /* Signaled when any of the fields above change. */
+  pthread_cond_t cond;
+  pthread_t thread;
+} PngPipe;
+
+static void *png_pipe_worker(void *pp_arg) {
+  PngPipe *pp = (PngPipe*)pp_arg;
+  const uint32_t rlen = pp->rlen;
+  uint32_t y;
+  const unsigned char *sp;
+  unsigned char *dp = pp->dp0;
+  for (y = 0;; ++y, dp += rlen) {
+    pthread_mutex_lock(&pp->mutex);
+    while (y == pp->produced && !pp->is_done && !pp->is_aborted) {
+      pthread_cond_wait(&pp->cond, &pp->mutex);
+    }
+    if (y == pp->produced || pp->is_aborted) {
+      pthread_mutex_unlock(&pp->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&pp->mutex);
+    sp = pp->ring + y % pp->ring_rows * pp->row_size;
+    unfilter_png_row(*sp, dp, sp + 1, y == 0 ? NULL : dp - rlen, rlen,
+                     pp->left_delta_inv);
+    if (pp->stats) {
+      add_image_stats_rows(pp->stats, pp->color_type, (const char*)dp, rlen);
+    }
+    pthread_mutex_lock(&pp->mutex);
+    pp->consumed = y + 1;
+    pthread_cond_signal(&pp->cond);
+    pthread_mutex_unlock(&pp->mutex);
+  }
+  return NULL;
+}
+
+/* Returns 0 if the helper thread couldn't be started. */
+static xbool_t start_png_pipe(PngPipe *pp, unsigned char *dp0, uint32_t rlen,
+                              uint32_t height, uint32_t left_delta_inv,
+                              ImageStats *stats, uint8_t color_type) {
+  pp->row_size = add_check(rlen, 1);
+  pp->ring_rows = PNG_PIPE_RING_SIZE / pp->row_size;
+  if (pp->ring_rows < 2) pp->ring_rows = 2;
+  if (pp->ring_rows > height) pp->ring_rows = height;
+  pp->ring = (unsigned char*)scratch_alloc(
+      multiply_check(pp->ring_rows, pp->row_size));
+  pp->dp0 = dp0;
+  pp->rlen = rlen;
+  pp->left_delta_inv = left_delta_inv;
+  pp->stats = stats;
+  pp->color_type = color_type;
+  pp->produced = pp->consumed = 0;
+  pp->is_done = pp->is_aborted = 0;
+  if (pthread_mutex_init(&pp->mutex, NULL)) die("error in pthread_mutex_init");
+  if (pthread_cond_init(&pp->cond, NULL)) die("error in pthread_cond_init");
+  if (pthread_create(&pp->thread, NULL, png_pipe_worker, pp)) {
+    pthread_cond_destroy(&pp->cond);
+    pthread_mutex_destroy(&pp->mutex);
+    scratch_free(pp->ring);
+    return 0;
+  }
+  return 1;
+}
+
+/* Passes the row in the current slot to the helper thread, and returns the
+ * slot for the next row. Waits for a free slot.
+ */
+static unsigned char *put_png_pipe_row(PngPipe *pp) {
+  uint32_t produced;
+  pthread_mutex_lock(&pp->mutex);
+  produced = ++pp->produced;
+  pthread_cond_signal(&pp->cond);
+  while (produced - pp->consumed >= pp->ring_rows) {
+    pthread_cond_wait(&pp->cond, &pp->mutex);
+  }
+  pthread_mutex_unlock(&pp->mutex);
+  return pp->ring + produced % pp->ring_rows * pp->row_size;
+}
+
+/* Waits for the helper thread to unfilter the remaining rows (or to stop
+ * if is_aborted), and frees resources.
+ */
+static void stop_png_pipe(PngPipe *pp, xbool_t is_aborted) {
+  pthread_mutex_lock(&pp->mutex);
+  pp->is_done = 1;
+  pp->is_aborted = is_aborted;
+  pthread_cond_signal(&pp->cond);
+  pthread_mutex_unlock(&pp->mutex);
+  pthread_join(pp->thread, NULL);
+  pthread_cond_destroy(&pp->cond);
+  pthread_mutex_destroy(&pp->mutex);
+  scratch_free(pp->ring);
+}
+
+static void abort_png_pipe(void *pp_arg) {
+  stop_png_pipe((PngPipe*)pp_arg, 1);
+}
+#endif
+
+/* --- Alpha channel and transparency (--alpha-output). */
+
+/* The alpha channel (or the tRNS chunk) of a PNG, as a separate image. */
+typedef struct AlphaMask {
+  /* CT_GRAY, bpc=8, or bpc=16 for an alpha channel of a bpc=16 PNG which
+   * can't be reduced. Allocated only if is_used.
+   */
+  Image img;
+  /* Does the input have an alpha channel or a tRNS chunk? */
+  xbool_t is_used;
+  /* Bitwise AND of all alpha bytes, 255 iff the image is fully opaque. */
+  unsigned char and_alpha;
+  uint32_t trns_size;  /* Number of bytes in trns. */
+  /* Payload of the tRNS chunk: alpha of each palette entry, or the 16-bit
+   * sample values of the transparent color.
+   */
+  unsigned char trns[256];
+} AlphaMask;
+
+static void init_alpha_mask(AlphaMask *am) {
+  noalloc_image(&am->img);
+  am->is_used = 0;
+  am->and_alpha = 255;
+  am->trns_size = 0;
+}
+
+/* For push_die_cleanup. */
+static void abort_alpha_mask(void *am_arg) {
+  dealloc_image(&((AlphaMask*)am_arg)->img);
+}
+
+static void alloc_alpha_mask(AlphaMask *am, uint32_t width, uint32_t height,
+                             uint8_t bpc) {
+  realloc_image(&am->img, width, height, bpc, CT_GRAY, 0, 0);
+  am->is_used = 1;
+  am->and_alpha = 255;
+}
+
+/* Converts the sample value in PNG tRNS to the bpc of img. Returns -1 if
+ * no sample in img can have that value.
+ */
+static int32_t get_trns_sample(const unsigned char *p, uint8_t png_bpc,
+                               const Image *img) {
+  const uint32_t v = p[0] << 8 | p[1];
+  if (img->bpc == 16) return v;
+  if (png_bpc == 16) return v % 257 == 0 ? (int32_t)(v / 257) : -1;
+  if (v >> png_bpc != 0) return -1;
+  return v * (255 / ((1 << png_bpc) - 1));  /* Same as convert_to_bpc. */
+}
+
+/* Creates am->img from the tRNS chunk in am->trns and img (with bpc=8 or
+ * bpc=16), in a single pass.
+ */
+static void apply_png_trns(AlphaMask *am, const Image *img, uint8_t png_bpc) {
+  const unsigned char *p = (const unsigned char*)img->data;
+  const unsigned char *pend = p + img->rlen * img->height;
+  unsigned char *op, and_alpha = 255;
+  alloc_alpha_mask(am, img->width, img->height, 8);
+  op = (unsigned char*)am->img.data;
+  if (img->color_type == CT_INDEXED_RGB) {
+    unsigned char alpha[256];
+    memset(alpha, 255, sizeof(alpha));
+    memcpy(alpha, am->trns, am->trns_size);
+    for (; p != pend; and_alpha &= *op++ = alpha[*p++]) {}
+  } else {
+    const uint32_t cpp = img->cpp, bps = img->bpc >> 3;  /* Bytes/sample. */
+    unsigned char key[6];  /* Transparent color, in the format of img. */
+    uint32_t i;
+    if (am->trns_size != 2 * cpp) die("bad png trns size");
+    for (i = 0; i < cpp; ++i) {
+      const int32_t v = get_trns_sample(am->trns + 2 * i, png_bpc, img);
+      if (v < 0) {  /* Fully opaque. */
+        memset(op, 255, am->img.rlen * am->img.height);
+        am->and_alpha = 255;
+        return;
+      }
+      if (bps == 2) {
+        key[2 * i] = v >> 8; key[2 * i + 1] = v;
+      } else {
+        key[i] = v;
+      }
+    }
+    for (i = cpp * bps; p != pend; p += i) {
+      and_alpha &= *op++ = memcmp(p, key, i) == 0 ? 0 : 255;
+    }
+  }
+  am->and_alpha = and_alpha;
+}
+
+/* --- Adam7 deinterlacing. */
+
+/* Start column, start row, column step and row step of the 7 passes. */
+static const uint8_t kAdam7X0[7] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t kAdam7Y0[7] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t kAdam7DX[7] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t kAdam7DY[7] = {8, 8, 8, 4, 4, 2, 2};
+
+/* State of streaming Adam7 deinterlacing: each row of a pass is inflated to
+ * a row buffer, unfiltered against the previous row of the same pass, and
+ * its pixels are scattered to img->data.
+ */
+typedef struct Adam7 {
+  unsigned char *rows;  /* 2 row buffers, for a full row each. */
+  unsigned char *row, *prev_row;  /* prev_row is NULL for the first row. */
+  uint32_t row_size;  /* Size of each of the 2 row buffers. */
+  uint32_t pass;  /* 0..6, or 7 at the end. */
+  uint32_t y;  /* Row within the pass. */
+  uint32_t pass_width, pass_height, pass_rlen;
+  uint32_t cpp;  /* Samples per pixel in the PNG, img->cpp + (am != NULL). */
+  AlphaMask *am;  /* If not NULL, the alpha samples are split to am->img. */
+} Adam7;
+
+static uint32_t get_adam7_pass_size(uint32_t size, uint8_t start,
+                                    uint8_t step) {
+  return size <= start ? 0 : (size - start + step - 1) / step;
+}
+
+/* Returns the number of bytes of image data (without the predictor bytes)
+ * in all passes of an Adam7 image with cpp samples per pixel.
+ */
+static uint32_t get_adam7_data_size(const Image *img, uint32_t cpp) {
+  uint32_t pass, size = 0;
+  for (pass = 0; pass < 7; ++pass) {
+    const uint32_t pass_width =
+        get_adam7_pass_size(img->width, kAdam7X0[pass], kAdam7DX[pass]);
+    const uint32_t pass_height =
+        get_adam7_pass_size(img->height, kAdam7Y0[pass], kAdam7DY[pass]);
+    if (pass_width != 0) {
+      size = add_check(size, multiply_check(
+          (pass_width * cpp * img->bpc + 7) >> 3, pass_height));
+    }
+  }
+  return size;
+}
+
+/* Moves to the next nonempty pass (starting at pass). */
+static void start_adam7_pass(Adam7 *a7, const Image *img, uint32_t pass) {
+  for (; pass < 7; ++pass) {
+    a7->pass_width =
+        get_adam7_pass_size(img->width, kAdam7X0[pass], kAdam7DX[pass]);
+    a7->pass_height =
+        get_adam7_pass_size(img->height, kAdam7Y0[pass], kAdam7DY[pass]);
+    if (a7->pass_width != 0 && a7->pass_height != 0) break;
+  }
+  a7->pass = pass;
+  a7->y = 0;
+  a7->pass_rlen = (a7->pass_width * a7->cpp * img->bpc + 7) >> 3;
+  a7->prev_row = NULL;
+}
+
+/* Clears img->data (and am->img.data), because pixels of truncated passes
+ * remain 0. am is NULL if there is no alpha channel.
+ */
+static void start_adam7(Adam7 *a7, Image *img, AlphaMask *am) {
+  a7->am = am;
+  a7->cpp = img->cpp + (am != NULL);
+  memset(img->data, '\0', img->rlen * img->height);
+  if (am) memset(am->img.data, '\0', am->img.rlen * am->img.height);
+  a7->row_size = (multiply_check(img->width, a7->cpp * img->bpc) + 7) >> 3;
+  a7->rows = (unsigned char*)scratch_alloc(multiply_check(a7->row_size, 2));
+  a7->row = a7->rows;
+  start_adam7_pass(a7, img, 0);
+}
+
+/* Unfilters the (just inflated) current row a7->row with predictor,
+ * scatters its pixels to img->data, and moves to the next row.
+ */
+static void put_adam7_row(Adam7 *a7, Image *img, char predictor,
+                          uint32_t left_delta_inv) {
+  const uint32_t pass = a7->pass;
+  unsigned char *sp = a7->row;
+  const uint32_t y = kAdam7Y0[pass] + a7->y * kAdam7DY[pass];
+  unsigned char *dp = (unsigned char*)img->data + y * img->rlen;
+  const uint32_t x0 = kAdam7X0[pass], dx = kAdam7DX[pass];
+  uint32_t i;
+  unfilter_png_row(predictor, sp, sp, a7->prev_row, a7->pass_rlen,
+                   left_delta_inv);
+  if (a7->am) {  /* bpc == 8 or bpc == 16, for both img and a7->am->img. */
+    const uint32_t bps = img->bpc >> 3;  /* Bytes per sample. */
+    const uint32_t bpp = img->cpp * bps;  /* Bytes per pixel in img. */
+    unsigned char *adp = (unsigned char*)a7->am->img.data +
+        y * a7->am->img.rlen + x0 * bps;
+    unsigned char and_alpha = a7->am->and_alpha;
+    for (dp += x0 * bpp, i = a7->pass_width; i > 0; --i, sp += bpp + bps) {
+      memcpy(dp, sp, bpp);
+      memcpy(adp, sp + bpp, bps);
+      and_alpha &= adp[0] & adp[bps - 1];
+      dp += dx * bpp;
+      adp += dx * bps;
+    }
+    a7->am->and_alpha = and_alpha;
+  } else if (dx == 1) {  /* Pass 7 has full rows. */
+    memcpy(dp, sp, a7->pass_rlen);
+  } else if (img->bpc >= 8) {
+    const uint32_t bpp = img->cpp * (img->bpc >> 3);  /* Bytes per pixel. */
+    for (dp += x0 * bpp, i = a7->pass_width; i > 0; --i, sp += bpp) {
+      memcpy(dp, sp, bpp);
+      dp += dx * bpp;
+    }
+  } else {  /* Samples don't span byte boundaries. */
+    const uint32_t bpc = img->bpc, cpp = img->cpp;
+    const unsigned mask = (1 << bpc) - 1;
+    const uint32_t sample_count = a7->pass_width * cpp;
+    uint32_t sb, db;
+    for (i = 0; i < sample_count; ++i) {
+      sb = i * bpc;
+      db = ((x0 + i / cpp * dx) * cpp + i % cpp) * bpc;
+      dp[db >> 3] |= ((sp[sb >> 3] >> (8 - bpc - (sb & 7))) & mask) <<
+          (8 - bpc - (db & 7));
+    }
+  }
+  a7->prev_row = a7->row;
+  a7->row = a7->row == a7->rows ? a7->rows + a7->row_size : a7->rows;
+  if (++a7->y == a7->pass_height) start_adam7_pass(a7, img, pass + 1);
+}
+
+/* --- 16-bit PNG input. */
+
+/* Returns whether all bpc=16 samples in p[:size] can be reduced to bpc=8
+ * losslessly, i.e. each is 257 * v (with v <= 255).
+ */
+static xbool_t is_bpc8_enough(const unsigned char *p, uint32_t size) {
+  const unsigned char *pend = p + size;
+  for (; p != pend; p += 2) {
+    if (p[0] != p[1]) return 0;
+  }
+  return 1;
+}
+
+/* Reduces bpc=16 samples p[:size] to bpc=8 op[:size / 2]. op can be p. */
+static void convert_bpc16_to_bpc8(unsigned char *op, const unsigned char *p,
+                                  uint32_t size) {
+  const unsigned char *pend = p + size;
+  for (; p != pend; p += 2) *op++ = *p;
+}
+
+/* Changes img from bpc=8 to bpc=16, keeping the first row_count rows. */
+static void convert_rows_to_bpc16(Image *img, uint32_t row_count) {
+  uint32_t i = img->rlen * row_count;
+  const uint32_t alloced = set_image_shape(
+      img, img->width, img->height, 16, img->color_type, 0, 0);
+  unsigned char *p;
+  if (img->alloced < alloced) {
+    if (!(img->data = (char*)realloc(img->data, alloced))) {
+      die("out of memory");
+    }
+    img->alloced = alloced;
+  }
+  /* Backwards, because it's in place. */
+  for (p = (unsigned char*)img->data; i > 0;) {
+    --i;
+    p[2 * i] = p[2 * i + 1] = p[i];
+  }
+}
+
+/* Returns whether the bpc=16 CT_RGB img has only gray pixels, so
+ * convert_to_gray works.
+ */
+static xbool_t is_rgb16_gray(const Image *img) {
+  const unsigned char *p = (const unsigned char*)img->data;
+  const unsigned char *pend = p + img->rlen * img->height;
+  for (; p != pend; p += 6) {
+    if (p[0] != p[2] || p[0] != p[4] || p[1] != p[3] || p[1] != p[5]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Reduces img from bpc=16 to bpc=8 in place, if it's lossless. */
+static void reduce_image_to_bpc8(Image *img) {
+  const uint32_t size = img->rlen * img->height;
+  if (img->bpc != 16 || !is_bpc8_enough((unsigned char*)img->data, size)) {
+    return;
+  }
+  convert_bpc16_to_bpc8(
+      (unsigned char*)img->data, (unsigned char*)img->data, size);
+  set_image_shape(img, img->width, img->height, 8, img->color_type, 0, 0);
+}
+
+/* Decoding state of non-interlaced PNG image data which isn't inflated
+ * to img->data directly. Each row is inflated to a row buffer, unfiltered
+ * against the previous row, and then:
+ *
+ * * bpc=16: copied to img->data at bpc=8 if all rows so far could be
+ *   reduced losslessly. Thus the bpc=16 image buffer (twice as large) is
+ *   allocated only for images which need it.
+ * * with an alpha channel: split to img->data and am->img.data. At bpc=16,
+ *   each of them is kept at bpc=8 while all its rows so far could be
+ *   reduced losslessly.
+ * * bpc=1, 2 or 4 (with force_bpc8): unpacked to img->data at bpc=8, so
+ *   there is no need for a separate convert_to_bpc pass.
+ */
+typedef struct PngRows {
+  unsigned char *rows;  /* 2 row buffers, rlen bytes each. */
+  unsigned char *row, *prev_row;  /* prev_row is NULL for the first row. */
+  uint32_t rlen;  /* Of a PNG row. */
+  uint32_t y;  /* Number of rows in img->data. */
+  AlphaMask *am;  /* Not NULL iff there is an alpha channel. */
+  uint8_t bpc;  /* Of the PNG. */
+} PngRows;
+
+/* img must have bpc=8. am is NULL if there is no alpha channel. */
+static void start_png_rows(PngRows *pr, const Image *img, AlphaMask *am,
+                           uint8_t bpc) {
+  pr->am = am;
+  pr->bpc = bpc;
+  pr->rlen = am ? multiply_check(img->width, (img->cpp + 1) * (bpc >> 3)) :
+      bpc == 16 ? multiply_check(img->rlen, 2) :
+      (multiply_check(img->rlen, bpc) + 7) >> 3;
+  pr->rows = (unsigned char*)scratch_alloc(multiply_check(pr->rlen, 2));
+  pr->row = pr->rows;
+  pr->prev_row = NULL;
+  pr->y = 0;
+}
+
+/* Splits the unfiltered bpc=16 row sp (with alpha) of pr to img->data and
+ * pr->am->img.data, changing each of them to bpc=16 first if this row can't
+ * be reduced to bpc=8.
+ */
+static void put_png_rows_alpha16_row(PngRows *pr, Image *img,
+                                     const unsigned char *sp) {
+  const uint32_t cpp = img->cpp;
+  const unsigned char *p, *pend = sp + pr->rlen;
+  Image *aimg = &pr->am->img;
+  unsigned char *dp, *adp, and_alpha = pr->am->and_alpha;
+  xbool_t is_color8 = 1, is_alpha8 = 1;
+  uint32_t i;
+  for (p = sp; p != pend; p += 2) {
+    for (i = 0; i < cpp; ++i, p += 2) {
+      if (p[0] != p[1]) is_color8 = 0;
+    }
+    if (p[0] != p[1]) is_alpha8 = 0;
+  }
+  if (img->bpc == 8 && !is_color8) convert_rows_to_bpc16(img, pr->y);
+  if (aimg->bpc == 8 && !is_alpha8) convert_rows_to_bpc16(aimg, pr->y);
+  dp = (unsigned char*)img->data + pr->y * img->rlen;
+  adp = (unsigned char*)aimg->data + pr->y * aimg->rlen;
+  for (p = sp; p != pend; p += 2) {
+    for (i = 0; i < cpp; ++i, p += 2) {
+      *dp++ = p[0];
+      if (img->bpc == 16) *dp++ = p[1];
+    }
+    *adp++ = p[0];
+    if (aimg->bpc == 16) *adp++ = p[1];
+    and_alpha &= p[0] & p[1];
+  }
+  pr->am->and_alpha = and_alpha;
+}
+
+/* Unfilters the (just inflated) current row pr->row with predictor, and
+ * appends it to img->data.
+ */
+static void put_png_rows_row(PngRows *pr, Image *img, char predictor,
+                             uint32_t left_delta_inv) {
+  unsigned char *sp = pr->row;
+  unsigned char *dp = (unsigned char*)img->data + pr->y * img->rlen;
+  unfilter_png_row(predictor, sp, sp, pr->prev_row, pr->rlen,
+                   left_delta_inv);
+  if (pr->am && pr->bpc == 16) {
+    put_png_rows_alpha16_row(pr, img, sp);
+  } else if (pr->am) {
+    const uint32_t cpp = img->cpp;
+    const unsigned char *p = sp, *pend = sp + pr->rlen;
+    unsigned char *adp =
+        (unsigned char*)pr->am->img.data + pr->y * pr->am->img.rlen;
+    unsigned char and_alpha = pr->am->and_alpha;
+    if (cpp == 1) {
+      for (; p != pend; p += 2) {
+        *dp++ = p[0];
+        and_alpha &= *adp++ = p[1];
+      }
+    } else {
+      for (; p != pend; p += 4, dp += 3) {
+        dp[0] = p[0]; dp[1] = p[1]; dp[2] = p[2];
+        and_alpha &= *adp++ = p[3];
+      }
+    }
+    pr->am->and_alpha = and_alpha;
+  } else if (pr->bpc < 8) {
+    unpack_row_to_bpc8((char*)dp, (const char*)sp, img->rlen, pr->bpc,
+                       img->color_type == CT_INDEXED_RGB);
+  } else {
+    if (img->bpc == 8 && !is_bpc8_enough(sp, pr->rlen)) {
+      convert_rows_to_bpc16(img, pr->y);
+      dp = (unsigned char*)img->data + pr->y * img->rlen;
+    }
+    if (img->bpc == 8) {
+      convert_bpc16_to_bpc8(dp, sp, pr->rlen);
+    } else {
+      memcpy(dp, sp, pr->rlen);
+    }
+  }
+  pr->prev_row = sp;
+  pr->row = sp == pr->rows ? pr->rows + pr->rlen : pr->rows;
+  ++pr->y;
+}
+
+/* Reads a PNG image from src to img. img must be initialized (at least
+ * noalloc_image).
+ *
+ * thread_count: If larger than 1, unfilter large images on a helper thread
+ * while inflating. The output doesn't depend on it.
+ *
+ * If stats is not NULL, adds the image data to it (if possible while
+ * unfiltering).
+ *
+ * If rw is not NULL, and rw can write the image as is (without changing the
+ * color type or bpc), then it doesn't keep the image in memory, but it
+ * writes the rows to rw as they are read (and it sets rw->is_started).
+ * Then img->data contains only 2 rows, and force_bpc8 and stats are
+ * ignored. The caller must call finish_png_row_writer.
+ *
+ * If ic is not NULL, saves the compressed image data to it (unless rw is
+ * used). ic->data must be initialized (e.g. with nofile_sink).
+ *
+ * If am is not NULL, it splits the alpha channel (of CT_GRAY_ALPHA and
+ * CT_RGB_ALPHA) to am while reading, reducing bpc=16 to bpc=8 separately
+ * for img and am->img if possible, or it creates am from the tRNS chunk
+ * after reading. Otherwise it fails on an alpha channel, and it ignores
+ * tRNS.
+ */
+static void read_png_stream(Source *src, Image *img, xbool_t force_bpc8,
+                            uint32_t thread_count, ImageStats *stats,
+                            PngRowWriter *rw, IdatCopy *ic, AlphaMask *am) {
+  uint32_t width, height, palette_size = 0;
+  uint8_t bpc, color_type, filter, interlace;
+  xbool_t has_alpha, do_unpack;
+#if !NO_PMTIFF
+  uint8_t bpx = 0;
+#endif
+  char right_and_byte = 0;
+  /* Must be large enough for the PNG header (33 bytes), for the palette (3
+   * * 256 bytes), and must be fast enough for inflate, and must be at least
    * 4 bytes (adler32 checksum size) for inflate.
    */
   char buf[8192], *p;
   unsigned char *dp0 = 0;
   register unsigned char *dp = NULL;
-  char predictor;
+  char predictor, *predictorp = &predictor;
   uint32_t d_remaining = (uint32_t)-1, rlen = 0;
+  JobStats *job_stats = get_job_stats();
+  double inflate_wall = 0, t = 0;
+  uint32_t rows_remaining = 0;  /* Used only with rw. */
   int32_t left_delta_inv = 0;
-  z_stream zs;
+  z_stream zs_storage, *zs = NULL;
   int zr = Z_OK;
   xbool_t do_one_more_inflate = 1;
-  if (33 != fread(buf, 1, 33, f)) die("png too short");
+  xbool_t is_alloced = 0;
+  /* Non-NULL iff we add the rows to stats right after unfiltering. */
+  ImageStats *row_stats = NULL;
+  Adam7 adam7, *a7 = NULL;  /* Non-NULL iff interlaced. */
+  /* Non-NULL iff not interlaced, and bpc == 16 or has_alpha or do_unpack. */
+  PngRows png_rows, *pr = NULL;
+#if USE_PTHREAD
+  PngPipe pipe, *pp = NULL;
+  DieCleanup pipe_cleanup;
+#else
+  (void)thread_count;
+#endif
+  if (33 != source_read(src, buf, 33)) die("png too short");
   /* https://tools.ietf.org/rfc/rfc2083.txt */
   if (0 != memcmp(buf, kPngHeader, 16)) die("bad signature in png");
   if (crc32(0, (const Bytef*)buf + 12, 17) != get_u32be(buf + 29)) {
     die("crc error in png ihdr");
   }
-  dealloc_image(img);
   width = get_u32be(buf + 16);
   height = get_u32be(buf + 20);
   p = buf + 24;
   bpc = *p++;
-  if (bpc == 16) die("not supported png bpc");
-  if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8) die("bad png bpc");
+  if (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16) {
+    die("bad png bpc");
+  }
   color_type = *p++;
   if (color_type != CT_GRAY && color_type != CT_RGB &&
-      color_type != CT_INDEXED_RGB) die("bad png color_type");
+      color_type != CT_INDEXED_RGB && color_type != CT_GRAY_ALPHA &&
+      color_type != CT_RGB_ALPHA) die("bad png color_type");
+  if (bpc == 16 && color_type == CT_INDEXED_RGB) die("bad png bpc");
+  if ((has_alpha = (color_type & 4) != 0)) {
+    if (!am) die("png alpha needs --alpha-output");
+    color_type &= ~4;  /* CT_GRAY or CT_RGB, am gets the alpha. */
+  }
   if (*p++ != PNG_COMPRESSION_DEFAULT) die("bad png compression");
   filter = *p++;
   /* PNG supports filter == 0 only; 1 and 2 are imgdataopt extensions. */
@@ -877,23 +3669,57 @@ static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
 #endif
       filter != PM_NONE
      ) die("bad png filter");
-  if (*p++ != PNG_INTERLACE_NONE) die("not supported png interlace");
+  interlace = *p++;
+  if (interlace != PNG_INTERLACE_NONE && interlace != PNG_INTERLACE_ADAM7) {
+    die("bad png interlace");
+  }
+  if (interlace != PNG_INTERLACE_NONE && filter != PNG_FILTER_DEFAULT) {
+    die("not supported png interlace");
+  }
+  if ((bpc == 16 || has_alpha) && filter != PNG_FILTER_DEFAULT) {
+    die("bad png filter");
+  }
+  /* With am, a later tRNS chunk may need all pixels. */
+  if (rw && (filter != PNG_FILTER_DEFAULT || am ||
+             interlace != PNG_INTERLACE_NONE || bpc == 16 ||
+             !is_png_row_writer_ok(rw, bpc, color_type))) {
+    rw = NULL;  /* Keep the image in memory, the caller will convert it. */
+  }
+  /* Unpack bpc < 8 rows to img->data right after unfiltering them. */
+  do_unpack = force_bpc8 && bpc < 8 && filter == PNG_FILTER_DEFAULT &&
+      interlace == PNG_INTERLACE_NONE && !rw;
+  if ((bpc == 8 || do_unpack) && filter == PNG_FILTER_DEFAULT &&
+      interlace == PNG_INTERLACE_NONE && !has_alpha && !rw) {
+    row_stats = stats;
+  }
+  if (rw) ic = NULL;
+  if (ic) {
+    ic->is_ok = 0;
+    ic->bpc = bpc;
+    ic->color_type = color_type;
+    ic->data.size = 0;
+  }
   for (;;) {
     uint32_t chunk_size;
-    if (8 != fread(buf, 1, 8, f)) die("eof in png chunk header");
+    if (8 != source_read(src, buf, 8)) die("eof in png chunk header");
     chunk_size = get_u32be(buf);
     p = buf + 4;
     {
-      /* We ignore every other chunk (such as gamma correction with gAMA and
-       * transparency in tRNS), so this code is not suitable as a
-       * general-purpose PNG renderer.
+      /* We ignore every other chunk (such as gamma correction with gAMA,
+       * and transparency in tRNS without am), so this code is not suitable
+       * as a general-purpose PNG renderer.
        */
       xbool_t is_plte = 0 == memcmp(p, "PLTE", 4);
       const xbool_t is_idat = 0 == memcmp(p, "IDAT", 4);
       const xbool_t is_iend = 0 == memcmp(p, "IEND", 4);
+      const xbool_t is_trns = am && 0 == memcmp(p, "tRNS", 4);
       uint32_t crc32v = crc32(0, (const Bytef*)p, 4);
+      if (is_trns) {
+        if (dp) die("png trns too late");
+        if (chunk_size > sizeof(am->trns)) die("bad png trns size");
+      }
       if (is_plte) {
-        if (img->data) die("png palette too late");
+        if (is_alloced) die("png palette too late");
         if (chunk_size == 0 || chunk_size > 3 * 256 || chunk_size % 3 != 0) {
           die("bad png palette size");
         }
@@ -914,16 +3740,30 @@ static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
           die("unexpected png palette");
         }
       }
-      if (is_idat && !img->data) {
+      if (is_idat && !is_alloced) {
         /* PNG requires that PLTE is appears after IDAT. */
         if (color_type == CT_INDEXED_RGB) die("missing png palette");
         palette_size = 0;
        do_alloc_image:
-        alloc_image(img, width, height, bpc, color_type, palette_size, force_bpc8);
+        if (rw) {  /* Only the previous and the current row. */
+          realloc_image(img, width, 2, bpc, color_type, palette_size, 0);
+          img->height = height;
+        } else {
+          /* Non-interlaced bpc=16 rows are reduced to bpc=8 if possible. */
+          realloc_image(img, width, height,
+                        (bpc == 16 && interlace == PNG_INTERLACE_NONE) ||
+                        do_unpack ? 8 : bpc,
+                        color_type, palette_size, force_bpc8);
+          if (has_alpha) {
+            alloc_alpha_mask(am, width, height,
+                             interlace == PNG_INTERLACE_NONE ? 8 : bpc);
+          }
+        }
+        is_alloced = 1;
 #if !NO_PMTIFF
         bpx = (img->cpp - 1) * bpc;
 #endif
-        left_delta_inv = bpc * img->cpp;
+        left_delta_inv = bpc * (img->cpp + has_alpha);
         right_and_byte = ((width & 7) * left_delta_inv) & 7;
         /* 0: 0xff, 1: 0x80, 2: 0xc0, 3: 0xe0, 4: 0xf0, 5: 0xf8, 6: 0xfc, 7: 0xfe. */
         right_and_byte = right_and_byte == 0 ? 0xff :
@@ -932,100 +3772,154 @@ static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
         left_delta_inv = ((left_delta_inv + 7) >> 3);
       }
       while (chunk_size > 0) {
-        const uint32_t want = chunk_size < sizeof(buf) ?
+        /* From memory (e.g. mmap), it inflates the chunk without copying. */
+        const uint32_t want = chunk_size < sizeof(buf) || !src->f ?
             chunk_size : sizeof(buf);
-        if (want != fread(buf, 1, want, f)) die("eof in png chunk");
+        const char *in = source_next(src, buf, want);
+        if (!in) die("eof in png chunk");
         if (is_plte) {
           if (want != chunk_size) die("ASSERT: png palette buf too small");
-          memcpy(img->palette, buf, palette_size);
+          memcpy(img->palette, in, palette_size);
+        } else if (is_trns) {
+          memcpy(am->trns, in, am->trns_size = want);
         } else if (is_idat) {
           if (!dp) {
-            zs.zalloc = xzalloc;  /* calloc to pacify valgrind. */
-            zs.zfree = NULL;
-            zs.opaque = NULL;
-            if (inflateInit(&zs)) die("error in deflateInit");
+            zs = start_inflate(&zs_storage);
             dp = dp0 = (unsigned char*)img->data;
             /* Overflow already checked by alloc_image. */
             rlen = img->rlen;
-            d_remaining = rlen * img->height;  /* Not 0, checked by alloc_image. */
+            if (rw) {
+              /* With rw, d_remaining is for the current row only. */
+              d_remaining = rlen;
+              rows_remaining = height;
+              start_png_row_writer(rw, img);
+            } else if (interlace != PNG_INTERLACE_NONE) {
+              a7 = &adam7;
+              start_adam7(a7, img, has_alpha ? am : NULL);
+              d_remaining = get_adam7_data_size(img, a7->cpp);  /* Not 0. */
+            } else if (bpc == 16 || has_alpha || do_unpack) {
+              pr = &png_rows;
+              start_png_rows(pr, img, has_alpha ? am : NULL, bpc);
+              d_remaining = multiply_check(pr->rlen, img->height);
+            } else {
+              d_remaining = rlen * img->height;  /* Not 0, checked by alloc_image. */
+            }
             if (filter == PNG_FILTER_DEFAULT) {
-              zs.next_out = (Bytef*)&predictor;
-              zs.avail_out = 1;
+#if USE_PTHREAD
+              if (thread_count > 1 && !rw && !a7 && !pr &&
+                  d_remaining >= PNG_PIPE_MIN_SIZE &&
+                  start_png_pipe(&pipe, dp0, rlen, img->height,
+                                 left_delta_inv, row_stats, color_type)) {
+                pp = &pipe;
+                push_die_cleanup(&pipe_cleanup, abort_png_pipe, pp);
+                predictorp = (char*)pp->ring;
+              }
+#endif
+              zs->next_out = (Bytef*)predictorp;
+              zs->avail_out = 1;
             } else if (filter == PM_NONE) {
-              zs.next_out = (Bytef*)dp;
-              zs.avail_out = d_remaining;  /* TODO(pts): Check for overflow. */
+              zs->next_out = (Bytef*)dp;
+              zs->avail_out = d_remaining;  /* TODO(pts): Check for overflow. */
 #if !NO_PMTIFF
             } else if (filter == PM_TIFF2) {
-              zs.next_out = (Bytef*)dp;
-              zs.avail_out = rlen;
+              zs->next_out = (Bytef*)dp;
+              zs->avail_out = rlen;
 #endif
             }
           }
           /* There was an error or EOF before, we can't inflate anymore. */
-          zs.next_in = (Bytef*)buf;
-          zs.avail_in = want;
+          zs->next_in = (Bytef*)in;
+          zs->avail_in = want;
+          if (ic) sink_write(&ic->data, in, want);
           if (d_remaining == 0 && zr == Z_OK && do_one_more_inflate) {
             /* Do one more inflate, so that it can process the adler32 checksum. */
             do_one_more_inflate = 0;
-            zs.next_out = (Bytef*)&predictor;
-            zs.avail_out = 1;
-            zr = inflate(&zs, Z_NO_FLUSH);
+            zs->next_out = (Bytef*)&predictor;
+            zs->avail_out = 1;
+            if (job_stats) t = get_wall_time();
+            zr = inflate(zs, Z_NO_FLUSH);
+            if (job_stats) inflate_wall += get_wall_time() - t;
             if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_DATA_ERROR) {
               die("inflate failed");
             }
           }
-          while (zr == Z_OK && zs.avail_in != 0 && d_remaining != 0) {
-            zr = inflate(&zs, Z_NO_FLUSH);
+          while (zr == Z_OK && zs->avail_in != 0 && d_remaining != 0) {
+            if (job_stats) t = get_wall_time();
+            zr = inflate(zs, Z_NO_FLUSH);
+            if (job_stats) inflate_wall += get_wall_time() - t;
             if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_DATA_ERROR) {
               die("inflate failed");
             }
             /* TODO(pts): Process a row partially if there is an EOD. */
-            if (zs.avail_out != 0) {
-            } else if (zs.next_out == (Bytef*)(&predictor + 1)) {
-              if ((unsigned char)predictor > 4) die("bad png predictor");
-              zs.next_out = (Bytef*)dp;
-              zs.avail_out = rlen;
+            if (zs->avail_out != 0) {
+            } else if (zs->next_out == (Bytef*)(predictorp + 1)) {
+              if ((unsigned char)*predictorp > 4) die("bad png predictor");
+              /* With pp, the row follows the predictor in the ring slot. */
+              zs->next_out = a7 ? (Bytef*)a7->row :
+                  pr ? (Bytef*)pr->row :
+                  predictorp == &predictor ? (Bytef*)dp :
+                  (Bytef*)(predictorp + 1);
+              zs->avail_out = a7 ? a7->pass_rlen : pr ? pr->rlen : rlen;
+#if USE_PTHREAD
+            } else if (pp) {
+              /* The helper thread will unfilter it to dp[:rlen]. */
+              predictorp = (char*)put_png_pipe_row(pp);
+              dp += rlen;
+              d_remaining -= rlen;
+              zs->next_out = (Bytef*)predictorp;
+              zs->avail_out = d_remaining != 0;
+#endif
+            } else if (a7) {
+              d_remaining -= a7->pass_rlen;
+              put_adam7_row(a7, img, predictor, left_delta_inv);
+              zs->next_out = (Bytef*)&predictor;
+              zs->avail_out = d_remaining != 0;
+            } else if (pr) {
+              d_remaining -= pr->rlen;
+              put_png_rows_row(pr, img, predictor, left_delta_inv);
+              if (row_stats) {
+                add_image_stats_rows(
+                    row_stats, color_type,
+                    img->data + (pr->y - 1) * img->rlen, img->rlen);
+              }
+              zs->next_out = (Bytef*)&predictor;
+              zs->avail_out = d_remaining != 0;
+            } else if (rw) {
+              /* The other row of img->data is the previous row. */
+              unsigned char *const dr = dp == dp0 ? dp0 + rlen : dp0;
+              unsigned char last_byte;
+              unfilter_png_row(predictor, dp, dp,
+                               rows_remaining == height ? NULL : dr, rlen,
+                               left_delta_inv);
+              last_byte = dp[rlen - 1];
+              /* Clear the unused bits only temporarily, so that it doesn't
+               * affect the predictor in the next row.
+               */
+              dp[rlen - 1] &= right_and_byte;
+              if (color_type == CT_INDEXED_RGB) {
+                check_palette_rows(img, (const char*)dp, rlen);
+              }
+              write_png_row(rw, (const char*)dp);
+              dp[rlen - 1] = last_byte;
+              dp = dr;
+              if (--rows_remaining == 0) d_remaining = 0;
+              zs->next_out = (Bytef*)&predictor;
+              zs->avail_out = d_remaining != 0;
             } else if (filter == PNG_FILTER_DEFAULT) {
               /* Now we've predictor and dp[:rlen] as the current row ready. */
-              unsigned char *dpleft = dp + left_delta_inv;
-              unsigned char *dpend = dp + rlen;
-              register unsigned char *dr, *dc;
-              switch (predictor) {
-               case PNG_PR_SUB: do_sub:
-                if ((uint32_t)left_delta_inv < rlen) {
-                  for (dc = dp, dp += left_delta_inv; dp != dpend; *dp++ += *dc++) {}
-                }
-                break;
-               case PNG_PR_UP:
-                if (dp != dp0) {  /* Skip it in the first row. */
-                  for (dr = dp - rlen; dp != dpend; *dp++ += *dr++) {}
-                }
-                break;
-               case PNG_PR_AVERAGE:
-                /* It's important here that dr and dc are _unsigned_ char* */
-                if (dp == dp0) {  /* First row. */
-                  for (; dp != dpend && dp != dpleft; ++dp) {}
-                  for (dc = dp - left_delta_inv; dp != dpend; *dp++ += *dc++ >> 1) {}
-                } else {
-                  for (dr = dp - rlen; dp != dpend && dp != dpleft; *dp++ += *dr++ >> 1) {}
-                  for (dc = dp - left_delta_inv; dp != dpend; *dp++ += (*dc++ + *dr++) >> 1) {}
-                }
-                break;
-               case PNG_PR_PAETH:
-                /* It's important here that dr and dc are _unsigned_ char* */
-                if (dp == dp0) goto do_sub;  /* First row. */
-                for (dr = dp - rlen; dp != dpend && dp != dpleft; *dp++ += *dr++) {}
-                for (dc = dp - left_delta_inv; dp != dpend; *dp++ += paeth_predictor(*dc++, *dr, *(dr - left_delta_inv)), ++dr) {}
-                break;
-               default: ; /* No special action needed for PNG_PR_NONE. */
-                dp = dpend;
+              unfilter_png_row(predictor, dp, dp, dp == dp0 ? NULL : dp - rlen,
+                               rlen, left_delta_inv);
+              if (row_stats) {
+                add_image_stats_rows(row_stats, color_type, (const char*)dp,
+                                     rlen);
               }
+              dp += rlen;
               /* We don't do `dp[-1] &= right_and_byte;' here, because it
                * would affect the output of the predictor in the next row.
                */
               d_remaining -= rlen;
-              zs.next_out = (Bytef*)&predictor;
-              zs.avail_out = d_remaining != 0;
+              zs->next_out = (Bytef*)&predictor;
+              zs->avail_out = d_remaining != 0;
             } else if (filter == PM_NONE) {
               d_remaining = 0;
 #if !NO_PMTIFF
@@ -1072,41 +3966,98 @@ static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
                 die("ASSERT: bad bpc for writing PM_TIFF2");
               }
               d_remaining -= rlen;
-              zs.next_out = (Bytef*)dp;
-              zs.avail_out = d_remaining != 0 ? rlen : 0;
+              zs->next_out = (Bytef*)dp;
+              zs->avail_out = d_remaining != 0 ? rlen : 0;
 #endif
             }
           }
         }
-        crc32v = crc32(crc32v, (const Bytef*)buf, want);
+        crc32v = crc32(crc32v, (const Bytef*)in, want);
         chunk_size -= want;
       }
-      if (4 != fread(buf, 1, 4, f)) die("eof in png chunk crc");
+      if (4 != source_read(src, buf, 4)) die("eof in png chunk crc");
       if (crc32v != get_u32be(buf)) die("crc error in png chunk");
       if (is_iend) break;
     }
   }
-  if (!img->data && width > 0 && height > 0) die("missing png image data");
+#if USE_PTHREAD
+  if (pp) {
+    pop_die_cleanup(&pipe_cleanup);
+    stop_png_pipe(pp, 0);
+  }
+#endif
+  if (a7) scratch_free(a7->rows);
+  if (pr) scratch_free(pr->rows);
+  if (!is_alloced) die("missing png image data");
   if (zr == Z_DATA_ERROR) {
     warn("bad png image data or bad adler32");
   }
   if (d_remaining == 0) {
-    if (dp && zr == Z_OK && (zs.avail_in != 0 || zs.avail_out != 0)) {  /* Not Z_STREAM_END. */
+    if (dp && zr == Z_OK && (zs->avail_in != 0 || zs->avail_out != 0)) {  /* Not Z_STREAM_END. */
       warn("png image data too long");
     }
+  } else if (rw) {
+    warn("png image data too short\n");
+    memset(dp, '\0', rlen);
+    for (; rows_remaining > 0; --rows_remaining) {
+      write_png_row(rw, (const char*)dp);
+    }
+  } else if (a7) {
+    warn("png image data too short\n");  /* The rest is 0 already. */
+    if (has_alpha) am->and_alpha = 0;
+  } else if (pr) {
+    warn("png image data too short\n");
+    memset(img->data + pr->y * img->rlen, '\0',
+           (height - pr->y) * img->rlen);
+    if (row_stats) {
+      add_image_stats_rows(row_stats, color_type,
+                           img->data + pr->y * img->rlen,
+                           (height - pr->y) * img->rlen);
+    }
+    if (has_alpha) {
+      memset(am->img.data + pr->y * am->img.rlen, '\0',
+             (height - pr->y) * am->img.rlen);
+      am->and_alpha = 0;
+    }
   } else {
     warn("png image data too short\n");
     /* TODO(pts): Make it white instead on RGB and gray. */
     memset(dp, '\0', d_remaining);
+    if (row_stats) {
+      add_image_stats_rows(row_stats, color_type, (const char*)dp,
+                           d_remaining);
+    }
   }
-  if ((unsigned char)right_and_byte != 255) {
+  if ((unsigned char)right_and_byte != 255 && !rw && !pr) {
     uint32_t y;
     for (y = height, dp = dp0 + (rlen - 1); y > 0;
          *dp &= right_and_byte, dp += rlen, --y) {}
   }
-  if (dp) inflateEnd(&zs);
-  if (force_bpc8) convert_to_bpc(img, 8);
+  if (ic && dp) {
+    ic->is_ok = filter == PNG_FILTER_DEFAULT && !a7 &&
+        (!pr || pr->bpc < 8) && zr == Z_STREAM_END && d_remaining == 0 &&
+        zs->total_in == ic->data.size &&
+        ic->data.size <= 0x7fffffffUL;  /* Maximum PNG chunk size. */
+    ic->palette_size = palette_size;
+    memcpy(ic->palette, img->palette, palette_size);
+  }
+  if (job_stats && dp) {
+    add_stage_wall(job_stats, STAGE_INFLATE, inflate_wall, zs->total_in,
+                   zs->total_out);
+  }
+  if (dp) end_inflate(zs);
+  if (rw) return;
+  if (a7) {
+    reduce_image_to_bpc8(img);
+    if (has_alpha) reduce_image_to_bpc8(&am->img);
+  }
+  if (force_bpc8 && img->bpc != 16) convert_to_bpc(img, 8);
+  if (am && am->trns_size != 0 && !has_alpha) {
+    if (img->bpc < 8) convert_to_bpc(img, 8);
+    apply_png_trns(am, img, bpc);
+  }
   if (color_type == CT_INDEXED_RGB) check_palette(img);
+  if (row_stats) row_stats->is_complete = 1;
 }
 
 /* Don't use ATTRIBUTE_USED here, it will include it to the binary even if unused.
@@ -1116,8 +4067,10 @@ static void read_png_stream(FILE *f, Image *img, xbool_t force_bpc8) {
 static void read_png(const char *filename, Image *img) {
   const xbool_t force_bpc8 = 0;
   FILE *f;
+  Source src;
   if (!(f = fopen(filename, "rb"))) die("error reading png");
-  read_png_stream(f, img, force_bpc8);
+  file_source(&src, f);
+  read_png_stream(&src, img, force_bpc8, 1, NULL, NULL, NULL, NULL);
   if (ferror(f)) die("error reading pngggg");
   fclose(f);
 }
@@ -1125,6 +4078,7 @@ static void read_png(const char *filename, Image *img) {
 
 /* --- */
 
+#if !NO_REGTEST  /* Otherwise ImageStats is used. */
 /* Returns bool indicating whether the image can be converted to CT_GRAY without quality loss.
  *
  * Only works if img->bpc == 8.
@@ -1149,6 +4103,7 @@ static xbool_t is_gray_ok(const Image *img) {
   }
   return 1;
 }
+#endif
 
 /* Returns the number of distinct RGB colors used in the image, or 257 if
  * it's more than 257.
@@ -1156,62 +4111,10 @@ static xbool_t is_gray_ok(const Image *img) {
  * Only works if img->bpc == 8.
  */
 static uint16_t get_color_count(const Image *img) {
-  const uint32_t size = img->rlen * img->height;
-  const uint8_t color_type = img->color_type;
-  uint32_t color_count = 0;
-  const unsigned char *pu = (const unsigned char*)img->data;
-  const unsigned char *puend = pu + size;
-  char palette[3 * 256];
-  if (img->bpc != 8) die("ASSERT: get_min_indexed_colors needs bpc=8");
-  if (color_type == CT_RGB) {
-    /* An open addressing hashtable. See build_palette_from_rgb8 for more. */
-    uint32_t hashtable[1409], hk, hik, hv;
-   count_rgb_colors:
-    /* All slots in the hashtable are empty (0). */
-    memset(hashtable, '\0', sizeof(hashtable));
-    for (; pu != puend; pu += 3) {
-      uint32_t v = (uint32_t)pu[0] << 16 | pu[1] << 8 | pu[2];
-      hk = v % 1409;
-      hik = 1 + v % 1408;
-      v |= (uint32_t)1 << 24;
-      for (;; hk -= hk >= hik ? hik : hik - 1409) {
-        hv = hashtable[hk];
-        if (hv == 0) {  /* Free slot. */
-          /* Without the early `return' here, the hashtable would become
-           * full, and we'd get an infinite loop.
-           */
-          if (++color_count > 256) return color_count;
-          hashtable[hk] = v;
-          break;
-        } else if (hv == v) {  /* Found color v. */
-          break;
-        }
-      }
-    }
-  } else {
-    unsigned char used[256];
-    memset(used, '\0', sizeof(used));
-    for (; pu != puend; used[*pu++] = 1) {}
-    pu = used; puend = used + 256;
-    if (color_type == CT_GRAY) {
-      for (; pu != puend; color_count += *pu++) {}
-    } else if (color_type == CT_INDEXED_RGB) {
-      const char *cp = img->palette;
-      char *pp = palette;
-      puend = pu + img->palette_size / 3;
-      while (pu != puend) {
-        if (*pu++ != 0) {
-          *pp++ = *cp++; *pp++ = *cp++; *pp++ = *cp++;
-        } else {
-          cp += 3;
-        }
-      }
-      pu = (const unsigned char*)palette;
-      puend = (const unsigned char*)pp;
-      goto count_rgb_colors;
-    }
-  }
-  return color_count;
+  ImageStats st;
+  init_image_stats(&st);
+  finish_image_stats(&st, img);
+  return st.color_count;
 }
 
 /* Returns the miniumum RGB bpc value that can be used without quality loss
@@ -1408,11 +4311,13 @@ static void normalize_palette(Image *img) {
     xbool_t *up = used;
     memset(used, '\0', sizeof(used));
     for (; p != pend; used[*(unsigned char*)p++] = 1) {}
-    while (pa != paend) {
+    for (; pa0 != paend && !*up; pa0 += 3, ++up) {}
+    if (pa0 == paend) pa0 = pa;  /* Empty image. */
+    for (up = used; pa != paend;) {
       if (*up++) {
         pa += 3;
       } else {
-        /* Change unused color to the very first color. */
+        /* Change unused color to the first used color. */
         *pa++ = pa0[0]; *pa++ = pa0[1]; *pa++ = pa0[2];
       }
     }
@@ -1435,17 +4340,20 @@ static void normalize_palette(Image *img) {
 
 /* Converts the image to CT_RGB.
  *
- * Only works if img->bpc == 8.
+ * Only works if img->bpc == 8, or img->bpc == 16 and it's CT_GRAY.
  */
 static void convert_to_rgb(Image *img) {
-  const uint32_t width3 = multiply_check(img->width, 3);
+  const uint32_t width3 =
+      multiply_check(img->width, img->bpc == 16 ? 6 : 3);  /* rlen. */
   const uint32_t new_size = multiply_check(width3, img->height);
   const uint32_t rlen_height = img->rlen * img->height;
   const uint8_t color_type = img->color_type;
   char *op = img->data;
   const char *p = op, *pend;
   if (color_type == CT_RGB) return;
-  if (img->bpc != 8) die("ASSERT: convert_to_rgb needs bpc=8");
+  if (img->bpc != 8 && !(img->bpc == 16 && color_type == CT_GRAY)) {
+    die("ASSERT: convert_to_rgb needs bpc=8");
+  }
   if (img->alloced < new_size) {
     p = img->data = op = (char*)realloc(op, new_size);
     if (!op) die("out of memory");
@@ -1466,6 +4374,11 @@ static void convert_to_rgb(Image *img) {
     free(img->palette);
     img->palette = NULL;
     img->palette_size = 0;
+  } else if (color_type == CT_GRAY && img->bpc == 16) {
+    while (p != pend) {
+      const char v0 = *p++, v1 = *p++;
+      *op++ = v0; *op++ = v1; *op++ = v0; *op++ = v1; *op++ = v0; *op++ = v1;
+    }
   } else if (color_type == CT_GRAY) {
     while (p != pend) {
       const char v = *p++;
@@ -1478,7 +4391,7 @@ static void convert_to_rgb(Image *img) {
 
 /* Converts the image to CT_GRAY.
  *
- * Only works if img->bpc == 8.
+ * Only works if img->bpc == 8, or img->bpc == 16 and it's CT_RGB.
  */
 static void convert_to_gray(Image *img) {
   const uint32_t rlen_height = img->rlen * img->height;
@@ -1486,9 +4399,11 @@ static void convert_to_gray(Image *img) {
   char *op = img->data;
   const char *p = op, *pend = p + rlen_height;
   if (color_type == CT_GRAY) return;
-  if (img->bpc != 8) die("ASSERT: convert_to_gray needs bpc=8");
+  if (img->bpc != 8 && !(img->bpc == 16 && color_type == CT_RGB)) {
+    die("ASSERT: convert_to_gray needs bpc=8");
+  }
   img->color_type = CT_GRAY;
-  img->rlen = img->width;
+  img->rlen = img->bpc == 16 ? multiply_check(img->width, 2) : img->width;
   img->cpp = 1;
   if (color_type == CT_INDEXED_RGB) {
     const char *palette = img->palette;
@@ -1501,6 +4416,13 @@ static void convert_to_gray(Image *img) {
     free(img->palette);
     img->palette = NULL;
     img->palette_size = 0;
+  } else if (color_type == CT_RGB && img->bpc == 16) {
+    for (; p != pend; p += 6) {
+      if (p[0] != p[2] || p[0] != p[4] || p[1] != p[3] || p[1] != p[5]) {
+        die("cannot convert to gray");
+      }
+      *op++ = p[0]; *op++ = p[1];
+    }
   } else if (color_type == CT_RGB) {
     while (p != pend) {
       const char v = *p++;
@@ -1526,45 +4448,400 @@ static void convert_to_indexed(Image *img) {
   img->rlen = img->width;
   img->cpp = 1;
   free(img->palette);
+  img->palette = NULL;
   if (color_type == CT_GRAY) {
-    char *pp = palette;
+    char *pp = img->palette = (char*)xmalloc(3 * 256);
     uint16_t c = 0;
     for (; c < 256; ++c) {
       *pp++ = c; *pp++ = c; *pp++ = c;
     }
-    img->palette = palette;
-    img->palette_size = 3 * 256;
-    normalize_palette(img);
-    img->palette = (char*)xmalloc(img->palette_size);
-    memcpy(img->palette, palette, img->palette_size);
-  } else if (color_type == CT_RGB) {
-    const uint32_t palette_size = build_palette_from_rgb8(
-        img->data, rlen_height, palette);
-    if (palette_size < 3) die("too many colors to convert to indexed");
-    img->palette_size = palette_size;
-    memcpy(img->palette = (char*)xmalloc(palette_size), palette, palette_size);
-  } else {
-    die("ASSERT: bad color_type for convert_to_indexed");
+    img->palette_size = 3 * 256;
+    normalize_palette(img);
+  } else if (color_type == CT_RGB) {
+    const uint32_t palette_size = build_palette_from_rgb8(
+        img->data, rlen_height, palette);
+    if (palette_size < 3) die("too many colors to convert to indexed");
+    img->palette_size = palette_size;
+    memcpy(img->palette = (char*)xmalloc(palette_size), palette, palette_size);
+  } else {
+    die("ASSERT: bad color_type for convert_to_indexed");
+  }
+}
+
+#if USE_SSE2
+/* SIMD kernels for unpack_row_to_bpc8 and pack_row_from_bpc8. Each
+ * iteration does 16 bytes of packed samples. They return the number of
+ * samples done, the caller does the rest. Like the scalar code, they also
+ * work in place: they write only after reading what they overwrite.
+ */
+
+/* Unpacks the bpc=1 samples of the 2 bytes in each 16-bit lane of x (each
+ * byte repeated 8 times) to 0 or 1 (indexed) or 0 or 255.
+ */
+static INLINE __m128i unpack_bits_sse2(__m128i x, __m128i and_mask) {
+  const __m128i bits = _mm_set_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(x, bits), bits),
+                       and_mask);
+}
+
+/* Scales samples (0 .. (1 << bpc) - 1) in x to 0..255. */
+static INLINE __m128i scale_to_bpc8_sse2(__m128i x, uint8_t bpc) {
+  /* The shifts don't cross byte boundaries, because the samples are small. */
+  if (bpc == 2) x = _mm_or_si128(x, _mm_slli_epi16(x, 2));
+  return _mm_or_si128(x, _mm_slli_epi16(x, 4));
+}
+
+static uint32_t unpack_row_to_bpc8_sse2(char *op, const char *p,
+                                        uint32_t spr, uint8_t bpc,
+                                        xbool_t is_indexed) {
+  const uint32_t step = 128 / bpc;  /* Samples per 16 packed bytes. */
+  const __m128i m3 = _mm_set1_epi8(3), m15 = _mm_set1_epi8(15);
+  const __m128i and_mask = _mm_set1_epi8(is_indexed ? 1 : -1);
+  __m128i x, a, b, c, d, v[8];
+  uint32_t done, i;
+  for (done = 0; done + step <= spr; done += step, p += 16, op += step) {
+    x = _mm_loadu_si128((const __m128i*)p);
+    if (bpc == 1) {
+      a = _mm_unpacklo_epi8(x, x);
+      b = _mm_unpackhi_epi8(x, x);
+      c = _mm_unpacklo_epi16(a, a);
+      d = _mm_unpackhi_epi16(a, a);
+      v[0] = _mm_unpacklo_epi32(c, c);
+      v[1] = _mm_unpackhi_epi32(c, c);
+      v[2] = _mm_unpacklo_epi32(d, d);
+      v[3] = _mm_unpackhi_epi32(d, d);
+      c = _mm_unpacklo_epi16(b, b);
+      d = _mm_unpackhi_epi16(b, b);
+      v[4] = _mm_unpacklo_epi32(c, c);
+      v[5] = _mm_unpackhi_epi32(c, c);
+      v[6] = _mm_unpacklo_epi32(d, d);
+      v[7] = _mm_unpackhi_epi32(d, d);
+      for (i = 0; i < 8; ++i) {
+        _mm_storeu_si128((__m128i*)op + i, unpack_bits_sse2(v[i], and_mask));
+      }
+    } else {
+      if (bpc == 2) {
+        a = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(x, 6), m3),
+                              _mm_and_si128(_mm_srli_epi16(x, 4), m3));
+        b = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(x, 2), m3),
+                              _mm_and_si128(x, m3));
+        c = _mm_unpackhi_epi8(_mm_and_si128(_mm_srli_epi16(x, 6), m3),
+                              _mm_and_si128(_mm_srli_epi16(x, 4), m3));
+        d = _mm_unpackhi_epi8(_mm_and_si128(_mm_srli_epi16(x, 2), m3),
+                              _mm_and_si128(x, m3));
+        v[0] = _mm_unpacklo_epi16(a, b);
+        v[1] = _mm_unpackhi_epi16(a, b);
+        v[2] = _mm_unpacklo_epi16(c, d);
+        v[3] = _mm_unpackhi_epi16(c, d);
+      } else {  /* bpc == 4. */
+        a = _mm_and_si128(_mm_srli_epi16(x, 4), m15);
+        b = _mm_and_si128(x, m15);
+        v[0] = _mm_unpacklo_epi8(a, b);
+        v[1] = _mm_unpackhi_epi8(a, b);
+      }
+      for (i = 0; i < 8 / bpc; ++i) {
+        _mm_storeu_si128((__m128i*)op + i, is_indexed ? v[i] :
+                         scale_to_bpc8_sse2(v[i], bpc));
+      }
+    }
+  }
+  return done;
+}
+
+static uint32_t pack_row_from_bpc8_sse2(char *op, const char *p,
+                                        uint32_t spr, uint8_t bpc,
+                                        xbool_t is_indexed) {
+  const uint32_t step = 128 / bpc;  /* Samples per 16 packed bytes. */
+  const __m128i m3 = _mm_set1_epi32(3), m15 = _mm_set1_epi16(15);
+  __m128i x, v[4];
+  uint32_t done, i;
+  int bits;
+  for (done = 0; done + step <= spr; done += step, op += 16) {
+    if (bpc == 1) {
+      for (i = 0; i < 8; ++i, p += 16) {
+        x = _mm_loadu_si128((const __m128i*)p);
+        /* Move the low bit of each byte to the high bit. */
+        if (is_indexed) x = _mm_slli_epi16(x, 7);
+        /* Reverse the byte order within the 2 halves of 8 bytes, so that
+         * the first sample goes to the high bit.
+         */
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0x1b), 0x1b);
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        bits = _mm_movemask_epi8(x);
+        op[2 * i] = bits;
+        op[2 * i + 1] = bits >> 8;
+      }
+    } else if (bpc == 2) {
+      /* 4 samples per 32-bit lane, the first one in the low byte. */
+      for (i = 0; i < 4; ++i, p += 16) {
+        x = _mm_loadu_si128((const __m128i*)p);
+        v[i] = is_indexed ? _mm_or_si128(_mm_or_si128(
+            _mm_slli_epi32(_mm_and_si128(x, m3), 6),
+            _mm_and_si128(_mm_srli_epi32(x, 4), _mm_slli_epi32(m3, 4))),
+            _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(x, 14), _mm_slli_epi32(m3, 2)),
+            _mm_and_si128(_mm_srli_epi32(x, 24), m3))) :
+            _mm_or_si128(_mm_or_si128(
+            _mm_and_si128(x, _mm_slli_epi32(m3, 6)),
+            _mm_and_si128(_mm_srli_epi32(x, 10), _mm_slli_epi32(m3, 4))),
+            _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(x, 20), _mm_slli_epi32(m3, 2)),
+            _mm_srli_epi32(x, 30)));
+      }
+      _mm_storeu_si128((__m128i*)op, _mm_packus_epi16(
+          _mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+    } else {  /* bpc == 4. */
+      /* 2 samples per 16-bit lane, the first one in the low byte. */
+      for (i = 0; i < 2; ++i, p += 16) {
+        x = _mm_loadu_si128((const __m128i*)p);
+        v[i] = is_indexed ? _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(x, m15), 4),
+            _mm_and_si128(_mm_srli_epi16(x, 8), m15)) :
+            _mm_or_si128(_mm_and_si128(x, _mm_slli_epi16(m15, 4)),
+                         _mm_srli_epi16(x, 12));
+      }
+      _mm_storeu_si128((__m128i*)op, _mm_packus_epi16(v[0], v[1]));
+    }
+  }
+  return done;
+}
+#endif
+
+/* Unpacks a row of spr samples from bpc=1, 2 or 4 at p to bpc=8 at op.
+ * Non-indexed samples are scaled to 0..255. It also works in place, if
+ * op[:spr] doesn't end after the packed row at p.
+ */
+static void unpack_row_to_bpc8(char *op, const char *p, uint32_t spr,
+                               uint8_t bpc, xbool_t is_indexed) {
+  uint32_t rlen;
+  const char *pend;
+  register unsigned char v;
+#if USE_SSE2
+  if (bpc < 8) {
+    const uint32_t done =
+        unpack_row_to_bpc8_sse2(op, p, spr, bpc, is_indexed);
+    op += done;
+    p += done * bpc >> 3;
+    spr -= done;
+  }
+#endif
+  rlen = (spr * bpc + 7) >> 3;
+  if (is_indexed) {
+    if (bpc == 4) {
+      uint8_t i = spr & 1;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        *op++ = v >> 4;
+        *op++ = v & 15;
+      }
+      if (i != 0) *op++ = *(unsigned char*)p++ >> 4;
+    } else if (bpc == 2) {
+      uint8_t i = spr & 3;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        *op++ = v >> 6;
+        *op++ = (v >> 4) & 3;
+        *op++ = (v >> 2) & 3;
+        *op++ = v & 3;
+      }
+      if (i != 0) {
+        for (v = *p++; i > 0; *op++ = v >> 6, v <<= 2, --i) {}
+      }
+    } else if (bpc == 1) {
+      uint8_t i = spr & 7;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        *op++ = v >> 7;
+        *op++ = (v >> 6) & 1;
+        *op++ = (v >> 5) & 1;
+        *op++ = (v >> 4) & 1;
+        *op++ = (v >> 3) & 1;
+        *op++ = (v >> 2) & 1;
+        *op++ = (v >> 1) & 1;
+        *op++ = v & 1;
+      }
+      if (i != 0) {
+        for (v = *p++; i > 0; *op++ = v >> 7, v <<= 1, --i) {}
+      }
+    }
+  } else {  /* Non-indexed. */
+    if (bpc == 4) {
+      uint8_t i = spr & 1;
+      unsigned char w;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        /* (w * 0x11) is optimized by gcc -O2 to (w | w << 4), but not by
+         * gcc -Om.
+         */
+        w = (v >> 4); *op++ = w | (w << 4);
+        w = (v & 15); *op++ = w | (w << 4);
+      }
+      if (i != 0) {
+        w = (*(unsigned char*)p++ >> 4); *op++ = w | (w << 4);
+      }
+    } else if (bpc == 2) {
+      uint8_t i = spr & 3;
+      unsigned char w;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        w = v >> 6; w |= (w << 2); *op++ = w | (w << 4);
+        w = (v >> 4) & 3; w |= (w << 2); *op++ = w | (w << 4);
+        w = (v >> 2) & 3; w |= (w << 2); *op++ = w | (w << 4);
+        w = v & 3; w |= (w << 2); *op++ = w | (w << 4);
+      }
+      if (i != 0) {
+        for (v = *p++; i > 0; w = v >> 6, w |= (w << 2), *op++ = w | (w << 4), v <<= 2, --i) {}
+      }
+    } else if (bpc == 1) {
+      uint8_t i = spr & 7;
+      for (pend = p + (rlen - (i != 0)); p != pend;) {
+        v = *p++;
+        *op++ = -(v >> 7);
+        *op++ = -((v >> 6) & 1);
+        *op++ = -((v >> 5) & 1);
+        *op++ = -((v >> 4) & 1);
+        *op++ = -((v >> 3) & 1);
+        *op++ = -((v >> 2) & 1);
+        *op++ = -((v >> 1) & 1);
+        *op++ = -(v & 1);
+      }
+      if (i != 0) {
+        for (v = *p++; i > 0; *op++ = -(v >> 7), v <<= 1, --i) {}
+      }
+    }
+  }
+}
+
+/* Packs a row of spr bpc=8 samples at p to bpc=1, 2 or 4 at op, keeping
+ * the low bits of indexed samples, and the high bits of others. It also
+ * works in place.
+ */
+static void pack_row_from_bpc8(char *op, const char *p, uint32_t spr,
+                               uint8_t bpc, xbool_t is_indexed) {
+  const char *pend;
+  register unsigned char v;
+#if USE_SSE2
+  if (bpc < 8) {
+    const uint32_t done = pack_row_from_bpc8_sse2(op, p, spr, bpc, is_indexed);
+    op += done * bpc >> 3;
+    p += done;
+    spr -= done;
+  }
+#endif
+  if (is_indexed) {
+    if (bpc == 1) {
+      for (pend = p + (spr & ~(uint32_t)7); p != pend;) {
+        v = *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        v <<= 1; v |= *p++ & 1;
+        *op++ = (v << 1) | (*p++ & 1);
+      }
+      pend = p + (spr & 7);
+      if (p != pend) {
+        v = *p++ & 1;
+        while (p != pend) {
+          v <<= 1; v |= *p++ & 1;
+        }
+        *op++ = v << (8 - (spr & 7));
+      }
+    } else if (bpc == 2) {
+      for (pend = p + (spr & ~(uint32_t)3); p != pend;) {
+        v = *p++ & 3;
+        v <<= 2; v |= *p++ & 3;
+        v <<= 2; v |= *p++ & 3;
+        *op++ = (v << 2) | (*p++ & 3);
+      }
+      pend = p + (spr & 3);
+      if (p != pend) {
+        v = *p++ & 3;
+        while (p != pend) {
+          v <<= 2; v |= *p++ & 3;
+        }
+        *op++ = v << (8 - 2 * (spr & 3));
+      }
+    } else if (bpc == 4) {
+      for (pend = p + (spr & ~(uint32_t)1); p != pend;) {
+        v = *p++ & 15;
+        *op++ = (v << 4) | (*p++ & 15);
+      }
+      if ((spr & 1) != 0) {
+        *op++ = (*p++ & 15) << 4;
+      }
+    } else {
+      die("ASSERT: bad bpc");
+    }
+  } else {  /* Non-indexed. */
+    if (bpc == 1) {
+      for (pend = p + (spr & ~(uint32_t)7); p != pend;) {
+        v = *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        *op++ = (v << 1) | (*(unsigned char*)p++ >> 7);
+      }
+      pend = p + (spr & 7);
+      if (p != pend) {
+        v = *(unsigned char*)p++ >> 7;
+        while (p != pend) {
+          v <<= 1; v |= *(unsigned char*)p++ >> 7;
+        }
+        *op++ = v << (8 - (spr & 7));
+      }
+    } else if (bpc == 2) {
+      for (pend = p + (spr & ~(uint32_t)3); p != pend;) {
+        v = *(unsigned char*)p++ >> 6;
+        v <<= 2; v |= *(unsigned char*)p++ >> 6;
+        v <<= 2; v |= *(unsigned char*)p++ >> 6;
+        *op++ = (v << 2) | (*(unsigned char*)p++ >> 6);
+      }
+      pend = p + (spr & 3);
+      if (p != pend) {
+        v = *(unsigned char*)p++ >> 6;
+        while (p != pend) {
+          v <<= 2; v |= *(unsigned char*)p++ >> 6;
+        }
+        *op++ = v << (8 - 2 * (spr & 3));
+      }
+    } else if (bpc == 4) {
+      for (pend = p + (spr & ~(uint32_t)1); p != pend;) {
+        v = *(unsigned char*)p++ & 0xf0;
+        *op++ = v | (*(unsigned char*)p++ >> 4);
+      }
+      if ((spr & 1) != 0) {
+        *op++ = *(unsigned char*)p++ & 0xf0;
+      }
+    } else {
+      die("ASSERT: bad bpc");
+    }
   }
 }
 
 /* Converts the image to bpc=to_bpc in place.
  *
- * Checks that the conversion is lossless.
+ * If do_check, checks that the conversion is lossless. Otherwise the
+ * caller must have checked it, and the extra low bits are dropped.
  */
-static void convert_to_bpc(Image *img, uint8_t to_bpc) {
+static void convert_to_bpc_check(Image *img, uint8_t to_bpc,
+                                 xbool_t do_check) {
   /* alloc_image guarantees that there is no overflow here. */
   const uint32_t spr = img->width * img->cpp;
   const uint8_t bpc = img->bpc;
-  uint32_t height = img->height;
+  const xbool_t is_indexed = img->color_type == CT_INDEXED_RGB;
+  uint32_t height = img->height, rlen;
   char *op = img->data;
-  const char *p = op, *pend;
-  register unsigned char v;
+  const char *p = op;
   if (bpc == to_bpc) return;
   if (bpc != 8 || to_bpc == 8) {  /* Convert to bpc=8 first. */
-    const uint32_t rlen = img->rlen;
     const uint32_t new_size = multiply_check(spr, height);
-    const uint32_t rlen_height = rlen * height;
+    const uint32_t rlen_height = img->rlen * height;
     uint32_t h1 = height;
     if (img->alloced < new_size) {
       p = img->data = op = (char*)realloc(op, new_size);
@@ -1573,297 +4850,768 @@ static void convert_to_bpc(Image *img, uint8_t to_bpc) {
     }
     p += new_size - rlen_height;
     memmove((char*)p, op, rlen_height);
-    if (img->color_type == CT_INDEXED_RGB) {
-      if (bpc == 4) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 1;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            *op++ = v >> 4;
-            *op++ = v & 15;
-          }
-          if (i != 0) *op++ = *(unsigned char*)p++ >> 4;
-        }
-      } else if (bpc == 2) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 3;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            *op++ = v >> 6;
-            *op++ = (v >> 4) & 3;
-            *op++ = (v >> 2) & 3;
-            *op++ = v & 3;
-          }
-          if (i != 0) {
-            for (v = *p++; i > 0; *op++ = v >> 6, v <<= 2, --i) {}
-          }
-        }
-      } else if (bpc == 1) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 7;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            *op++ = v >> 7;
-            *op++ = (v >> 6) & 1;
-            *op++ = (v >> 5) & 1;
-            *op++ = (v >> 4) & 1;
-            *op++ = (v >> 3) & 1;
-            *op++ = (v >> 2) & 1;
-            *op++ = (v >> 1) & 1;
-            *op++ = v & 1;
-          }
-          if (i != 0) {
-            for (v = *p++; i > 0; *op++ = v >> 7, v <<= 1, --i) {}
-          }
-        }
-      }
-    } else {  /* Non-indexed. */
-      if (bpc == 4) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 1;
-          unsigned char w;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            /* (w * 0x11) is optimized by gcc -O2 to (w | w << 4), but not by
-             * gcc -Om.
-             */
-            w = (v >> 4); *op++ = w | (w << 4);
-            w = (v & 15); *op++ = w | (w << 4);
-          }
-          if (i != 0) {
-            w = (*p++ >> 4); *op++ = w | (w << 4);
-          }
-        }
-      } else if (bpc == 2) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 3;
-          unsigned char w;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            w = v >> 6; w |= (w << 2); *op++ = w | (w << 4);
-            w = (v >> 4) & 3; w |= (w << 2); *op++ = w | (w << 4);
-            w = (v >> 2) & 3; w |= (w << 2); *op++ = w | (w << 4);
-            w = v & 3; w |= (w << 2); *op++ = w | (w << 4);
-          }
-          if (i != 0) {
-            for (v = *p++; i > 0; w = v >> 6, w |= (w << 2), *op++ = w | (w << 4), v <<= 2, --i) {}
-          }
-        }
-      } else if (bpc == 1) {
-        for (; h1 > 0; --h1) {
-          uint8_t i = spr & 7;
-          for (pend = p + (rlen - (i != 0)); p != pend;) {
-            v = *p++;
-            *op++ = -(v >> 7);
-            *op++ = -((v >> 6) & 1);
-            *op++ = -((v >> 5) & 1);
-            *op++ = -((v >> 4) & 1);
-            *op++ = -((v >> 3) & 1);
-            *op++ = -((v >> 2) & 1);
-            *op++ = -((v >> 1) & 1);
-            *op++ = -(v & 1);
-          }
-          if (i != 0) {
-            for (v = *p++; i > 0; *op++ = -(v >> 7), v <<= 1, --i) {}
-          }
-        }
-      }
+    for (rlen = img->rlen; h1 > 0; --h1, p += rlen, op += spr) {
+      unpack_row_to_bpc8(op, p, spr, bpc, is_indexed);
     }
     img->bpc = 8;
     img->rlen = spr;
     p = op = img->data;
   }
   if (to_bpc == 8) return;
-  if (to_bpc < get_min_bpc(img)) {
+  if (do_check && to_bpc < get_min_bpc(img)) {
     die("decreasing bpc would cause quality loss");
   }
-  if (img->color_type == CT_INDEXED_RGB) {
-    if (to_bpc == 1) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)7); p != pend;) {
-          v = *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          v <<= 1; v |= *p++ & 1;
-          *op++ = (v << 1) | (*p++ & 1);
-        }
-        pend = p + (spr & 7);
-        if (p != pend) {
-          v = *p++ & 1;
-          while (p != pend) {
-            v <<= 1; v |= *p++ & 1;
-          }
-          *op++ = v << (8 - (spr & 7));
-        }
-      }
-      img->rlen = (spr + 7) >> 3;
-    } else if (to_bpc == 2) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)3); p != pend;) {
-          v = *p++ & 3;
-          v <<= 2; v |= *p++ & 3;
-          v <<= 2; v |= *p++ & 3;
-          *op++ = (v << 2) | (*p++ & 3);
-        }
-        pend = p + (spr & 3);
-        if (p != pend) {
-          v = *p++ & 3;
-          while (p != pend) {
-            v <<= 2; v |= *p++ & 3;
-          }
-          *op++ = v << (8 - 2 * (spr & 3));
-        }
-      }
-      img->rlen = (spr + 3) >> 2;
-    } else if (to_bpc == 4) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)1); p != pend;) {
-          v = *p++ & 15;
-          *op++ = (v << 4) | (*p++ & 15);
-        }
-        if ((spr & 1) != 0) {
-          *op++ = (*p++ & 15) << 4;
-        }
-      }
-      img->rlen = (spr + 1) >> 1;
-    } else {
-      die("ASSERT: bad to_bpc");
-    }
-  } else {  /* Non-indexed. */
-    if (to_bpc == 1) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)7); p != pend;) {
-          v = *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          *op++ = (v << 1) | (*(unsigned char*)p++ >> 7);
-        }
-        pend = p + (spr & 7);
-        if (p != pend) {
-          v = *(unsigned char*)p++ >> 7;
-          while (p != pend) {
-            v <<= 1; v |= *(unsigned char*)p++ >> 7;
-          }
-          *op++ = v << (8 - (spr & 7));
-        }
-      }
-      img->rlen = (spr + 7) >> 3;
-    } else if (to_bpc == 2) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)3); p != pend;) {
-          v = *(unsigned char*)p++ >> 6;
-          v <<= 2; v |= *(unsigned char*)p++ >> 6;
-          v <<= 2; v |= *(unsigned char*)p++ >> 6;
-          *op++ = (v << 2) | (*(unsigned char*)p++ >> 6);
-        }
-        pend = p + (spr & 3);
-        if (p != pend) {
-          v = *(unsigned char*)p++ >> 6;
-          while (p != pend) {
-            v <<= 2; v |= *(unsigned char*)p++ >> 6;
-          }
-          *op++ = v << (8 - 2 * (spr & 3));
-        }
-      }
-      img->rlen = (spr + 3) >> 2;
-    } else if (to_bpc == 4) {
-      for (; height > 0; --height) {
-        for (pend = p + (spr & ~(uint32_t)1); p != pend;) {
-          v = *(unsigned char*)p++ & 0xf0;
-          *op++ = v | (*(unsigned char*)p++ >> 4);
-        }
-        if ((spr & 1) != 0) {
-          *op++ = *(unsigned char*)p++ & 0xf0;
-        }
-      }
-      img->rlen = (spr + 1) >> 1;
-    } else {
-      die("ASSERT: bad to_bpc");
-    }
+  for (rlen = (spr * to_bpc + 7) >> 3; height > 0;
+       --height, p += spr, op += rlen) {
+    pack_row_from_bpc8(op, p, spr, to_bpc, is_indexed);
   }
+  img->rlen = rlen;
   img->bpc = to_bpc;
 }
 
+static void convert_to_bpc(Image *img, uint8_t to_bpc) {
+  convert_to_bpc_check(img, to_bpc, 1);
+}
+
 /* --- */
 
-static void read_image(const char *filename, Image *img, xbool_t force_bpc8) {
+/* Reads a PNG or PNM image from src, autodetecting the format.
+ *
+ * img must be initialized (at least noalloc_image).
+ *
+ * If stats is not NULL, the image readers add the image data to it.
+ *
+ * If rw is not NULL, and the image can be streamed to it, then it doesn't
+ * keep the image in memory, see read_png_stream.
+ *
+ * If ic is not NULL, and the image is a PNG, then it saves the compressed
+ * image data to ic. Otherwise it sets ic->is_ok to false.
+ *
+ * If am is not NULL, it must be initialized (with init_alpha_mask), and
+ * the alpha channel or tRNS of a PNG is read to it.
+ */
+static void read_image_source(Source *src, Image *img, xbool_t force_bpc8,
+                              uint32_t thread_count, ImageStats *stats,
+                              PngRowWriter *rw, IdatCopy *ic, AlphaMask *am) {
   char buf[4];
-  FILE *f;
-  if (!(f = fopen(filename, "rb"))) die("error reading image");
-  if (4 != fread(buf, 1, 4, f)) die("image signature too short");
-  if (fseek(f, 0, SEEK_SET) != 0) die("cannot seek back to image");
+  if (4 != source_read(src, buf, 4)) die("image signature too short");
+  if (src->f) {
+    if (fseek(src->f, 0, SEEK_SET) != 0) die("cannot seek back to image");
+  } else {
+    src->p -= 4;
+  }
   if (0 == memcmp(buf, kPngHeader, 4)) {
-    read_png_stream(f, img, force_bpc8);
+    read_png_stream(src, img, force_bpc8, thread_count, stats, rw, ic, am);
 #if !NO_PNM
   } else if (buf[0] == 'P' && (buf[1] == '4' || buf[1] == '5' || buf[1] == '6')) {
     /* We support only the subset of the PNM format. */
-    read_pnm_stream(f, img, force_bpc8);
+    if (ic) ic->is_ok = 0;
+    read_pnm_stream(src, img, force_bpc8, stats);
 #endif
   } else {
     die("unknown input image format");
   }
+}
+
+static void read_image(const char *filename, Image *img, xbool_t force_bpc8,
+                       uint32_t thread_count, ImageStats *stats,
+                       PngRowWriter *rw, IdatCopy *ic, AlphaMask *am) {
+  FILE *f;
+  Source src;
+#if USE_MMAP
+  uint32_t size;
+  const char *map = map_file(filename, &size);
+  if (map) {
+    set_die_map(map, size);
+    memory_source(&src, map, size);
+    read_image_source(&src, img, force_bpc8, thread_count, stats, rw, ic, am);
+    set_die_map(NULL, 0);
+    munmap((void*)map, size);
+    return;
+  }
+#endif
+  if (!(f = fopen(filename, "rb"))) die("error reading image");
+  set_die_file(f);
+  file_source(&src, f);
+  read_image_source(&src, img, force_bpc8, thread_count, stats, rw, ic, am);
   if (ferror(f)) die("error reading image");
+  set_die_file(NULL);
+  fclose(f);
+}
+
+typedef struct PngCandidate {
+  uint8_t color_type;  /* CT_GRAY, CT_INDEXED_RGB or CT_RGB. */
+  uint8_t bpc;
+} PngCandidate;
+
+/* Returns the pdfsizeopt name (e.g. "Indexed4") of candidate. */
+static const char *get_png_candidate_name(const PngCandidate *candidate) {
+  static const char *const names[3][4] = {
+      {"Gray1", "Gray2", "Gray4", "Gray8"},
+      {"Indexed1", "Indexed2", "Indexed4", "Indexed8"},
+      {"Rgb1", "Rgb2", "Rgb4", "Rgb8"}};
+  const uint8_t bpc = candidate->bpc;
+  return names[candidate->color_type == CT_GRAY ? 0 :
+               candidate->color_type == CT_INDEXED_RGB ? 1 : 2]
+              [bpc == 1 ? 0 : bpc == 2 ? 1 : bpc == 4 ? 2 : 3];
+}
+
+/* Records the candidate chosen out of count in the JobStats (if any). */
+static void set_png_candidate_stats(const PngCandidate *candidates,
+                                    uint32_t idx, uint32_t count) {
+  JobStats *job_stats = get_job_stats();
+  if (job_stats) {
+    job_stats->branch = get_png_candidate_name(candidates + idx);
+    job_stats->candidate_idx = idx;
+    job_stats->candidate_count = count;
+  }
+}
+
+/* Max number of PngCandidate structs get_png_candidates can return. */
+#define PNG_CANDIDATE_MAX 12
+
+/* Saves to candidates[:result] the color_type and bpc combinations to which
+ * img can be converted losslessly, most promising first.
+ *
+ * Here we follow the order by pdfsizeopt
+ * (-s Gray1:Indexed1:Gray2:Indexed2:Rgb1:Gray4:Indexed4:Rgb2:Gray8:Indexed8:Rgb4:Rgb8:stop)
+ *
+ * st must be finished (finish_image_stats) for img. Only works if
+ * img->bpc == 8.
+ */
+static uint32_t get_png_candidates(const Image *img, xbool_t is_extended,
+                                   xbool_t force_gray, const ImageStats *st,
+                                   PngCandidate *candidates) {
+  const xbool_t is_gray_ok_ = st->is_gray_ok;
+  const uint8_t min_rgb_bpc = st->min_rgb_bpc;
+  const uint32_t color_count = st->color_count;
+  PngCandidate *c = candidates;
+  uint8_t bpc;
+  if (img->bpc != 8) die("ASSERT: get_png_candidates needs bpc=8");
+  if (force_gray && !is_gray_ok_) die("cannot convert to gray");
+  for (bpc = 1; bpc <= 8; bpc <<= 1) {
+    if (is_gray_ok_ && min_rgb_bpc <= bpc) {  /* GrayK */
+      c->color_type = CT_GRAY; c++->bpc = bpc;
+    }
+    if (color_count <= (uint32_t)1 << bpc && !force_gray) {  /* IndexedK */
+      c->color_type = CT_INDEXED_RGB; c++->bpc = bpc;
+    }
+    /* Rgb(K/2), after GrayK and IndexedK. */
+    if (bpc >= 2 && min_rgb_bpc <= (bpc >> 1) && !force_gray && is_extended) {
+      c->color_type = CT_RGB; c++->bpc = bpc >> 1;
+    }
+  }
+  if (min_rgb_bpc <= 8 && !force_gray) {  /* Rgb8 */
+    c->color_type = CT_RGB; c++->bpc = 8;
+  }
+  return c - candidates;
+}
+
+/* Converts img (with bpc == 8) losslessly to the candidate, as returned by
+ * get_png_candidates.
+ */
+static void convert_to_png_candidate(Image *img,
+                                     const PngCandidate *candidate) {
+  const uint8_t bpc = candidate->bpc;
+  if (candidate->color_type == CT_GRAY) {
+    convert_to_gray(img);
+  } else if (candidate->color_type == CT_INDEXED_RGB) {
+    convert_to_indexed(img);
+    if (bpc != 8 && img->palette_size > (uint32_t)3 << bpc) {
+      /* Make all palette indexes smaller than 1 << bpc. */
+      const unsigned char *p = (const unsigned char*)img->data;
+      const unsigned char *pend = p + img->rlen * img->height;
+      for (; p != pend && *p >> bpc == 0; ++p) {}
+      if (p != pend) normalize_palette(img);
+    }
+  } else {
+    convert_to_rgb(img);
+  }
+  /* get_png_candidates has already checked that it's lossless. */
+  convert_to_bpc_check(img, bpc, 0);
+}
+
+/* Changes the bpc and/or the color_type heuristically, in order to make the
+ * output of a subsequent write_png small.
+ *
+ * st must be finished (finish_image_stats) for img. Only works if
+ * img->bpc == 8.
+ */
+static void optimize_for_png(Image *img, xbool_t is_extended,
+                             xbool_t force_gray, const ImageStats *st) {
+  /* Use encode_best_png to try rgb8 if rgb4 is the winner etc. */
+  PngCandidate candidates[PNG_CANDIDATE_MAX];
+  const uint32_t count =
+      get_png_candidates(img, is_extended, force_gray, st, candidates);
+  if (count == 0) die("ASSERT: optimize_for_png found no solution");
+  set_png_candidate_stats(candidates, 0, count);
+  convert_to_png_candidate(img, candidates);
+}
+
+static void copy_image(Image *dst, const Image *src) {
+  *dst = *src;
+  dst->data = (char*)xmalloc(src->alloced);
+  memcpy(dst->data, src->data, src->rlen * src->height);
+  dst->palette = (char*)xmalloc(src->palette_size);
+  memcpy(dst->palette, src->palette, src->palette_size);
+}
+
+/* --- Compressed size estimation (--estimate and -j:candidates:N). */
+
+/* Returns log2(x) for x > 0, with an absolute error below 0.01, without
+ * libm.
+ */
+static double approx_log2(double x) {
+  double e = 0;
+  for (; x >= 2; x *= 0.5) ++e;
+  for (; x < 1; x *= 2) --e;
+  x -= 1;  /* Quadratic approximation of log2(1 + x) for 0 <= x < 1. */
+  return e + x * (1.3465 - 0.3465 * x);
+}
+
+#define ESTIMATE_HASH_BITS 15
+/* Number of earlier positions with the same hash to try. */
+#define ESTIMATE_CHAIN 16
+/* Hash of the 4 bytes at unsigned char *p, for estimate_deflate_size. */
+#define ESTIMATE_HASH(p) ((uint32_t)(((p)[0] | (p)[1] << 8 | \
+    (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24) * 2654435761UL) >> \
+    (32 - ESTIMATE_HASH_BITS))
+
+/* Returns the length of the match at p[i:] with distance dist, at most
+ * max_len.
+ */
+static uint32_t get_match_length(const unsigned char *p, uint32_t i,
+                                 uint32_t dist, uint32_t max_len) {
+  const unsigned char *q = p + i - dist;
+  uint32_t len = 0;
+  for (p += i; len < max_len && p[len] == q[len]; ++len) {}
+  return len;
+}
+
+/* Returns the number of bits Huffman coding would need for the symbols
+ * counted in counts[:n], including an approximate size of the code lengths
+ * in the block header.
+ */
+static double get_huffman_bits(const uint32_t *counts, uint32_t n) {
+  double total = 0, bits = 0, log2_total;
+  uint32_t i;
+  for (i = 0; i < n; ++i) {
+    total += counts[i];
+  }
+  if (total == 0) return 0;
+  log2_total = approx_log2(total);
+  for (i = 0; i < n; ++i) {
+    if (counts[i] != 0) {
+      bits += counts[i] * (log2_total - approx_log2(counts[i])) + 5;
+    }
+  }
+  /* Huffman codes are at least 1 bit long. */
+  return bits < total ? total : bits;
+}
+
+/* Returns floor(log2(x)) for x > 0. */
+static uint32_t get_log2_floor(uint32_t x) {
+  uint32_t result = 0;
+  for (; x > 1; x >>= 1) ++result;
+  return result;
+}
+
+/* Returns an estimate of the size of the zlib stream deflate (with level 9)
+ * would produce from data[:size], without compressing it: the entropy of
+ * the literals, and of the length and distance codes of the LZ77 matches,
+ * in the deflate alphabets, with a single Huffman table for the whole
+ * stream. The matches are found greedily, trying only 3 distances: the last
+ * occurrence of the next 4 bytes (in a hash table), the distance of the
+ * previous match, and row_size (the same bytes in the previous row). This
+ * is much faster than deflate, but it's good only for ranking encodings of
+ * the same image, not for predicting exact sizes.
+ */
+static uint32_t estimate_deflate_size(const char *data, uint32_t size,
+                                      uint32_t row_size) {
+  const unsigned char *p = (const unsigned char*)data;
+  /* heads[h] is 1 + the last position with hash h, or 0. prevs[i %
+   * DEFLATE_WINDOW_SIZE] is the same as heads[h] before position i.
+   */
+  uint32_t *heads = (uint32_t*)scratch_alloc(
+      sizeof(uint32_t) * ((1 << ESTIMATE_HASH_BITS) + DEFLATE_WINDOW_SIZE));
+  uint32_t *prevs = heads + (1 << ESTIMATE_HASH_BITS);
+  /* Literal and length codes, and distance codes, like in deflate. */
+  uint32_t lcounts[256 + 29], dcounts[30], i = 0, last_dist = 0, e;
+  double bits = 0;
+  const double stored_size = 6.0 + size + 5.0 * (size / 65535 + 1);
+  memset(heads, 0, sizeof(uint32_t) << ESTIMATE_HASH_BITS);
+  memset(lcounts, 0, sizeof(lcounts));
+  memset(dcounts, 0, sizeof(dcounts));
+  if (row_size > DEFLATE_WINDOW_SIZE) row_size = 0;
+  while (i < size) {
+    if (size - i >= 4) {
+      const uint32_t h = ESTIMATE_HASH(p + i);
+      const uint32_t max_len = size - i < 258 ? size - i : 258;
+      uint32_t head = heads[h], len = 0, dist = 0, len2, chain;
+      prevs[i & (DEFLATE_WINDOW_SIZE - 1)] = head;
+      heads[h] = i + 1;
+      for (chain = ESTIMATE_CHAIN; chain > 0 && head != 0 &&
+           i + 1 - head <= DEFLATE_WINDOW_SIZE && len < max_len; --chain) {
+        if ((len2 = get_match_length(p, i, i + 1 - head, max_len)) > len) {
+          len = len2;
+          dist = i + 1 - head;
+        }
+        head = prevs[(head - 1) & (DEFLATE_WINDOW_SIZE - 1)];
+      }
+      if (last_dist != 0 && last_dist <= i && len < max_len &&
+          (len2 = get_match_length(p, i, last_dist, max_len)) > len) {
+        len = len2;
+        dist = last_dist;
+      }
+      if (row_size != 0 && row_size <= i && len < max_len &&
+          (len2 = get_match_length(p, i, row_size, max_len)) > len) {
+        len = len2;
+        dist = row_size;
+      }
+      if (len >= 4) {
+        const uint32_t end = i + len;
+        if (len == 258) {
+          ++lcounts[256 + 28];
+        } else if (len - 3 < 8) {
+          ++lcounts[256 + len - 3];
+        } else {
+          e = get_log2_floor(len - 3) - 2;
+          ++lcounts[256 + 4 * e + ((len - 3) >> e)];
+          bits += e;
+        }
+        if (dist - 1 < 4) {
+          ++dcounts[dist - 1];
+        } else {
+          e = get_log2_floor(dist - 1) - 1;
+          ++dcounts[2 * e + 2 + ((dist - 1) >> e & 1)];
+          bits += e;
+        }
+        /* Make the rest of the match findable, like deflate does. */
+        for (++i; i < end && size - i >= 4; ++i) {
+          const uint32_t h2 = ESTIMATE_HASH(p + i);
+          prevs[i & (DEFLATE_WINDOW_SIZE - 1)] = heads[h2];
+          heads[h2] = i + 1;
+        }
+        i = end;
+        last_dist = dist;
+        continue;
+      }
+    }
+    ++lcounts[p[i++]];
+  }
+  scratch_free(heads);
+  bits += get_huffman_bits(lcounts, 256 + 29) + get_huffman_bits(dcounts, 30);
+  bits = 6 + (bits + 7) / 8;  /* Bytes, with the zlib header and adler32. */
+  return (uint32_t)(bits < stored_size ? bits : stored_size);
+}
+
+/* Returns an estimate of the size of the PNG file write_png_to_sink would
+ * write (with level 9).
+ */
+static uint32_t estimate_png_size(const Image *img, xbool_t is_extended,
+                                  uint8_t predictor_mode) {
+  const uint32_t rlen = img->rlen, height = img->height;
+  char *filtered = NULL;
+  uint32_t row_size, idat_size;
+  predictor_mode = get_png_predictor_mode(img, is_extended, predictor_mode);
+  if (predictor_mode != PM_NONE && height != 0) {
+    filtered = filter_png_rows(img->data, rlen, height, predictor_mode,
+                               img->bpc, img->cpp);
+  }
+  row_size = get_png_filtered_row_size(rlen, predictor_mode);
+  idat_size = estimate_deflate_size(filtered ? filtered : img->data,
+                                    multiply_check(row_size, height),
+                                    row_size);
+  if (filtered) scratch_free(filtered);
+  /* Header, optional palette, IDAT and IEND. */
+  return add_check(33 + 12 + 12 + (img->color_type == CT_INDEXED_RGB ?
+                                   12 + img->palette_size : 0), idat_size);
+}
+
+typedef struct PngEstimateJob {
+  const Image *img;
+  const PngCandidate *candidates;
+  uint32_t *sizes;
+  xbool_t is_extended;
+  uint8_t predictor_mode;
+} PngEstimateJob;
+
+static void estimate_png_candidate(void *arg, uint32_t task_idx) {
+  const PngEstimateJob *job = (const PngEstimateJob*)arg;
+  Image img;
+  copy_image(&img, job->img);
+  convert_to_png_candidate(&img, job->candidates + task_idx);
+  job->sizes[task_idx] =
+      estimate_png_size(&img, job->is_extended, job->predictor_mode);
+  dealloc_image(&img);
+}
+
+/* Like encode_best_png, but only estimates (with estimate_png_size) the
+ * output size of each candidate in candidates[:count], in parallel, and
+ * saves them to sizes[:count]. Returns the index of the smallest estimate
+ * (the earliest one on a tie).
+ */
+static uint32_t estimate_png_candidates(
+    const Image *img, xbool_t is_extended, const PngCandidate *candidates,
+    uint32_t count, uint8_t predictor_mode, uint32_t thread_count,
+    uint32_t *sizes) {
+  PngEstimateJob job;
+  uint32_t i, best_i;
+  job.img = img;
+  job.candidates = candidates;
+  job.sizes = sizes;
+  job.is_extended = is_extended;
+  job.predictor_mode = predictor_mode;
+  run_tasks(estimate_png_candidate, &job, count, thread_count);
+  for (best_i = 0, i = 1; i < count; ++i) {
+    if (sizes[i] < sizes[best_i]) best_i = i;
+  }
+  return best_i;
+}
+
+typedef struct PngCandidateJob {
+  const Image *img;
+  const PngCandidate *candidates;
+  Sink *outs;  /* outs[:candidate_count]. */
+  uint32_t candidate_count;
+  xbool_t is_extended;
+  uint8_t predictor_mode;
+  uint8_t flate_level;
+  uint8_t flate_strategy;
+  uint32_t thread_count;
+} PngCandidateJob;
+
+static void encode_png_candidate(void *arg, uint32_t task_idx) {
+  const PngCandidateJob *job = (const PngCandidateJob*)arg;
+  Image img;
+  copy_image(&img, job->img);
+  convert_to_png_candidate(&img, job->candidates + task_idx);
+  write_png_to_sink(job->outs + task_idx, &img, job->is_extended,
+                    job->predictor_mode, job->flate_level,
+                    job->flate_strategy, job->thread_count);
+  dealloc_image(&img);
+}
+
+/* For push_die_cleanup. */
+static void abort_png_candidates(void *job_arg) {
+  const PngCandidateJob *job = (const PngCandidateJob*)job_arg;
+  uint32_t i;
+  for (i = 0; i < job->candidate_count; ++i) {
+    free(job->outs[i].data);
+  }
+}
+
+/* Saves to order[:count] the indexes of sizes[:count], smallest size first
+ * (the earliest index on a tie).
+ */
+static void sort_png_candidate_order(uint32_t *order, const uint32_t *sizes,
+                                     uint32_t count) {
+  uint32_t i, j, k;
+  for (i = 0; i < count; ++i) {  /* Insertion sort, count is small. */
+    for (j = i, k = i; j > 0 && sizes[order[j - 1]] > sizes[k]; --j) {
+      order[j] = order[j - 1];
+    }
+    order[j] = k;
+  }
+}
+
+/* Like optimize_for_png followed by write_png_to_sink, but encodes
+ * candidate_count candidates in parallel (in memory), and saves the
+ * smallest output (the earliest candidate on a tie) to *best, a memory sink
+ * to be freed by the caller. If there are more candidates than
+ * candidate_count, it encodes those with the smallest estimate_png_size.
+ * The output doesn't depend on the timing of the threads. Also converts img
+ * to the winner candidate.
+ *
+ * Only works if img->bpc == 8.
+ */
+static void encode_best_png(Sink *best, Image *img,
+                            xbool_t is_extended, xbool_t force_gray,
+                            const ImageStats *st, uint8_t predictor_mode,
+                            uint8_t flate_level, uint8_t flate_strategy,
+                            uint32_t thread_count, uint32_t candidate_count) {
+  PngCandidate candidates[PNG_CANDIDATE_MAX];
+  PngCandidate ranked[PNG_CANDIDATE_MAX];  /* In the order of order. */
+  uint32_t sizes[PNG_CANDIDATE_MAX], order[PNG_CANDIDATE_MAX];
+  Sink outs[PNG_CANDIDATE_MAX];
+  PngCandidateJob job;
+  DieCleanup outs_cleanup;
+  uint32_t i, best_i;
+  const uint32_t count =
+      get_png_candidates(img, is_extended, force_gray, st, candidates);
+  if (count == 0) die("ASSERT: encode_best_png found no solution");
+  if (candidate_count < count) {
+    estimate_png_candidates(img, is_extended, candidates, count,
+                            predictor_mode, candidate_count, sizes);
+    sort_png_candidate_order(order, sizes, count);
+  } else {
+    candidate_count = count;
+    for (i = 0; i < count; ++i) {
+      order[i] = i;
+    }
+  }
+  for (i = 0; i < candidate_count; ++i) {
+    ranked[i] = candidates[order[i]];
+    nofile_sink(outs + i);
+  }
+  job.img = img;
+  job.candidates = ranked;
+  job.outs = outs;
+  job.candidate_count = candidate_count;
+  job.is_extended = is_extended;
+  job.predictor_mode = predictor_mode;
+  job.flate_level = flate_level;
+  job.flate_strategy = flate_strategy;
+  job.thread_count = thread_count;
+  push_die_cleanup(&outs_cleanup, abort_png_candidates, &job);
+  run_tasks(encode_png_candidate, &job, candidate_count, candidate_count);
+  pop_die_cleanup(&outs_cleanup);
+  for (best_i = 0, i = 1; i < candidate_count; ++i) {
+    if (outs[i].size < outs[best_i].size ||
+        (outs[i].size == outs[best_i].size && order[i] < order[best_i])) {
+      best_i = i;
+    }
+  }
+  set_png_candidate_stats(candidates, order[best_i], count);
+  /* Cheap compared to compression. Makes img reflect the output. */
+  convert_to_png_candidate(img, ranked + best_i);
+  *best = outs[best_i];
+  for (i = 0; i < candidate_count; ++i) {
+    if (i != best_i) free(outs[i].data);
+  }
+}
+
+/* --- Result cache (--cache-dir). */
+
+/* SHA-256 state (FIPS 180-4). The cache key must be collision resistant,
+ * because the input images may be untrusted.
+ */
+typedef struct Sha256 {
+  uint32_t h[8];
+  uint32_t size_lo, size_hi;  /* Number of bytes hashed so far. */
+  unsigned char block[64];  /* The partial block, size_lo & 63 bytes. */
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL};
+
+#define ROTR32(x, r) ((x) >> (r) | (x) << (32 - (r)))
+
+static void sha256_init(Sha256 *hs) {
+  static const uint32_t h0[8] = {
+      0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL,
+      0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL};
+  memcpy(hs->h, h0, sizeof(h0));
+  hs->size_lo = hs->size_hi = 0;
+}
+
+/* Hashes a 64-byte block p to hs. */
+static void sha256_block(Sha256 *hs, const unsigned char *p) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+  for (i = 0; i < 16; ++i, p += 4) {
+    w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+  }
+  for (; i < 64; ++i) {
+    t1 = w[i - 2]; t2 = w[i - 15];
+    w[i] = (ROTR32(t1, 17) ^ ROTR32(t1, 19) ^ t1 >> 10) + w[i - 7] +
+           (ROTR32(t2, 7) ^ ROTR32(t2, 18) ^ t2 >> 3) + w[i - 16];
+  }
+  a = hs->h[0]; b = hs->h[1]; c = hs->h[2]; d = hs->h[3];
+  e = hs->h[4]; f = hs->h[5]; g = hs->h[6]; h = hs->h[7];
+  for (i = 0; i < 64; ++i) {
+    t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+         ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+         ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+  }
+  hs->h[0] += a; hs->h[1] += b; hs->h[2] += c; hs->h[3] += d;
+  hs->h[4] += e; hs->h[5] += f; hs->h[6] += g; hs->h[7] += h;
+}
+
+/* Hashes p[:size] to hs. */
+static void sha256_update(Sha256 *hs, const char *p, uint32_t size) {
+  const unsigned char *up = (const unsigned char*)p;
+  const uint32_t used = hs->size_lo & 63;
+  uint32_t n;
+  if ((hs->size_lo += size) < size) ++hs->size_hi;
+  if (used != 0) {
+    n = 64 - used < size ? 64 - used : size;
+    memcpy(hs->block + used, up, n);
+    if (used + n < 64) return;
+    sha256_block(hs, hs->block);
+    up += n; size -= n;
+  }
+  for (; size >= 64; up += 64, size -= 64) {
+    sha256_block(hs, up);
+  }
+  memcpy(hs->block, up, size);
+}
+
+/* Pads the data hashed to hs, and writes the 32-byte digest to out. */
+static void sha256_final(Sha256 *hs, char *out) {
+  const uint32_t size_lo = hs->size_lo, size_hi = hs->size_hi;
+  const uint32_t used = size_lo & 63;
+  const uint32_t pad_size = (used < 56 ? 56 : 120) - used;
+  char tail[72];  /* 0x80, pad_size - 1 zeros, then the size in bits. */
+  int i;
+  memset(tail, '\0', pad_size);
+  tail[0] = (char)0x80;
+  put_u32be(tail + pad_size, size_hi << 3 | size_lo >> 29);
+  put_u32be(tail + pad_size + 4, size_lo << 3);
+  sha256_update(hs, tail, pad_size + 8);
+  for (i = 0; i < 8; ++i) {
+    out = put_u32be(out, hs->h[i]);
+  }
+}
+
+/* Bump this if the PNG output of the same pixels and flags changes. */
+#define CACHE_KEY_VERSION "imgdataopt-cache-3"
+
+/* Returns the filename of the cache entry in cache_dir of the PNG output of
+ * img (as read, before optimize_for_png) with the specified flags. Free it
+ * with scratch_free.
+ *
+ * -j:threads:N and -j:candidates:N are not part of the key: they only
+ * change how much work is done, so entries are shared between their values.
+ */
+static char *get_cache_filename(
+    const char *cache_dir, const Image *img, xbool_t is_extended,
+    xbool_t force_gray, uint8_t predictor_mode, uint8_t flate_level,
+    uint8_t flate_strategy) {
+  static const char hexdigits[] = "0123456789abcdef";
+  const uint32_t dir_size = strlen(cache_dir);
+  char key[sizeof(CACHE_KEY_VERSION) + 16 + 3 * 256], *p = key;
+  char digest[32], *filename, *q;
+  Sha256 hs;
+  uint32_t i;
+  memcpy(p, CACHE_KEY_VERSION, sizeof(CACHE_KEY_VERSION));
+  p += sizeof(CACHE_KEY_VERSION);
+  p = put_u32be(p, img->width);
+  p = put_u32be(p, img->height);
+  *p++ = img->color_type;
+  *p++ = img->bpc;
+  *p++ = is_extended;
+  *p++ = force_gray;
+  *p++ = predictor_mode;
+  *p++ = flate_level;
+  *p++ = flate_strategy;
+  p = put_u32be(p, img->palette_size);
+  memcpy(p, img->palette, img->palette_size);
+  p += img->palette_size;
+  sha256_init(&hs);
+  sha256_update(&hs, key, p - key);
+  sha256_update(&hs, img->data, multiply_check(img->rlen, img->height));
+  sha256_final(&hs, digest);
+  /* cache_dir + "/" + 64 hex digits + ".png" + "\0", followed by the
+   * temporary filename of write_cache_entry, which has 20 more bytes.
+   */
+  q = filename = (char*)scratch_alloc(
+      add_check(multiply_check(dir_size, 2), 160));
+  memcpy(q, cache_dir, dir_size);
+  q += dir_size;
+  *q++ = '/';
+  for (i = 0; i < 32; ++i) {
+    *q++ = hexdigits[(unsigned char)digest[i] >> 4];
+    *q++ = hexdigits[digest[i] & 15];
+  }
+  memcpy(q, ".png", 5);
+  return filename;
+}
+
+/* Returns whether data[:size] is a complete PNG file: the signature, then
+ * chunks with correct CRCs, ending with IEND at the end of data.
+ */
+static xbool_t is_complete_png(char *data, uint32_t size) {
+  uint32_t i = 8, chunk_size;
+  xbool_t is_iend = 0;
+  if (size < 8 || 0 != memcmp(data, "\211PNG\r\n\032\n", 8)) return 0;
+  while (!is_iend) {
+    if (size - i < 12 || (chunk_size = get_u32be(data + i)) > size - i - 12) {
+      return 0;
+    }
+    is_iend = 0 == memcmp(data + i + 4, "IEND", 4);
+    if (crc32(0, (const Bytef*)data + i + 4, chunk_size + 4) !=
+        get_u32be(data + i + 8 + chunk_size)) {
+      return 0;
+    }
+    i += chunk_size + 12;
+  }
+  return i == size;
+}
+
+/* Reads the cache entry filename to out (a memory sink). Returns whether
+ * it was found. Sets the bpc and color_type of img to those of the
+ * cached PNG.
+ */
+static xbool_t read_cache_entry(const char *filename, Sink *out,
+                                Image *img) {
+  FILE *f;
+  char buf[8192];
+  uint32_t got;
+  if (!(f = fopen(filename, "rb"))) return 0;
+  while ((got = fread(buf, 1, sizeof(buf), f)) > 0) {
+    sink_write(out, buf, got);
+  }
   fclose(f);
+  if (out->size < 33 || !is_complete_png(out->data, out->size) ||
+      0 != memcmp(out->data + 12, "IHDR", 4) ||
+      get_u32be(out->data + 16) != img->width ||
+      get_u32be(out->data + 20) != img->height) {
+    out->size = 0;  /* Truncated or bad cache entry, recompress it. */
+    return 0;
+  }
+  img->bpc = out->data[24];
+  img->color_type = out->data[25];
+  return 1;
 }
 
-/* Changes the bpc and/or the color_type heuristically, in order to make the
- * output of a subsequent write_png small.
- *
- * Only works if img->bpc == 8.
+/* Writes data to the cache entry filename atomically: to a temporary file
+ * first, then renames it. Errors are only warnings.
  */
-static void optimize_for_png(Image *img, xbool_t is_extended,
-                             xbool_t force_gray) {
-  /* !! if rgb4 is the winner, also try rgb8 */
-  /* !! if rgb2 is the winner, also try indexed8 */
-  /* !! if rgb1 is the winner, also try indexed4 */
-  /* Here we follow the order by pdfsizeopt
-   * (-s Gray1:Indexed1:Gray2:Indexed2:Rgb1:Gray4:Indexed4:Rgb2:Gray8:Indexed8:Rgb4:Rgb8:stop)
-   */
-  const xbool_t is_gray_ok_ = is_gray_ok(img);
-  const uint8_t min_rgb_bpc = get_min_rgb_bpc(img);
-  const uint32_t color_count = get_color_count(img);
-  if (img->bpc != 8) die("ASSERT: optimize_for_png needs bpc=8");
-  if (force_gray && !is_gray_ok_) die("cannot convert to gray");
-  if (is_gray_ok_ && min_rgb_bpc == 1) {  /* Gray1 */
-   do_gray:
-    convert_to_gray(img);
-    convert_to_bpc(img, min_rgb_bpc);
-  } else if (color_count <= 2 && !force_gray) {  /* Indexed1 */
-    convert_to_indexed(img);
-    convert_to_bpc(img, 1);
-  } else if (is_gray_ok_ && min_rgb_bpc == 2) {  /* Gray2 */
-    goto do_gray;
-  } else if (color_count <= 4 && !force_gray) {  /* Indexed2 */
-    convert_to_indexed(img);
-    convert_to_bpc(img, 2);
-  } else if (min_rgb_bpc == 1 && !force_gray && is_extended) {  /* Rgb1 */
-   do_rgb:
-    convert_to_rgb(img);
-    convert_to_bpc(img, min_rgb_bpc);
-  } else if (is_gray_ok_ && min_rgb_bpc == 4) {  /* Gray4 */
-    goto do_gray;
-  } else if (color_count <= 16 && !force_gray) {  /* Indexed4 */
-    convert_to_indexed(img);
-    convert_to_bpc(img, 4);
-  } else if (min_rgb_bpc == 2 && !force_gray && is_extended) {  /* Rgb2 */
-    goto do_rgb;
-  } else if (is_gray_ok_ && min_rgb_bpc == 8) {  /* Gray8 */
-    goto do_gray;
-  } else if (color_count <= 256 && !force_gray) {  /* Indexed8 */
-    convert_to_indexed(img);
-  } else if (min_rgb_bpc == 4 && !force_gray && is_extended) {  /* Rgb4 */
-    goto do_rgb;
-  } else if (min_rgb_bpc == 8 && !force_gray) {  /* Rgb8 */
-    goto do_rgb;
-  } else {
-    die("ASSERT: optimize_for_png found no solution");
+static void write_cache_entry(char *filename, const Sink *data) {
+  const uint32_t size = strlen(filename);
+  char *tmp_filename = filename + size + 1;
+  FILE *f;
+  uint32_t u = (uint32_t)(size_t)&f;  /* Different in concurrent threads. */
+  xbool_t is_ok;
+  int i;
+  memcpy(tmp_filename, filename, size);
+  memcpy(tmp_filename + size, ".tmp", 4);
+  for (i = 0; i < 16; ++i) {
+#if USE_PTHREAD  /* unistd.h is included. */
+    if (i == 8) u = getpid();
+#endif
+    tmp_filename[size + 4 + i] = "0123456789abcdef"[u & 15];
+    u >>= 4;
+  }
+  tmp_filename[size + 20] = '\0';
+  if (!(f = fopen(tmp_filename, "wb"))) {
+    warn("error creating cache entry");
+    return;
+  }
+  fwrite(data->data, 1, data->size, f);
+  fflush(f);
+  is_ok = !ferror(f);
+  is_ok = fclose(f) == 0 && is_ok;
+  if (!is_ok || rename(tmp_filename, filename) != 0) {
+    /* rename fails on Windows if another process has just created it. */
+    remove(tmp_filename);
+    if (!is_ok) warn("error writing cache entry");
   }
 }
 
@@ -1919,142 +5667,387 @@ static void regression_test() {
   const uint8_t predictor_mode = PM_PNGAUTO;
   const xbool_t is_extended = 0;
   const uint8_t flate_level = 0;
+  const uint32_t thread_count = 1;
 
   init_image_chess(&img);
   /* color_type=3 bpc=8 is_gray_ok=1 min_bpc=1 min_rgb_bpc=1 color_count=2 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
   write_pnm("chess2.ppm", &img);
-  write_png("chess2.png", &img, is_extended, predictor_mode, flate_level);
-  write_png("chess2n.png", &img, 1, PM_NONE, 9);
+  write_png("chess2.png", &img, is_extended, predictor_mode, flate_level, thread_count);
+  write_png("chess2n.png", &img, 1, PM_NONE, 9, thread_count);
   normalize_palette(&img);
   /* color_type=3 bpc=8 is_gray_ok=1 min_bpc=1 min_rgb_bpc=1 color_count=2 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
   convert_to_bpc(&img, 1);
-  write_png("chess2i1.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2i1.png", &img, is_extended, PM_NONE, 9, thread_count);
   read_png("chess2i1.png", &img);
   convert_to_bpc(&img, 2);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("chess2i2.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2i2.png", &img, is_extended, PM_NONE, 9, thread_count);
   read_png("chess2i2.png", &img);
   convert_to_bpc(&img, 4);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("chess2i4.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2i4.png", &img, is_extended, PM_NONE, 9, thread_count);
   read_png("chess2i4.png", &img);
   convert_to_bpc(&img, 1);
   img.color_type = CT_GRAY;  /* This only works if bpc=1. */
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("chess2g1.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2g1.png", &img, is_extended, PM_NONE, 9, thread_count);
   write_pnm("chess2.pbm", &img);
   convert_to_bpc(&img, 2);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("chess2g2.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2g2.png", &img, is_extended, PM_NONE, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("chess2g4.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2g4.png", &img, is_extended, PM_NONE, 9, thread_count);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
   convert_to_bpc(&img, 8);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("chess2g8.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2g8.png", &img, is_extended, PM_NONE, 9, thread_count);
   write_pnm("chess2.pgm", &img);
   convert_to_rgb(&img);
   /* color_type=2 bpc=8 is_gray_ok=1 min_bpc=1 min_rgb_bpc=1 color_count=2 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
-  write_png("chess2r8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess2r8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("chess2r4.png", &img, 1, PM_PNGAUTO, 9);
+  write_png("chess2r4.png", &img, 1, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 2);
-  write_png("chess2r2.png", &img, 1, PM_PNGAUTO, 9);
+  write_png("chess2r2.png", &img, 1, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 1);
-  write_png("chess2r1.png", &img, 1, PM_PNGAUTO, 9);
+  write_png("chess2r1.png", &img, 1, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 8);
   convert_to_gray(&img);
   /* color_type=0 bpc=8 is_gray_ok=1 min_bpc=1 min_rgb_bpc=1 color_count=2 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
   write_pnm("chess3.pgm", &img);
-  write_png("chess3g8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3g8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("chess3g4.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3g4.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 2);
-  write_png("chess3g2.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3g2.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 1);
-  write_png("chess3g1.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3g1.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   read_png("chess2n.png", &img);
-  write_png("chess3ni8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ni8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_gray(&img);
-  write_png("chess3ng8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ng8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 8);
   convert_to_indexed(&img);
   /* color_type=3 bpc=8 is_gray_ok=1 min_bpc=1 min_rgb_bpc=1 color_count=2 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
-  write_png("chess3ngi8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ngi8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 1);
-  write_png("chess3ngi1.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ngi1.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("chess3ngi4.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ngi4.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 2);
-  write_png("chess3ngi2.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("chess3ngi2.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
 
   read_png("chess2i1.png", &img);
-  write_png("chess2i1w.png", &img, 1, predictor_mode, 9);
+  write_png("chess2i1w.png", &img, 1, predictor_mode, 9, thread_count);
   read_png("chess2n.png", &img);
-  write_png("chess2nr.png", &img, is_extended, PM_NONE, 9);
+  write_png("chess2nr.png", &img, is_extended, PM_NONE, 9, thread_count);
   read_png("chess2.png", &img);
-  write_png("chess4.png", &img, is_extended, PM_PNGNONE, 9);
+  write_png("chess4.png", &img, is_extended, PM_PNGNONE, 9, thread_count);
   dealloc_image(&img);
   init_image_squares(&img);
   /* color_type=3 bpc=8 is_gray_ok=0 min_bpc=2 min_rgb_bpc=1 color_count=4 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
-  write_png("square1i8.png", &img, is_extended, PM_NONE, 9);
+  write_png("square1i8.png", &img, is_extended, PM_NONE, 9, thread_count);
   normalize_palette(&img);
-  write_png("square2i8.png", &img, is_extended, PM_NONE, 9);
+  write_png("square2i8.png", &img, is_extended, PM_NONE, 9, thread_count);
   convert_to_bpc(&img, 2);
   /*INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));*/
-  write_png("square2i2.png", &img, is_extended, PM_NONE, 9);
+  write_png("square2i2.png", &img, is_extended, PM_NONE, 9, thread_count);
   convert_to_bpc(&img, 8);
   convert_to_rgb(&img);
   /* color_type=2 bpc=8 is_gray_ok=0 min_bpc=1 min_rgb_bpc=1 color_count=4 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
   write_pnm("square2.ppm", &img);
-  write_png("square2r8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2r8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("square2r4.png", &img, 1, PM_PNGAUTO, 9);
+  write_png("square2r4.png", &img, 1, PM_PNGAUTO, 9, thread_count);
   read_png("square2r4.png", &img);
   convert_to_bpc(&img, 8);
-  write_png("square2r48.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2r48.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 2);
-  write_png("square2r2.png", &img, 1, PM_PNGAUTO, 9);
-  write_png("square2r2t.png", &img, 1, PM_TIFF2, 9);
+  write_png("square2r2.png", &img, 1, PM_PNGAUTO, 9, thread_count);
+  write_png("square2r2t.png", &img, 1, PM_TIFF2, 9, thread_count);
   convert_to_bpc(&img, 8);
-  write_png("square2r28.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2r28.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 1);
-  write_png("square2r1.png", &img, 1, PM_PNGAUTO, 9);
+  write_png("square2r1.png", &img, 1, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 8);
-  write_png("square2r18.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2r18.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_indexed(&img);
   /* color_type=3 bpc=8 is_gray_ok=0 min_bpc=2 min_rgb_bpc=1 color_count=4 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
-  write_png("square2ri8.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2ri8.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 2);
-  write_png("square2ri2.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2ri2.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
   convert_to_bpc(&img, 4);
-  write_png("square2ri4.png", &img, is_extended, PM_PNGAUTO, 9);
-  write_png("square2ri4t.png", &img, 1, PM_TIFF2, 9);
+  write_png("square2ri4.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
+  write_png("square2ri4t.png", &img, 1, PM_TIFF2, 9, thread_count);
 
   read_png("square2r2t.png", &img);
   convert_to_bpc(&img, 8);
-  write_png("square2r2tt.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2r2tt.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
 
   read_png("square2ri4t.png", &img);
-  write_png("square2ri4tt.png", &img, is_extended, PM_PNGAUTO, 9);
+  write_png("square2ri4tt.png", &img, is_extended, PM_PNGAUTO, 9, thread_count);
 
   /* !! Add a smaller version of beach.png to the repo. */
   read_png("beach.png", &img);
   /* color_type=2 bpc=8 is_gray_ok=0 min_bpc=8 min_rgb_bpc=8 color_count=257 */
   INFOF("color_type=%d bpc=%d is_gray_ok=%d min_bpc=%d min_rgb_bpc=%d color_count=%d\n", img.color_type, img.bpc, is_gray_ok(&img), get_min_bpc(&img), get_min_rgb_bpc(&img), get_color_count(&img));
-  write_png("beach3.png", &img, is_extended, PM_PNGNONE, 9);
+  write_png("beach3.png", &img, is_extended, PM_PNGNONE, 9, thread_count);
   dealloc_image(&img);
 }
 #endif
 
+/* --- Benchmark. */
+
+#if !NO_REGTEST
+/* Synthetic images for benchmark(), like init_image_chess and
+ * init_image_squares, but large, and also photo-like and scan-like.
+ */
+#define BI_CHESS 0  /* Indexed8 with 2 colors, min bpc 1. */
+#define BI_SQUARES 1  /* Indexed8 with 4 colors, min bpc 2. */
+#define BI_SCAN 2  /* Gray8 text on noisy paper, 16 gray levels, min bpc 4. */
+#define BI_PHOTO 3  /* Rgb8 gradients with noise, many colors. */
+#define BI_COUNT 4
+
+static const char *const bench_image_names[BI_COUNT] = {
+    "chess", "squares", "scan", "photo"};
+
+/* Returns a pseudorandom 3-bit number, and updates *seed. */
+static INLINE uint32_t get_bench_noise(uint32_t *seed) {
+  *seed = *seed * 1103515245UL + 12345;
+  return (*seed >> 28) & 7;
+}
+
+/* Creates a side * side image of kind BI_.... */
+static void init_bench_image(Image *img, uint8_t kind, uint32_t side) {
+  const xbool_t do_alloc_bpc8 = 0;
+  static const char chess_palette[] = "\0\0\0\xff\xff\xff";
+  static const char squares_palette[] = "\0\0\0\xff\0\0\0\xff\0\xff\xff\0";
+  const uint32_t cell = side >= 8 ? side / 8 : 1;
+  const uint32_t line_height = side >= 64 ? side / 64 : 1;
+  const uint32_t char_width = line_height / 2 + 1;
+  uint32_t x, y, seed = 1;
+  unsigned char *p;
+  if (kind == BI_CHESS) {
+    alloc_image(img, side, side, 8, CT_INDEXED_RGB, 6, do_alloc_bpc8);
+    memcpy(img->palette, chess_palette, 6);
+  } else if (kind == BI_SQUARES) {
+    alloc_image(img, side, side, 8, CT_INDEXED_RGB, 12, do_alloc_bpc8);
+    memcpy(img->palette, squares_palette, 12);
+  } else {
+    alloc_image(img, side, side, 8, kind == BI_SCAN ? CT_GRAY : CT_RGB, 0,
+                do_alloc_bpc8);
+  }
+  p = (unsigned char*)img->data;
+  for (y = 0; y < side; ++y) {
+    for (x = 0; x < side; ++x) {
+      if (kind == BI_CHESS) {
+        *p++ = (x / cell + y / cell) & 1;
+      } else if (kind == BI_SQUARES) {
+        /* Scaled from the 91x84 image of init_image_squares. */
+        const uint32_t sx = x * 91.0 / side, sy = y * 84.0 / side;
+        *p++ = (sx >= 50 && sx <= 85 && sy >= 10 && sy <= 50) +
+               (sx >= 10 && sx <= 60 && sy >= 40 && sy <= 80) * 2;
+      } else if (kind == BI_SCAN) {
+        /* Lines of characters made of 3x5 random blocks. */
+        const uint32_t bx = x % char_width * 4 / char_width;  /* 3: gap. */
+        const uint32_t by = y % line_height * 10 / line_height;
+        const uint32_t h = (x / char_width * 3 + bx) * 2654435761UL ^
+                           (y / line_height * 5 + by) * 40503UL;
+        const xbool_t is_ink = bx < 3 && by - 2 < 5U && (h >> 13 & 1);
+        *p++ = (is_ink ? get_bench_noise(&seed) >> 1 :
+                15 - (get_bench_noise(&seed) >> 2)) * 17;
+      } else {
+        const uint32_t r = x * 248.0 / side, g = y * 248.0 / side;
+        *p++ = r + get_bench_noise(&seed);
+        *p++ = g + get_bench_noise(&seed);
+        *p++ = (r + g) / 2 + get_bench_noise(&seed);
+      }
+    }
+  }
+}
+
+/* Stages timed by benchmark(). */
+#define BS_ANALYZE 0  /* finish_image_stats. */
+#define BS_OPTIMIZE 1  /* optimize_for_png. */
+#define BS_PACK 2  /* convert_to_bpc from 8 to the optimized bpc. */
+#define BS_UNPACK 3  /* convert_to_bpc from the optimized bpc to 8. */
+#define BS_WRITE 4  /* write_png_img_data with a predictor_mode. */
+#define BS_READ 5  /* read_png_stream, from memory. */
+
+typedef struct Bench {
+  Image img;  /* The generated image, bpc=8. */
+  Image opt;  /* img after optimize_for_png. */
+  Image opt8;  /* opt converted to bpc=8. */
+  Image tmp;  /* A copy modified by the timed code. */
+  Sink png;  /* opt as PNG, input of BS_READ. */
+  Sink out;  /* Output of BS_WRITE. */
+  ImageStats st;
+} Bench;
+
+/* Runs stage once, and returns its wall time in seconds. The untimed setup
+ * (e.g. copying the input image) is done first. Sets *out_size to the
+ * output size of BS_WRITE.
+ */
+static double run_bench_stage(Bench *b, uint8_t stage,
+                              uint8_t predictor_mode, uint32_t *out_size) {
+  Source src;
+  double t;
+  if (stage == BS_OPTIMIZE) {
+    copy_image(&b->tmp, &b->img);
+    init_image_stats(&b->st);
+    finish_image_stats(&b->st, &b->tmp);
+  } else if (stage == BS_PACK) {
+    copy_image(&b->tmp, &b->opt8);
+  } else if (stage == BS_UNPACK) {
+    copy_image(&b->tmp, &b->opt);
+  } else if (stage == BS_READ) {
+    memory_source(&src, b->png.data, b->png.size);
+    init_image_stats(&b->st);
+  } else {
+    init_image_stats(&b->st);
+    b->out.size = 0;
+  }
+  t = get_wall_time();
+  if (stage == BS_ANALYZE) {
+    finish_image_stats(&b->st, &b->img);
+  } else if (stage == BS_OPTIMIZE) {
+    optimize_for_png(&b->tmp, 0, 0, &b->st);
+  } else if (stage == BS_PACK) {
+    convert_to_bpc(&b->tmp, b->opt.bpc);
+  } else if (stage == BS_UNPACK) {
+    convert_to_bpc(&b->tmp, 8);
+  } else if (stage == BS_WRITE) {
+    *out_size = write_png_img_data(
+        &b->out, b->opt.data, b->opt.rlen, b->opt.height, predictor_mode,
+        b->opt.bpc, b->opt.cpp, 9, FS_DEFAULT, 1);
+  } else {
+    /* Reuses b->tmp.data, like --serve. */
+    read_image_source(&src, &b->tmp, 1, 1, &b->st, NULL, NULL, NULL);
+  }
+  t = get_wall_time() - t;
+  if (stage != BS_READ) dealloc_image(&b->tmp);
+  return t;
+}
+
+/* Runs stage repeat times, and writes a row of the benchmark table with
+ * the median, minimum and maximum wall time.
+ */
+static void bench_stage(Sink *table, Bench *b, const char *image_name,
+                        uint8_t stage, const char *stage_name,
+                        uint8_t predictor_mode, uint32_t repeat,
+                        double *times) {
+  uint32_t i, j, in_size, out_size = 0;
+  double t;
+  for (i = 0; i < repeat; ++i) {  /* Insertion sort. */
+    t = run_bench_stage(b, stage, predictor_mode, &out_size);
+    for (j = i; j > 0 && times[j - 1] > t; --j) {
+      times[j] = times[j - 1];
+    }
+    times[j] = t;
+  }
+  in_size = stage == BS_READ ? b->png.size :
+      stage == BS_WRITE || stage == BS_UNPACK ? b->opt.rlen * b->opt.height :
+      b->img.rlen * b->img.height;
+  if (stage == BS_READ || stage == BS_UNPACK || stage == BS_PACK) {
+    out_size = stage == BS_PACK ? b->opt.rlen * b->opt.height :
+        b->img.rlen * b->img.height;
+  }
+  sink_write(table, image_name, strlen(image_name));
+  sink_write(table, "\t", 1);
+  sink_write(table, stage_name, strlen(stage_name));
+  sink_write(table, "\t", 1);
+  sink_write_u32(table, b->img.width);
+  sink_write(table, "\t", 1);
+  sink_write_u32(table, b->img.height);
+  sink_write(table, "\t", 1);
+  sink_write_u32(table, in_size);
+  sink_write(table, "\t", 1);
+  sink_write_u32(table, out_size);
+  sink_write(table, "\t", 1);
+  sink_write_ms(table, times[repeat / 2]);
+  sink_write(table, "\t", 1);
+  sink_write_ms(table, times[0]);
+  sink_write(table, "\t", 1);
+  sink_write_ms(table, times[repeat - 1]);
+  sink_write(table, "\n", 1);
+  fflush(stdout);
+}
+
+/* Runs microbenchmarks of the stages of image processing on synthetic
+ * images of about megapixels * 1e6 pixels each, and writes a
+ * tab-separated table to stdout. Each stage is run repeat times.
+ */
+static void benchmark(uint32_t megapixels, uint32_t repeat) {
+  static const uint8_t predictor_modes[] = {
+      PM_NONE, PM_TIFF2, PM_PNGNONE, PM_PNGAUTO};
+  static const char *const write_stage_names[] = {
+      "write_png_img_data:none", "write_png_img_data:tiff2",
+      "write_png_img_data:pngnone", "write_png_img_data:pngauto"};
+  static const char header[] = "image\tstage\twidth\theight\tin_bytes\t"
+      "out_bytes\tmedian_ms\tmin_ms\tmax_ms\n";
+  Sink table;
+  Bench b;
+  double *times;
+  uint32_t side = 1, i;
+  uint8_t kind;
+  if (megapixels == 0 || megapixels > 1000) die("bad benchmark megapixels");
+  if (repeat == 0) die("bad benchmark repeat");
+  /* The largest side with side * side <= megapixels * 1e6. */
+  while ((side + 1) * (side + 1) <= megapixels * 1000000UL) ++side;
+  times = (double*)xmalloc(multiply_check(repeat, sizeof(double)));
+  nofile_sink(&table);
+  table.f = stdout;
+  sink_write(&table, header, sizeof(header) - 1);
+  nofile_sink(&b.out);
+  nofile_sink(&b.png);
+  noalloc_image(&b.tmp);
+  for (kind = 0; kind < BI_COUNT; ++kind) {
+    const char *image_name = bench_image_names[kind];
+    init_bench_image(&b.img, kind, side);
+    init_image_stats(&b.st);
+    finish_image_stats(&b.st, &b.img);
+    copy_image(&b.opt, &b.img);
+    optimize_for_png(&b.opt, 0, 0, &b.st);
+    copy_image(&b.opt8, &b.opt);
+    convert_to_bpc(&b.opt8, 8);
+    b.png.size = 0;
+    write_png_to_sink(&b.png, &b.opt, 0, PM_SMART, 9, FS_DEFAULT, 1);
+    bench_stage(&table, &b, image_name, BS_ANALYZE, "finish_image_stats",
+                0, repeat, times);
+    bench_stage(&table, &b, image_name, BS_OPTIMIZE, "optimize_for_png",
+                0, repeat, times);
+    if (b.opt.bpc != 8) {
+      bench_stage(&table, &b, image_name, BS_PACK, "convert_to_bpc:pack",
+                  0, repeat, times);
+      bench_stage(&table, &b, image_name, BS_UNPACK, "convert_to_bpc:unpack",
+                  0, repeat, times);
+    }
+    for (i = 0; i < sizeof(predictor_modes); ++i) {
+      bench_stage(&table, &b, image_name, BS_WRITE, write_stage_names[i],
+                  predictor_modes[i], repeat, times);
+    }
+    bench_stage(&table, &b, image_name, BS_READ, "read_png_stream",
+                0, repeat, times);
+    dealloc_image(&b.img);
+    dealloc_image(&b.opt);
+    dealloc_image(&b.opt8);
+    dealloc_image(&b.tmp);
+  }
+  free(b.out.data);
+  free(b.png.data);
+  free(times);
+}
+#endif
+
+
 /* --- main(). */
 
 static xbool_t is_endswith(const char *p, const char *suffix) {
@@ -2063,19 +6056,132 @@ static xbool_t is_endswith(const char *p, const char *suffix) {
   return plen >= suffixlen && 0 == strcmp(p + (plen - suffixlen), suffix);
 }
 
-int main(int argc, char **argv) {
-  char **argi;
-  const char *inputfn, *outputfn;
-  const xbool_t force_bpc8 = 1;
-  uint8_t predictor_mode = PM_SMART;  /* Also the default of sam2p. */
-  xbool_t is_extended = 0;  /* Allow extended (nonstandard) PNG output? */
-  xbool_t force_gray = 0;
-  xbool_t do_save_pdf_as_png = 0;
-  uint8_t flate_level = 9;  /* !! allow override in -c:zip:PREDICTOR:LEVEL; The default of sam2p is 5. */
-  Image img;
+#if !NO_MAIN  /* Only --serve uses it. */
+/* Parses a nonnegative decimal integer to *r. Returns 0 (without calling
+ * die()) on a syntax error or an overflow.
+ */
+static xbool_t parse_u32(const char *p, uint32_t *r) {
+  uint32_t u = 0;
+  if (*p == '\0') return 0;
+  for (; *p != '\0'; ++p) {
+    const uint32_t digit = (unsigned char)*p - '0';
+    if (digit > 9 || u > ((uint32_t)-1 - digit) / 10) return 0;
+    u = u * 10 + digit;
+  }
+  *r = u;
+  return 1;
+}
+#endif
 
-  (void)argc;
-  for (argi = argv + 1; *argi;) {
+/* Parses a nonnegative decimal integer in a command-line flag value. */
+static uint32_t parse_u32_flag_value(const char *p) {
+  uint32_t r = 0;
+  if (*p == '\0') die("decimal expected in flag");
+  for (; *p != '\0'; ++p) {
+    if ((*p - '0') + 0U > 9U) die("decimal expected in flag");
+    r = add_check(multiply_check(10, r), *p - '0');
+  }
+  return r;
+}
+
+/* --- Command-line flags and jobs. */
+
+typedef struct Flags {
+  uint8_t predictor_mode;
+  xbool_t is_extended;  /* Allow extended (nonstandard) PNG output? */
+  xbool_t force_gray;
+  xbool_t do_save_pdf_as_png;
+  xbool_t do_stream;
+  xbool_t do_reuse_idat;
+  uint8_t flate_level;
+  uint8_t flate_strategy;
+  const char *cache_dir;  /* NULL unless --cache-dir. */
+  const char *alpha_output;  /* NULL unless --alpha-output. */
+  xbool_t do_stats;
+  xbool_t is_stats_json;
+  uint32_t deadline_ms;  /* 0 unless --deadline-ms. */
+  uint32_t thread_count;
+  uint32_t candidate_count;
+  /* The rest is used only in the top-level command-line. */
+  uint32_t worker_count;
+  const char *batch_filename;  /* NULL unless --batch or --batch0. */
+  xbool_t is_batch0;
+  xbool_t do_serve;
+  xbool_t do_estimate;
+} Flags;
+
+static void init_flags(Flags *flags) {
+  flags->predictor_mode = PM_SMART;  /* Also the default of sam2p. */
+  flags->is_extended = 0;
+  flags->force_gray = 0;
+  flags->do_save_pdf_as_png = 0;
+  flags->do_stream = 0;
+  flags->do_reuse_idat = 0;
+  flags->cache_dir = NULL;
+  flags->alpha_output = NULL;
+  flags->do_stats = 0;
+  flags->is_stats_json = 0;
+  flags->deadline_ms = 0;
+  flags->flate_level = 9;  /* The default of sam2p is 5. */
+  flags->flate_strategy = FS_DEFAULT;
+  flags->thread_count = 1;
+  flags->candidate_count = 1;
+  flags->worker_count = 1;
+#if USE_PTHREAD && defined(_SC_NPROCESSORS_ONLN)
+  {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count > 1) flags->worker_count = cpu_count;
+  }
+#endif
+  flags->batch_filename = NULL;
+  flags->is_batch0 = 0;
+  flags->do_serve = 0;
+  flags->do_estimate = 0;
+}
+
+/* Parses PREDICTOR[:LEVEL] in -c:zip:PREDICTOR[:LEVEL] to flags. */
+static void parse_zip_flag_value(const char *p, Flags *flags) {
+  uint32_t predictor = 0;
+  if ((*p - '0') + 0U > 9U) die("bad -c:zip: flag value");
+  for (; (*p - '0') + 0U <= 9U && predictor < 100; ++p) {
+    predictor = 10 * predictor + (*p - '0');
+  }
+  if (predictor == PM_NONE ||
+#if !NO_PMTIFF
+      predictor == PM_TIFF2 ||
+#endif
+      predictor == PM_PNGNONE || predictor == PM_PNGAUTO ||
+      predictor == PM_SMART) {
+    flags->predictor_mode = predictor;
+  } else {
+    die("bad -c:zip: predictor");
+  }
+  if (*p == ':') {
+    const uint32_t level = parse_u32_flag_value(p + 1);
+    if (level > 9) die("bad -c:zip: level");
+    flags->flate_level = level;
+  } else if (*p != '\0') {
+    die("bad -c:zip: flag value");
+  }
+}
+
+/* Parses NAME in -j:strategy:NAME. */
+static uint8_t parse_strategy_flag_value(const char *p) {
+  static const char *const names[] = {
+      "default", "filtered", "huffman", "rle", "tuned", "search", NULL};
+  const char *const *name;
+  for (name = names; *name && 0 != strcmp(p, *name); ++name) {}
+  if (!*name) die("bad -j:strategy: flag value");
+  return name - names;
+}
+
+/* Parses command-line flags in argi[...] to flags. Returns pointer to the
+ * first non-flag argument.
+ *
+ * is_toplevel is false for flags within a --batch job.
+ */
+static char **parse_flags(char **argi, Flags *flags, xbool_t is_toplevel) {
+  while (*argi) {
     char *arg = *argi++;
     if (arg[0] != '-' || arg[1] == '\0') {
       --argi;
@@ -2086,25 +6192,45 @@ int main(int argc, char **argv) {
       /* Ignore this flag, for compatibility with sam2p called by pdfsizeopt. */
     } else if (0 == strcmp(arg, "-pdf:2")) {
       /* For compatibility with sam2p called by pdfsizeopt (sam2p_np). */
-      is_extended = 1;
-      do_save_pdf_as_png = 1;
+      flags->is_extended = 1;
+      flags->do_save_pdf_as_png = 1;
     } else if (0 == strcmp(arg, "-j:ext") ||  /* sam2p takes is as -j (do_displayJobFile=true). Not recommended for compatibiltiy. */
                0 == strcmp(arg, "-j:00")) {  /* sam2p takes it as -j:job:0 (do_displayJobFile=false), same as the default. */
-      is_extended = 1;
+      flags->is_extended = 1;
+    } else if (0 == strncmp(arg, "-j:threads:", 11)) {  /* sam2p doesn't support this. */
+      if ((flags->thread_count = parse_u32_flag_value(arg + 11)) == 0) {
+        die("bad -j:threads: flag value");
+      }
+    } else if (0 == strncmp(arg, "-j:strategy:", 12)) {  /* sam2p doesn't support this. */
+      flags->flate_strategy = parse_strategy_flag_value(arg + 12);
+    } else if (0 == strcmp(arg, "-j:stream")) {  /* sam2p doesn't support this. */
+      flags->do_stream = 1;
+    } else if (0 == strcmp(arg, "--reuse-idat")) {  /* sam2p doesn't support this. */
+      flags->do_reuse_idat = 1;
+    } else if (0 == strcmp(arg, "--cache-dir") && *argi) {  /* sam2p doesn't support this. */
+      flags->cache_dir = *argi++;
+    } else if (0 == strcmp(arg, "--alpha-output") && *argi) {  /* sam2p doesn't support this. */
+      flags->alpha_output = *argi++;
+    } else if (0 == strcmp(arg, "--stats") ||  /* sam2p doesn't support this. */
+               0 == strcmp(arg, "--stats-json")) {
+      flags->do_stats = 1;
+      flags->is_stats_json = arg[7] == '-';
+    } else if (0 == strcmp(arg, "--deadline-ms") && *argi) {  /* sam2p doesn't support this. */
+      if ((flags->deadline_ms = parse_u32_flag_value(*argi++)) == 0) {
+        die("bad --deadline-ms flag value");
+      }
+    } else if (0 == strncmp(arg, "-j:candidates:", 14)) {  /* sam2p doesn't support this. */
+      if ((flags->candidate_count = parse_u32_flag_value(arg + 14)) == 0) {
+        die("bad -j:candidates: flag value");
+      }
     } else if (arg[1] == 'c' && arg[2] == ':') {
       arg += 3;
      process_c_flag:
-      if (0 == strcmp(arg, "zip:1:9")) {
-        predictor_mode = PM_NONE;
-      } else if (0 == strcmp(arg, "zip:10:9")) {
-        predictor_mode = PM_PNGNONE;
-      } else if (0 == strcmp(arg, "zip:15:9")) {
-        predictor_mode = PM_PNGAUTO;
-      } else if (0 == strcmp(arg, "zip:25:9")) {
-        predictor_mode = PM_SMART;
+      if (0 == strncmp(arg, "zip:", 4)) {
+        parse_zip_flag_value(arg + 4, flags);
       } else if (0 == strcmp(arg, "zip")) {  /* sam2p default. Not recommended. */
-        predictor_mode = PM_NONE;
-        flate_level = 5;
+        flags->predictor_mode = PM_NONE;
+        flags->flate_level = 5;
       } else {
         die("unknown -c flag value");
       }
@@ -2124,60 +6250,731 @@ int main(int argc, char **argv) {
        */
       if (0 == strcmp(arg, "grays") ||  /* sam2p doesn't support this. */
           0 == strcmp(arg, "Gray1:Gray2:Gray4:Gray8:stop")) {  /* Also works with sam2p. pdfsizeopt calls with this. */
-        force_gray = 1;
+        flags->force_gray = 1;
       } else if (0 == strcmp(arg, "Gray1:Indexed1:Gray2:Indexed2:Rgb1:Gray4:Indexed4:Rgb2:Gray8:Indexed8:Rgb4:Rgb8:stop")) {
         /* Also works with sam2p. For non-transparaent PNG output, it's the same as without -s. pdfsizeopt calls with this. */
-        force_gray = 0;
+        flags->force_gray = 0;
       } else {
         die("unknown -s flag value");
       }
     } else if (arg[1] == 's' && arg[2] == '\0' && *argi) {
       arg = *argi++;
       goto process_s_flag;
+    } else if (!is_toplevel) {
+      die("unknown flag in job");
+    } else if (0 == strncmp(arg, "-j:workers:", 11)) {  /* sam2p doesn't support this. */
+      if ((flags->worker_count = parse_u32_flag_value(arg + 11)) == 0) {
+        die("bad -j:workers: flag value");
+      }
+    } else if ((0 == strcmp(arg, "--batch") || 0 == strcmp(arg, "--batch0")) &&
+               *argi) {
+      flags->is_batch0 = arg[7] == '0';
+      flags->batch_filename = *argi++;
+    } else if (0 == strcmp(arg, "--serve")) {
+      flags->do_serve = 1;
+    } else if (0 == strcmp(arg, "--estimate")) {
+      flags->do_estimate = 1;
 #if !NO_REGTEST
     } else if (0 == strcmp(arg, "--regression-test")) {
       regression_test();
-      return 0;
+      exit(0);
+    } else if (0 == strcmp(arg, "--benchmark") && argi[0] && argi[1]) {
+      benchmark(parse_u32_flag_value(argi[0]), parse_u32_flag_value(argi[1]));
+      exit(0);
 #endif
     } else {
       die("unknown flag");
     }
   }
-  /* !! add --help */
+  return argi;
+}
+
+/* Writes img as PNG to sink, reusing the IDAT stream in icp if possible. */
+static void write_png_for_job(Sink *sink, const Image *img,
+                              const Flags *flags, const IdatCopy *icp) {
+  if (icp && can_reuse_idat(icp, img, flags->is_extended,
+                            flags->predictor_mode)) {
+    write_png_reusing_idat(sink, img, flags->is_extended, icp);
+  } else {
+    write_png_to_sink(sink, img, flags->is_extended, flags->predictor_mode,
+                      flags->flate_level, flags->flate_strategy,
+                      flags->thread_count);
+  }
+}
+
+static xbool_t is_png_filename(const char *filename, const Flags *flags) {
+  /* TODO(pts): Use case insensitive comparison for extensions. */
+  return is_endswith(filename, ".png") ||
+      (flags->do_save_pdf_as_png && is_endswith(filename, ".pdf"));
+}
+
+/* Writes img (as read by convert_image_file) to outputfn, or to out if not
+ * NULL, in the format of the extension of outputfn. stats is for img. icp
+ * is for --reuse-idat, it may be NULL.
+ */
+static void write_image_for_job(const Flags *flags, const char *outputfn,
+                                Sink *out, Image *img, ImageStats *stats,
+                                const IdatCopy *icp, JobStats *job_stats,
+                                StageClock *clk, Deadline *deadline) {
+  const xbool_t force_gray = flags->force_gray;
+  const xbool_t is_png_output = is_png_filename(outputfn, flags);
+  Sink file_sink, *sink = out;
+  const char *write_msg = NULL;
+  Flags degraded_flags;
+  if (is_png_output && img->bpc == 16) {
+    /* Like the bpc=8 candidates: Gray16 if it's lossless. */
+    if (img->color_type == CT_RGB && (force_gray || is_rgb16_gray(img))) {
+      convert_to_gray(img);  /* Fails if not gray, for -s:grays. */
+    }
+    if (job_stats) {
+      job_stats->branch = img->color_type == CT_GRAY ? "Gray16" : "Rgb16";
+    }
+    write_msg = "error writing png";
+    if (!out) open_file_sink(sink = &file_sink, outputfn, write_msg);
+    write_png_to_sink(sink, img, 0, flags->predictor_mode, flags->flate_level,
+                      flags->flate_strategy, flags->thread_count);
+  } else if (is_png_output) {
+    /* Output of encode_best_png or the cache, or the output to be cached or
+     * timed separately from writing.
+     */
+    Sink best;
+    DieCleanup best_cleanup;
+    char *cache_filename = NULL;
+    xbool_t is_cached = 0;
+    nofile_sink(&best);
+    push_die_cleanup(&best_cleanup, free_sink_data, &best);
+    finish_image_stats(stats, img);
+    add_stage_clock(job_stats, STAGE_ANALYZE, clk);
+    /* With --reuse-idat, the output depends on the input IDAT stream. */
+    if (flags->cache_dir && !icp) {
+      cache_filename = get_cache_filename(
+          flags->cache_dir, img, flags->is_extended, force_gray,
+          flags->predictor_mode, flags->flate_level, flags->flate_strategy);
+      if ((is_cached = read_cache_entry(cache_filename, &best, img)) &&
+          job_stats) {
+        job_stats->branch = "cached";
+      }
+    }
+    if (!is_cached &&
+        is_deadline_at_risk(deadline, DEADLINE_COMPRESS_LEFT)) {
+      /* Cheaper settings, still lossless. */
+      degraded_flags = *flags;
+      degraded_flags.candidate_count = 1;
+      degraded_flags.flate_strategy = FS_DEFAULT;
+      degraded_flags.predictor_mode = PM_PNGNONE;
+      if (degraded_flags.flate_level > 1) degraded_flags.flate_level = 1;
+      flags = &degraded_flags;
+    }
+    if (is_cached) {  /* The output is in best. */
+    } else if (flags->candidate_count > 1) {
+      encode_best_png(&best, img, flags->is_extended, force_gray, stats,
+                      flags->predictor_mode, flags->flate_level,
+                      flags->flate_strategy, flags->thread_count,
+                      flags->candidate_count);
+    } else {
+      optimize_for_png(img, flags->is_extended, force_gray, stats);
+      add_stage_clock(job_stats, STAGE_CONVERT, clk);
+      if (cache_filename || job_stats) {
+        write_png_for_job(&best, img, flags, icp);
+      }
+    }
+    add_stage_clock(job_stats, STAGE_COMPRESS, clk);
+    if (cache_filename) {
+      /* The cache key doesn't reflect the settings of a degraded output. */
+      if (!is_cached && !(deadline && deadline->is_degraded)) {
+        write_cache_entry(cache_filename, &best);
+      }
+      scratch_free(cache_filename);
+    }
+    write_msg = "error writing png";
+    if (!out) open_file_sink(sink = &file_sink, outputfn, write_msg);
+    if (best.data) {
+      sink_write(sink, best.data, best.size);
+    } else {
+      write_png_for_job(sink, img, flags, icp);
+    }
+    pop_die_cleanup(&best_cleanup);
+    free(best.data);
+#if !NO_PNM
+  } else if (is_endswith(outputfn, ".ppm") || is_endswith(outputfn, ".pgm") ||
+             is_endswith(outputfn, ".pbm") || is_endswith(outputfn, ".pnm")) {
+    char pnm_type = outputfn[strlen(outputfn) - 2];  /* 'p', 'g', 'b' or 'n'. */
+    if (img->bpc == 16) {
+      if (pnm_type == 'n') {
+        pnm_type = img->color_type == CT_GRAY || is_rgb16_gray(img) ?
+            'g' : 'p';
+      }
+      /* It would have been reduced to bpc=8 if it was 0 and 65535 only. */
+      if (pnm_type == 'b') die("cannot convert bpc=16 image to pbm");
+    } else if (pnm_type == 'n') {
+      finish_image_stats(stats, img);
+      pnm_type = !stats->is_gray_ok ? 'p' : stats->min_rgb_bpc > 1 ? 'g' : 'b';
+    }
+    add_stage_clock(job_stats, STAGE_ANALYZE, clk);
+    if (pnm_type == 'p') {
+      if (force_gray) die("cannot save gray as ppm");
+      convert_to_rgb(img);
+    } else {
+      convert_to_gray(img);
+      if (pnm_type == 'b') convert_to_bpc(img, 1);
+    }
+    add_stage_clock(job_stats, STAGE_CONVERT, clk);
+    write_msg = "error writing pnm";
+    if (!out) open_file_sink(sink = &file_sink, outputfn, write_msg);
+    write_pnm_to_sink(sink, img);
+#endif
+  } else {
+    die("bad output format");
+  }
+  if (sink != out) close_file_sink(sink, write_msg);
+}
+
+/* Converts image file argi[0] to argi[1] according to flags. If src is not
+ * NULL, it reads the input image from there instead of argi[0]. If out is
+ * not NULL, it writes the output image there instead of argi[1] (but the
+ * output format is still derived from argi[1]). img is used as a
+ * temporary, and it's left in the color type and bpc of the output.
+ * Returns whether --deadline-ms made it use cheaper settings.
+ */
+static xbool_t convert_image_file(const Flags *flags, char **argi,
+                                  Source *src, Sink *out, Image *img) {
+  const char *inputfn, *outputfn;
+  const xbool_t force_bpc8 = 1;
+  const xbool_t force_gray = flags->force_gray;
+  ImageStats stats;
+  PngRowWriter rw, *rwp = NULL;
+  IdatCopy ic, *icp = NULL;
+  AlphaMask am, *amp = NULL;
+  xbool_t is_png_output;
+  JobStats job_stats_storage, *job_stats = NULL;
+  /* Free the memory above on a trapped die(). */
+  DieCleanup ic_cleanup, am_cleanup, job_stats_cleanup;
+  StageClock clk;
+  Deadline deadline_storage, *deadline = NULL;
+  xbool_t is_degraded;
+  uint32_t peak_alloced;
   if (!(inputfn = *argi++)) die("missing input filename");
   if (!(outputfn = *argi++)) die("missing output filename");
   if (*argi) die("too many command-line arguments");
+  is_png_output = is_png_filename(outputfn, flags);
+  /* Streaming would overwrite the input file while reading it. */
+  if (flags->do_stream && is_png_output &&
+      (src || out || 0 != strcmp(inputfn, outputfn))) {
+    init_png_row_writer(&rw, outputfn, out, flags->is_extended, force_gray,
+                        flags->predictor_mode, flags->flate_level,
+                        flags->flate_strategy);
+    rwp = &rw;
+  }
+  if (flags->do_reuse_idat && is_png_output) {
+    nofile_sink(&ic.data);
+    icp = &ic;
+    push_die_cleanup(&ic_cleanup, free_sink_data, &ic.data);
+  }
+  if (flags->alpha_output) {
+    init_alpha_mask(amp = &am);
+    push_die_cleanup(&am_cleanup, abort_alpha_mask, amp);
+  }
+  if (flags->do_stats) {
+    init_job_stats(job_stats = &job_stats_storage);
+    set_thread_ptr(TS_JOB_STATS, job_stats);
+    push_die_cleanup(&job_stats_cleanup, abort_job_stats, job_stats);
+  }
+  if (flags->deadline_ms != 0) {
+    init_deadline(deadline = &deadline_storage, flags->deadline_ms);
+    set_thread_ptr(TS_DEADLINE, deadline);
+  }
+
+  start_stage_clock(job_stats, &clk);
+  init_image_stats(&stats);
+  if (src) {
+    read_image_source(src, img, force_bpc8, flags->thread_count, &stats, rwp,
+                      icp, amp);
+  } else {
+    read_image(inputfn, img, force_bpc8, flags->thread_count, &stats, rwp,
+               icp, amp);
+  }
+  add_stage_clock(job_stats, STAGE_READ, &clk);
+  if (amp && am.is_used && am.and_alpha != 255) {
+    /* Written first, so that --stats shows the branch of the color image. */
+    ImageStats alpha_stats;
+    init_image_stats(&alpha_stats);
+    write_image_for_job(flags, flags->alpha_output, NULL, &am.img,
+                        &alpha_stats, NULL, job_stats, &clk, deadline);
+  }
+  /* The output file is created only after reading the input, so they can
+   * be the same file.
+   */
+  if (rwp && rw.is_started) {
+    finish_png_row_writer(&rw, img);
+  } else {
+    write_image_for_job(flags, outputfn, out, img, &stats, icp, job_stats,
+                        &clk, deadline);
+  }
+  if (job_stats) pop_die_cleanup(&job_stats_cleanup);
+  if (amp) pop_die_cleanup(&am_cleanup);
+  if (icp) {
+    pop_die_cleanup(&ic_cleanup);
+    free(ic.data.data);
+  }
+  peak_alloced = img->alloced;
+  if (amp) {
+    if (am.img.data) peak_alloced += am.img.alloced;
+    dealloc_image(&am.img);
+  }
+  is_degraded = deadline && deadline->is_degraded;
+  set_thread_ptr(TS_DEADLINE, NULL);
+  if (job_stats) {
+    add_stage_clock(job_stats, STAGE_WRITE, &clk);
+    job_stats->peak_alloced = peak_alloced;
+    job_stats->is_degraded = is_degraded;
+    write_job_stats(job_stats, inputfn, flags->is_stats_json);
+    set_thread_ptr(TS_JOB_STATS, NULL);
+    dealloc_job_stats(job_stats);
+  }
+  return is_degraded;
+}
+
+/* Runs a --batch or --serve job (or an imgdataopt_optimize call): flags
+ * followed by the input and output filename. Returns NULL on success, or
+ * the die() message. If is_degraded is not NULL, sets it to the return
+ * value of convert_image_file.
+ */
+static const char *run_job_trapped(const Flags *flags, char **argv,
+                                   Source *src, Sink *out, Image *img,
+                                   xbool_t *is_degraded) {
+  DieTrap trap;
+  DieTrap *old_trap;
+  const char *msg;
+  trap.f = NULL;
+#if USE_MMAP
+  trap.map = NULL;
+#endif
+  trap.cleanups = NULL;
+  old_trap = set_die_trap(&trap);
+  if (setjmp(trap.jb) == 0) {
+    Flags job_flags = *flags;
+    const xbool_t is_job_degraded = convert_image_file(
+        &job_flags, parse_flags(argv, &job_flags, 0), src, out, img);
+    if (is_degraded) *is_degraded = is_job_degraded;
+    msg = NULL;
+  } else {
+    /* The cleanups have freed the buffers of the job. The zlib streams and
+     * the scratch buffers are in the ZCache of the thread.
+     */
+    msg = trap.msg;
+    set_thread_ptr(TS_JOB_STATS, NULL);  /* Set by --stats. */
+    set_thread_ptr(TS_DEADLINE, NULL);  /* Set by --deadline-ms. */
+  }
+  set_die_trap(old_trap);
+  return msg;
+}
 
+/* --- Library API, see imgdataopt.h. */
+
+const char *imgdataopt_optimize(const void *in, size_t in_len,
+                                const char *const *flags,
+                                const char *output_ext,
+                                void **out, size_t *out_len) {
+  Flags base_flags;
+  Source src;
+  Sink sink;
+  Image img;
+  ZCache zcache;  /* Also frees the zlib streams of a failed call. */
+  char **argv;
+  const char *msg;
+  size_t flag_count = 0;
+  *out = NULL;
+  *out_len = 0;
+  if ((uint32_t)in_len != in_len) return "input image too large";
+  if (flags) {
+    for (; flags[flag_count]; ++flag_count) {}
+  }
+  /* flags..., "--", "-", output_ext, NULL. */
+  if (!(argv = (char**)malloc((flag_count + 4) * sizeof(char*)))) {
+    return "out of memory";
+  }
+  if (flag_count != 0) memcpy(argv, flags, flag_count * sizeof(char*));
+  argv[flag_count] = (char*)"--";
+  argv[flag_count + 1] = (char*)"-";
+  argv[flag_count + 2] = (char*)output_ext;
+  argv[flag_count + 3] = NULL;
+  init_flags(&base_flags);
+  memory_source(&src, (const char*)in, in_len);
+  nofile_sink(&sink);
   noalloc_image(&img);
-  read_image(inputfn, &img, force_bpc8);
-  /* TODO(pts): Use case insensitive comparison for extensions. */
-  if (is_endswith(outputfn, ".png") ||
-      (do_save_pdf_as_png && is_endswith(outputfn, ".pdf"))) {
-    optimize_for_png(&img, is_extended, force_gray);
-    write_png(outputfn, &img, is_extended, predictor_mode, flate_level);
-#if !NO_PNM
-  } else if (is_endswith(outputfn, ".ppm")) {
-   write_ppm:
-    if (force_gray) die("cannot save gray as ppm");
-    convert_to_rgb(&img);
-    write_pnm(outputfn, &img);
-  } else if (is_endswith(outputfn, ".pgm")) {
-   write_pgm:
-    convert_to_gray(&img);
-    write_pnm(outputfn, &img);
-  } else if (is_endswith(outputfn, ".pbm")) {
-   write_pbm:
-    convert_to_gray(&img);
-    convert_to_bpc(&img, 1);
-    write_pnm(outputfn, &img);
-  } else if (is_endswith(outputfn, ".pnm")) {
-    if (!is_gray_ok(&img)) goto write_ppm;
-    if (get_min_rgb_bpc(&img) > 1) goto write_pgm;
-    goto write_pbm;
+  init_zcache(&zcache);
+  set_thread_ptr(TS_ZCACHE, &zcache);
+  msg = run_job_trapped(&base_flags, argv, &src, &sink, &img, NULL);
+  set_thread_ptr(TS_ZCACHE, NULL);
+  dealloc_zcache(&zcache);
+  dealloc_image(&img);
+  free(argv);
+  if (msg) {
+    free(sink.data);
+  } else {
+    *out = sink.data;
+    *out_len = sink.size;
+  }
+  return msg;
+}
+
+void imgdataopt_free(void *p) {
+  free(p);
+}
+
+#if !NO_MAIN
+/* Splits lines p[:pend - p] to NULL-terminated jobs of arguments separated
+ * by whitespace. Empty lines and lines starting with # are ignored. *pend
+ * must be '\0'. Saves the arguments to args, and the index of the first
+ * argument of each job to job_starts. Returns the number of jobs.
+ */
+static uint32_t split_job_lines(char *p, char *pend, char **args,
+                                uint32_t *job_starts) {
+  uint32_t job_count = 0, arg_count = 0;
+  xbool_t is_first = 1;
+  while (p != pend) {
+    char c = *p;
+    if (c == '\n') {
+      if (!is_first) args[arg_count++] = NULL;
+      is_first = 1;
+      *p++ = '\0';
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\0') {
+      *p++ = '\0';
+    } else if (c == '#' && is_first) {
+      for (; p != pend && *p != '\n'; ++p) {}
+    } else {
+      if (is_first) job_starts[job_count++] = arg_count;
+      is_first = 0;
+      args[arg_count++] = p;
+      for (; p != pend && (c = *p) != ' ' && c != '\t' && c != '\r' &&
+           c != '\n' && c != '\0'; ++p) {}
+    }
+  }
+  if (!is_first) args[arg_count++] = NULL;
+  return job_count;
+}
+
+typedef struct Batch {
+  const Flags *flags;
+  /* Job job_idx has arguments args[job_starts[job_idx]:...] until NULL. */
+  char **args;
+  uint32_t *job_starts;
+  xbool_t *is_failed;  /* Indexed by job_idx. */
+  xbool_t *is_degraded;  /* Indexed by job_idx. Set by --deadline-ms. */
+} Batch;
+
+static void run_batch_job(void *arg, uint32_t job_idx) {
+  Batch *batch = (Batch*)arg;
+  const char *msg;
+  Sink line;
+  Image img;
+  ZCache zcache;  /* Also frees the zlib streams of a failed job. */
+  init_zcache(&zcache);
+  set_thread_ptr(TS_ZCACHE, &zcache);
+  noalloc_image(&img);
+  msg = run_job_trapped(
+      batch->flags, batch->args + batch->job_starts[job_idx], NULL, NULL,
+      &img, batch->is_degraded + job_idx);
+  dealloc_image(&img);
+  set_thread_ptr(TS_ZCACHE, NULL);
+  dealloc_zcache(&zcache);
+  /* A single fwrite, so lines of concurrent jobs don't get mixed. */
+  nofile_sink(&line);
+  sink_write(&line, "job ", 4);
+  sink_write_u32(&line, job_idx + 1);
+  if (msg) {
+    sink_write(&line, ": fatal: ", 9);
+    sink_write(&line, msg, strlen(msg));
+    batch->is_failed[job_idx] = 1;
+  } else {
+    sink_write(&line, ": ok", 4);
+    if (batch->is_degraded[job_idx]) sink_write(&line, " degraded", 9);
+  }
+  sink_write(&line, "\n", 1);
+  fwrite(line.data, 1, line.size, stdout);
+  fflush(stdout);
+  free(line.data);
+}
+
+/* Disables the newline conversion of f (stdin or stdout) on Windows. */
+static void set_binary_mode(FILE *f) {
+#ifdef _WIN32
+  _setmode(_fileno(f), _O_BINARY);
+#else
+  (void)f;
 #endif
+}
+
+/* Reads the jobs from flags->batch_filename, and runs them on
+ * flags->worker_count threads. Returns the exit code.
+ *
+ * With --batch, each line is a job: flags, input filename and output
+ * filename separated by whitespace. Empty lines and lines starting with #
+ * are ignored. With --batch0, the file contains NUL-terminated input and
+ * output filenames, alternating. The filename - means stdin.
+ */
+static int run_batch(const Flags *flags) {
+  Sink data;
+  Batch batch;
+  char *p, *pend;
+  uint32_t job_count = 0, arg_count = 0;
+  uint32_t i, max_arg_count;
+  xbool_t is_first = 1, is_ok = 1, is_degraded = 0;
+  FILE *f;
+  nofile_sink(&data);
+  if (0 == strcmp(flags->batch_filename, "-")) {
+    set_binary_mode(f = stdin);  /* For --batch0. */
+  } else if (!(f = fopen(flags->batch_filename, "rb"))) {
+    die("error reading batch file");
+  }
+  for (;;) {
+    char buf[8192];
+    const uint32_t got = fread(buf, 1, sizeof(buf), f);
+    if (got == 0) break;
+    sink_write(&data, buf, got);
+  }
+  if (ferror(f)) die("error reading batch file");
+  if (f != stdin) fclose(f);
+  sink_write(&data, "", 1);  /* Trailing NUL for the last argument. */
+  /* Upper bound: in --batch0 each job takes at least 2 bytes for 4 args
+   * (including "--" and NULL). With --batch it's less.
+   */
+  max_arg_count = add_check(multiply_check(data.size, 2), 4);
+  batch.args = (char**)xmalloc(multiply_check(max_arg_count, sizeof(char*)));
+  batch.job_starts = (uint32_t*)xmalloc(
+      multiply_check(max_arg_count, sizeof(uint32_t)));
+  p = data.data;
+  pend = p + data.size - 1;
+  if (flags->is_batch0) {
+    while (p != pend) {
+      if (is_first) {
+        batch.job_starts[job_count++] = arg_count;
+        batch.args[arg_count++] = (char*)"--";  /* No flags. */
+      }
+      batch.args[arg_count++] = p;
+      p += strlen(p);
+      if (p != pend) ++p;
+      if (!(is_first = !is_first)) continue;
+      batch.args[arg_count++] = NULL;
+    }
+    if (!is_first) die("odd number of filenames in batch file");
   } else {
-    die("bad output format");
+    job_count = split_job_lines(p, pend, batch.args, batch.job_starts);
+  }
+  batch.flags = flags;
+  batch.is_failed = (xbool_t*)xmalloc(job_count);
+  memset(batch.is_failed, '\0', job_count);
+  batch.is_degraded = (xbool_t*)xmalloc(job_count);
+  memset(batch.is_degraded, '\0', job_count);
+  run_tasks(run_batch_job, &batch, job_count, flags->worker_count);
+  for (i = 0; i < job_count; ++i) {
+    if (batch.is_failed[i]) is_ok = 0;
+    if (batch.is_degraded[i]) is_degraded = 1;
+  }
+  free(batch.is_degraded);
+  free(batch.is_failed);
+  free(batch.job_starts);
+  free(batch.args);
+  free(data.data);
+  return !is_ok ? 120 : is_degraded ? EXIT_DEGRADED : 0;
+}
+
+/* Returns -1 on error. */
+static long get_file_size(const char *filename) {
+  FILE *f;
+  long size;
+  if (!(f = fopen(filename, "rb"))) return -1;
+  size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+  fclose(f);
+  return size;
+}
+
+#define SERVE_LINE_MAX 8192
+
+/* Runs --serve: reads requests from stdin, and writes a reply line to
+ * stdout for each, until EOF. Returns the exit code.
+ *
+ * Each request is a line in the --batch format: flags, input filename and
+ * output filename. If the input filename is =SIZE (e.g. =1234), then the
+ * input image is the SIZE bytes following the line. The reply is
+ * `ok color_type=C bpc=B size=S' (with the output color type, bpc and file
+ * size, followed by ` degraded=1' if --deadline-ms was hit), or
+ * `fatal: MSG'. Empty lines and lines starting with # get no
+ * reply.
+ *
+ * A bad request gets a fatal reply, and serving continues. Requests longer
+ * than SERVE_LINE_MAX are skipped until the newline. If SIZE is malformed,
+ * no input image bytes are read. Exits (with 120) if EOF is reached in the
+ * input image.
+ *
+ * The zlib streams, the scratch buffers and the image buffers are reused
+ * between requests.
+ */
+static int run_serve(const Flags *flags) {
+  ZCache zcache;
+  Image img;
+  Sink line, input;
+  char *args[SERVE_LINE_MAX / 2 + 2];
+  uint32_t job_start;
+  int c, exit_code = 0;
+  init_zcache(&zcache);
+  set_thread_ptr(TS_ZCACHE, &zcache);
+  noalloc_image(&img);
+  nofile_sink(&line);
+  nofile_sink(&input);
+  /* The inline input images are binary, and the replies end with \n. */
+  set_binary_mode(stdin);
+  set_binary_mode(stdout);
+  for (;;) {
+    Source src;
+    const char *msg = NULL, *inputfn;
+    uint32_t arg_count, size;
+    long output_size = -1;
+    xbool_t is_degraded = 0, is_too_long = 0;
+    line.size = 0;
+    while ((c = getc(stdin)) >= 0 && c != '\n') {
+      const char b = c;
+      if (line.size == SERVE_LINE_MAX) {
+        is_too_long = 1;  /* Skip the rest of the line. */
+      } else {
+        sink_write(&line, &b, 1);
+      }
+    }
+    if (c < 0 && line.size == 0) break;
+    if (is_too_long) {
+      msg = "serve request line too long";
+      goto reply;
+    }
+    sink_write(&line, "", 1);
+    if (split_job_lines(line.data, line.data + line.size - 1, args,
+                        &job_start) == 0) continue;
+    for (arg_count = 0; args[arg_count]; ++arg_count) {}
+    inputfn = arg_count >= 2 ? args[arg_count - 2] : "";
+    if (inputfn[0] == '=') {  /* Read the inline input image. */
+      if (!parse_u32(inputfn + 1, &size)) {
+        msg = "bad serve input image size";
+        goto reply;
+      }
+      input.size = 0;
+      while (size > 0) {
+        char buf[8192];
+        const uint32_t got =
+            fread(buf, 1, size < sizeof(buf) ? size : sizeof(buf), stdin);
+        if (got == 0) {
+          msg = "eof in serve input image";
+          exit_code = 120;
+          goto reply;
+        }
+        sink_write(&input, buf, got);
+        size -= got;
+      }
+      memory_source(&src, input.data, input.size);
+    }
+    /* Also releases the scratch buffers of a failed previous job. */
+    reset_arena(&zcache.scratch);
+    msg = run_job_trapped(flags, args, inputfn[0] == '=' ? &src : NULL, NULL,
+                          &img, &is_degraded);
+    if (!msg && (output_size = get_file_size(args[arg_count - 1])) < 0) {
+      msg = "error getting output size";
+    }
+   reply:
+    line.size = 0;
+    if (msg) {
+      sink_write(&line, "fatal: ", 7);
+      sink_write(&line, msg, strlen(msg));
+    } else {
+      sink_write(&line, "ok color_type=", 14);
+      sink_write_u32(&line, img.color_type);
+      sink_write(&line, " bpc=", 5);
+      sink_write_u32(&line, img.bpc);
+      sink_write(&line, " size=", 6);
+      sink_write_u32(&line, output_size);
+      if (is_degraded) sink_write(&line, " degraded=1", 11);
+    }
+    sink_write(&line, "\n", 1);
+    fwrite(line.data, 1, line.size, stdout);
+    fflush(stdout);
+    if (exit_code != 0) break;
   }
+  set_thread_ptr(TS_ZCACHE, NULL);
+  dealloc_zcache(&zcache);
   dealloc_image(&img);
-  return 0;
+  free(line.data);
+  free(input.data);
+  return exit_code;
+}
+
+static void sink_write_estimate(Sink *line, const char *key,
+                                const PngCandidate *candidate, uint32_t size) {
+  const char *name = get_png_candidate_name(candidate);
+  sink_write(line, "estimate: ", 10);
+  sink_write(line, key, strlen(key));
+  sink_write(line, "=", 1);
+  sink_write(line, name, strlen(name));
+  sink_write(line, " size=", 6);
+  sink_write_u32(line, size);
+  sink_write(line, "\n", 1);
+}
+
+/* Runs --estimate: reads image file argi[0], and writes a line to stdout
+ * with the estimated PNG output size (see estimate_png_size) of each
+ * lossless color type and bpc candidate, in the -j:candidates:N order, and
+ * a line with the best one.
+ */
+static void estimate_image_file(const Flags *flags, char **argi) {
+  const char *inputfn;
+  PngCandidate candidates[PNG_CANDIDATE_MAX];
+  uint32_t sizes[PNG_CANDIDATE_MAX], count, best_i, i;
+  ImageStats stats;
+  Image img;
+  Sink line;
+  if (!(inputfn = *argi++)) die("missing input filename");
+  if (*argi) die("too many command-line arguments");
+  noalloc_image(&img);
+  init_image_stats(&stats);
+  read_image(inputfn, &img, 1, flags->thread_count, &stats, NULL, NULL, NULL);
+  if (img.bpc == 16) die("cannot estimate bpc=16 image");
+  finish_image_stats(&stats, &img);
+  count = get_png_candidates(&img, flags->is_extended, flags->force_gray,
+                             &stats, candidates);
+  if (count == 0) die("ASSERT: estimate_image_file found no solution");
+  best_i = estimate_png_candidates(
+      &img, flags->is_extended, candidates, count, flags->predictor_mode,
+      flags->thread_count, sizes);
+  nofile_sink(&line);
+  for (i = 0; i < count; ++i) {
+    sink_write_estimate(&line, "candidate", candidates + i, sizes[i]);
+  }
+  sink_write_estimate(&line, "best", candidates + best_i, sizes[best_i]);
+  fwrite(line.data, 1, line.size, stdout);
+  free(line.data);
+  dealloc_image(&img);
+}
+
+int main(int argc, char **argv) {
+  Flags flags;
+  char **argi;
+  Image img;
+  xbool_t is_degraded;
+
+  (void)argc;
+  init_flags(&flags);
+  argi = parse_flags(argv + 1, &flags, 1);
+  /* !! add --help */
+  if (flags.do_estimate) {
+    if (flags.batch_filename || flags.do_serve) {
+      die("--estimate doesn't work with --batch or --serve");
+    }
+    estimate_image_file(&flags, argi);
+    return 0;
+  }
+  if (flags.batch_filename || flags.do_serve) {
+    if (*argi) die("too many command-line arguments");
+    return flags.do_serve ? run_serve(&flags) : run_batch(&flags);
+  }
+  noalloc_image(&img);
+  is_degraded = convert_image_file(&flags, argi, NULL, NULL, &img);
+  dealloc_image(&img);
+  return is_degraded ? EXIT_DEGRADED : 0;
 }
+#endif
@@ -0,0 +1,47 @@
+/*
+ * imgdataopt.h: in-memory API of imgdataopt
+ * by pts@fazekas.hu
+ *
+ * Build libimgdataopt.a with `make libimgdataopt.a', and link against it.
+ * If it was built with PTHREAD_FLAGS (the default), also link with
+ * -pthread. It contains the bundled zlib.
+ */
+
+#ifndef IMGDATAOPT_H
+#define IMGDATAOPT_H 1
+
+#include <stddef.h>  /* size_t. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Converts the PNG or PNM image in[:in_len] in memory, the same way as
+ * `imgdataopt FLAGS... -- INPUT OUTPUT' does on files.
+ *
+ * flags is a NULL-terminated array of per-job command-line flags (e.g.
+ * "-c:zip:15:9", "-s:grays", "-j:threads:4"), or NULL. The output format is
+ * derived from output_ext, which is like the end of the output filename
+ * (e.g. ".png" or ".pgm").
+ *
+ * On success, returns NULL, and sets *out to the output image (to be freed
+ * with imgdataopt_free) and *out_len to its size. On failure, returns the
+ * error message (a static string), and sets *out to NULL. All other memory
+ * allocated by the call is freed in both cases.
+ *
+ * Warnings are still printed to stderr. If compiled with USE_PTHREAD, it's
+ * safe to call from multiple threads concurrently.
+ */
+const char *imgdataopt_optimize(const void *in, size_t in_len,
+                                const char *const *flags,
+                                const char *output_ext,
+                                void **out, size_t *out_len);
+
+/* Frees the output image returned by imgdataopt_optimize. */
+void imgdataopt_free(void *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* IMGDATAOPT_H */
@@ -3,12 +3,16 @@
 #
 # This tests that imgdataopt can load various PNG files correctly, especially
 # with all kinds of predictors. Please note that it's not a comprehensive
-# test, for example it doesn't contain interlaced PDF. It is also checked
-# that imgdataopt is able to load its own output.
+# test. The *adam7.png files are interlaced, the *16*.png files have
+# bpc=16, the *a8*.png and *a16*.png files have an alpha channel. It is also
+# checked that imgdataopt is able to load its own output.
 #
 
 function cleanup() {
   rm -f -- png_test.tmp.pbm png_test.tmp.pgm png_test.tmp.ppm png_test.tmp.png
+  rm -f -- png_test.tmp2.png png_test.tmp2.ppm png_test.tmp.jobs
+  rm -f -- png_test.tmp.replies
+  rm -rf -- png_test.tmp.cache
 }
 
 function do_png_test() {
@@ -30,12 +34,35 @@ function do_png_test() {
   #perl -pi -0777 -e 's@\A(P\d\n)#.*\n@$1@' "$TMP_PNM"
   cmp "$EXPECTED_PNM" "$TMP_PNM"
 
+  # -j:strategy:search tries all zlib strategies, and keeps the smallest.
+  $PREFIX "$IMGDATAOPT" -j:quiet -c:zip:15:6 -j:strategy:search -- "$INPUT_PNG" "$TMP_PNG"
+  $PREFIX "$IMGDATAOPT" -j:quiet -- "$TMP_PNG" "$TMP_PNM"
+  cmp "$EXPECTED_PNM" "$TMP_PNM"
+
   $PREFIX "$IMGDATAOPT" -j:quiet -- "$INPUT_PNG" "$TMP_PNG"
   $PREFIX "$IMGDATAOPT" -j:quiet -- "$TMP_PNG" "$TMP_PNM"
   #perl -pi -0777 -e 's@\A(P\d\n)#.*\n@$1@' "$TMP_PNM"
   cmp "$EXPECTED_PNM" "$TMP_PNM"
 
-  rm -f -- "$TMP_PNG" "$TMP_PNM"
+  # -j:candidates:12 encodes all color type and bpc combinations, and keeps
+  # the smallest output.
+  $PREFIX "$IMGDATAOPT" -j:quiet -j:ext -j:candidates:12 -- "$INPUT_PNG" "$TMP_PNG"
+  $PREFIX "$IMGDATAOPT" -j:quiet -- "$TMP_PNG" "$TMP_PNM"
+  cmp "$EXPECTED_PNM" "$TMP_PNM"
+
+  # -j:stream writes the rows as they are read, keeping the color type and
+  # bpc of the input.
+  $PREFIX "$IMGDATAOPT" -j:quiet -j:ext -j:stream -- "$INPUT_PNG" "$TMP_PNG"
+  $PREFIX "$IMGDATAOPT" -j:quiet -- "$TMP_PNG" "$TMP_PNM"
+  cmp "$EXPECTED_PNM" "$TMP_PNM"
+
+  # --reuse-idat copies the IDAT stream of its own output verbatim.
+  $PREFIX "$IMGDATAOPT" -j:quiet -- "$INPUT_PNG" "$TMP_PNG"
+  $PREFIX "$IMGDATAOPT" -j:quiet --reuse-idat -- "$TMP_PNG" png_test.tmp2.png
+  $PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png "$TMP_PNM"
+  cmp "$EXPECTED_PNM" "$TMP_PNM"
+
+  rm -f -- "$TMP_PNG" png_test.tmp2.png "$TMP_PNM"
 }
 
 set -ex
@@ -58,6 +85,10 @@ do_png_test hello.indexed4allpreds.png png_test.tmp.ppm hello.rgb8.ppm
 do_png_test hello.indexed4orig.png png_test.tmp.ppm hello.rgb8.ppm
 do_png_test hello.indexed4pngout.png png_test.tmp.ppm hello.rgb8.ppm
 do_png_test hello.rgb8allpreds.png png_test.tmp.ppm hello.rgb8.ppm
+do_png_test hello.gray2adam7.png png_test.tmp.pgm hello.gray2.pgm
+do_png_test hello.indexed4adam7.png png_test.tmp.ppm hello.rgb8.ppm
+do_png_test hello.rgb8adam7.png png_test.tmp.ppm hello.rgb8.ppm
+do_png_test hello.rgb16.png png_test.tmp.ppm hello.rgb8.ppm
 
 do_png_test chess.gray1.png png_test.tmp.pbm chess.gray1.pbm
 do_png_test chess.gray2.png png_test.tmp.pgm chess.gray1.pgm
@@ -67,6 +98,7 @@ do_png_test chess.grayb1.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.grayb2.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.grayb4.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.grayb8.png png_test.tmp.pgm chess.gray1.pgm
+do_png_test chess.grayu8.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexed1.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexed1w.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexed2.png png_test.tmp.pgm chess.gray1.pgm
@@ -79,6 +111,7 @@ do_png_test chess.indexedc4.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexedc8.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexedd8.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.indexede8.png png_test.tmp.pgm chess.gray1.pgm
+do_png_test chess.indexedf8.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.rgb1.png png_test.tmp.pgm chess.gray1.pgm
 do_png_test chess.rgb2.png png_test.tmp.pbm chess.gray1.pbm
 do_png_test chess.rgb4.png png_test.tmp.ppm chess.gray1.ppm
@@ -94,6 +127,145 @@ do_png_test square.rgb1.png png_test.tmp.ppm square.rgb1.ppm
 do_png_test square.rgb2.png png_test.tmp.ppm square.rgb1.ppm
 do_png_test square.rgb4.png png_test.tmp.ppm square.rgb1.ppm
 do_png_test square.rgb8.png png_test.tmp.ppm square.rgb1.ppm
+do_png_test square.rgb4adam7.png png_test.tmp.ppm square.rgb1.ppm
+do_png_test square.rgb16adam7.png png_test.tmp.ppm square.rgb1.ppm
+
+# bpc=16 input which can't be reduced to bpc=8 is kept as bpc=16.
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.gray16.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.gray16.png png_test.tmp.png
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+# Gray16 can be written as rgb, and gray rgb16 as gray.
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.gray16.png png_test.tmp.ppm
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.rgb16.png png_test.tmp2.ppm
+cmp png_test.tmp.ppm png_test.tmp2.ppm
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.rgb16.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" --stats -s:grays -- chess.rgb16.png png_test.tmp.png 2>png_test.tmp.replies
+grep -q ' branch=Gray16 ' png_test.tmp.replies
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- chess.rgb16.png png_test.tmp2.png
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+
+# --batch runs many jobs (with optional flags) in a single process.
+printf '%s\n' '# Comment.' 'chess.rgb8.png png_test.tmp.pgm' \
+    '-c:zip:15:9 square.indexedb8.png png_test.tmp.png' >png_test.tmp.jobs
+$PREFIX "$IMGDATAOPT" -j:workers:2 --batch png_test.tmp.jobs
+cmp chess.gray1.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.ppm
+cmp square.rgb1.ppm png_test.tmp.ppm
+# A failing job (corrupt input or unwritable output) doesn't stop the
+# others, but it makes the exit code nonzero.
+head -c 40 chess.rgb8.png >png_test.tmp2.png
+printf '%s\n' 'png_test.tmp2.png png_test.tmp.ppm' \
+    'chess.rgb8.png png_test.tmp.missing/x.png' \
+    'chess.rgb8.png png_test.tmp.pgm' >png_test.tmp.jobs
+if $PREFIX "$IMGDATAOPT" --batch png_test.tmp.jobs >png_test.tmp.replies; then false; fi
+test "$(cat png_test.tmp.replies)" = "$(printf '%s\n' \
+    'job 1: fatal: eof in png chunk header' \
+    'job 2: fatal: error writing png' 'job 3: ok')"
+cmp chess.gray1.pgm png_test.tmp.pgm
+
+# --serve reads requests from stdin, also with inline input image data.
+{ echo 'chess.rgb8.png png_test.tmp.pgm'
+  echo "=$(($(wc -c <square.indexed8.png))) png_test.tmp.png"
+  cat square.indexed8.png
+} >png_test.tmp.jobs
+$PREFIX "$IMGDATAOPT" --serve <png_test.tmp.jobs >png_test.tmp.replies
+test "$(grep -c '^ok ' png_test.tmp.replies)" = 2
+cmp chess.gray1.pgm png_test.tmp.pgm
+# A bad request gets a fatal reply, and the next request is still served.
+{ echo '=abc png_test.tmp.png'
+  printf '%9000s\n' x
+  echo 'chess.rgb8.png png_test.tmp.pgm'
+} >png_test.tmp.jobs
+$PREFIX "$IMGDATAOPT" --serve <png_test.tmp.jobs >png_test.tmp.replies
+test "$(sed -n 1,2p png_test.tmp.replies)" = "$(printf '%s\n' \
+    'fatal: bad serve input image size' 'fatal: serve request line too long')"
+test "$(sed -n '3s/ .*//p' png_test.tmp.replies)" = ok
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.ppm
+cmp square.rgb1.ppm png_test.tmp.ppm
+
+# --cache-dir stores the output, and writes it again when the pixels and
+# the flags are the same.
+mkdir png_test.tmp.cache
+$PREFIX "$IMGDATAOPT" -j:quiet --cache-dir png_test.tmp.cache -- square.indexed8.png png_test.tmp.png
+ls png_test.tmp.cache | grep -qx '[0-9a-f]\{64\}[.]png'
+$PREFIX "$IMGDATAOPT" -j:quiet --cache-dir png_test.tmp.cache -- square.indexed8.png png_test.tmp2.png
+cmp png_test.tmp.png png_test.tmp2.png
+# -j:threads:N and -j:candidates:N share the cache entries.
+$PREFIX "$IMGDATAOPT" --stats -j:threads:2 -j:candidates:4 --cache-dir png_test.tmp.cache -- square.indexed8.png png_test.tmp2.png 2>png_test.tmp.replies
+grep -q ' branch=cached ' png_test.tmp.replies
+cmp png_test.tmp.png png_test.tmp2.png
+# A truncated cache entry is a miss.
+for F in png_test.tmp.cache/*; do head -c 40 -- "$F" >png_test.tmp.ppm; mv -- png_test.tmp.ppm "$F"; done
+$PREFIX "$IMGDATAOPT" --stats --cache-dir png_test.tmp.cache -- square.indexed8.png png_test.tmp2.png 2>png_test.tmp.replies
+if grep -q ' branch=cached ' png_test.tmp.replies; then false; fi
+cmp png_test.tmp.png png_test.tmp2.png
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.ppm
+cmp square.rgb1.ppm png_test.tmp.ppm
+
+# --stats and --stats-json report timing and counters to stderr.
+$PREFIX "$IMGDATAOPT" --stats -- chess.rgb8.png png_test.tmp.png 2>png_test.tmp.replies
+grep -q '^stats: stage=deflate wall_ms=' png_test.tmp.replies
+grep -q ' branch=Gray1 ' png_test.tmp.replies
+$PREFIX "$IMGDATAOPT" --stats-json -- chess.rgb8.png png_test.tmp.png 2>png_test.tmp.replies
+grep -q '^{"input":"chess.rgb8.png","stages":{"read":{"wall_ms":' png_test.tmp.replies
+
+# --estimate prints the estimated PNG output size of each candidate.
+$PREFIX "$IMGDATAOPT" --estimate -- chess.rgb8.png >png_test.tmp.replies
+grep -q '^estimate: candidate=Rgb8 size=' png_test.tmp.replies
+grep -q '^estimate: best=Gray1 size=' png_test.tmp.replies
+# The estimated best candidate is the real best (compressing all candidates)
+# for each test image, so -j:candidates:2 (which compresses the 2 with the
+# smallest estimate) writes the same output.
+for F in *.png *.p?m; do
+  # Images with alpha or bpc=16 don't have candidates.
+  if ! $PREFIX "$IMGDATAOPT" --estimate -- "$F" >png_test.tmp.replies 2>/dev/null; then continue; fi
+  B="$(sed -n 's/^estimate: best=\([^ ]*\) .*/\1/p' png_test.tmp.replies)"
+  $PREFIX "$IMGDATAOPT" --stats -j:candidates:12 -- "$F" png_test.tmp.png 2>png_test.tmp.replies
+  grep -q " branch=$B " png_test.tmp.replies
+  $PREFIX "$IMGDATAOPT" -j:quiet -j:candidates:2 -- "$F" png_test.tmp2.png
+  cmp png_test.tmp.png png_test.tmp2.png
+done
+
+# --deadline-ms degrades only if the time is running out.
+$PREFIX "$IMGDATAOPT" --deadline-ms 100000 --stats -- chess.rgb8.png png_test.tmp.png 2>png_test.tmp.replies
+grep -q ' degraded=0$' png_test.tmp.replies
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.pgm
+cmp chess.gray1.pgm png_test.tmp.pgm
+
+# --alpha-output splits the alpha channel to a separate gray image, and
+# doesn't write it if the image is opaque.
+if $PREFIX "$IMGDATAOPT" -j:quiet -- hello.rgba8.png png_test.tmp.ppm 2>/dev/null; then false; fi
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- hello.rgba8.png png_test.tmp.ppm
+cmp hello.rgb8.ppm png_test.tmp.ppm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp hello.alpha8.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- hello.graya8adam7.png png_test.tmp.png
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp.png png_test.tmp.pgm
+cmp hello.gray2.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp hello.alpha8.pgm png_test.tmp.pgm
+# With bpc=16, the color and alpha samples are reduced to bpc=8 separately.
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- hello.rgba16.png png_test.tmp.ppm
+cmp hello.rgb8.ppm png_test.tmp.ppm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp hello.alpha8.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- chess.graya16.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp chess.gray1.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- chess.graya16adam7.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+$PREFIX "$IMGDATAOPT" -j:quiet -- png_test.tmp2.png png_test.tmp.pgm
+cmp chess.gray16.pgm png_test.tmp.pgm
+rm -f png_test.tmp2.png
+$PREFIX "$IMGDATAOPT" -j:quiet --alpha-output png_test.tmp2.png -- hello.rgb8adam7.png png_test.tmp.ppm
+test ! -f png_test.tmp2.png
 
 cleanup  # Clean up only on success.
 
@@ -54,6 +54,111 @@
 #  define MOD4(a) a %= BASE
 #endif
 
+/* SIMD versions for amd64 (SSSE3 and AVX2), selected at runtime by
+ * adler32(). Define NO_SIMD to disable them. Like in Chromium's zlib, the
+ * input is processed in 32-byte blocks: s1 is the sum of the bytes
+ * (_mm_sad_epu8), and the increment of s2 within the block is the dot
+ * product of the bytes and [32, 31, ..., 1] (_mm_maddubs_epi16).
+ */
+#if !defined(NO_SIMD) && defined(__SSE2__) && !defined(__TINYC__) && \
+    (defined(__clang__) ? __clang_major__ >= 4 : __GNUC__ >= 5)
+#  define ADLER32_SIMD
+#  include <immintrin.h>
+
+#define ADLER32_BLOCK_SIZE 32
+
+/* Returns the sum of the 4 32-bit lanes of v. */
+local unsigned adler32_hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));  /* [2, 3, 0, 1]. */
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));  /* [1, 0, 3, 2]. */
+    return (unsigned)_mm_cvtsi128_si32(v);
+}
+
+/* len must be divisible by ADLER32_BLOCK_SIZE. */
+local __attribute__((target("ssse3"))) uLong adler32_ssse3(
+    uLong adler, const Bytef *buf, uInt len)
+{
+    const __m128i tap1 = _mm_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i v_ps, v_s1, v_s2, bytes1, bytes2;
+    unsigned long s1 = adler & 0xffff, s2 = (adler >> 16) & 0xffff;
+    unsigned blocks = len / ADLER32_BLOCK_SIZE, n;
+
+    while (blocks) {
+        /* At most NMAX bytes before s2 must be reduced modulo BASE. */
+        n = NMAX / ADLER32_BLOCK_SIZE;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+        /* v_ps: sum of s1 values at the start of each block. */
+        v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+        v_s2 = _mm_cvtsi32_si128((int)s2);
+        v_s1 = zero;
+        do {
+            bytes1 = _mm_loadu_si128((const __m128i*)buf);
+            bytes2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                _mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                _mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += ADLER32_BLOCK_SIZE;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+        s1 = (s1 + adler32_hsum_sse2(v_s1)) % BASE;
+        s2 = adler32_hsum_sse2(v_s2) % BASE;
+    }
+    return s1 | (s2 << 16);
+}
+
+/* Same as adler32_ssse3, but with 32-byte registers. */
+local __attribute__((target("avx2"))) uLong adler32_avx2(
+    uLong adler, const Bytef *buf, uInt len)
+{
+    const __m256i tap = _mm256_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i v_ps, v_s1, v_s2, bytes;
+    unsigned long s1 = adler & 0xffff, s2 = (adler >> 16) & 0xffff;
+    unsigned blocks = len / ADLER32_BLOCK_SIZE, n;
+
+    while (blocks) {
+        n = NMAX / ADLER32_BLOCK_SIZE;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+        v_ps = _mm256_castsi128_si256(_mm_cvtsi32_si128((int)(s1 * n)));
+        v_s2 = _mm256_castsi128_si256(_mm_cvtsi32_si128((int)s2));
+        v_s1 = zero;
+        do {
+            bytes = _mm256_loadu_si256((const __m256i*)buf);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(
+                _mm256_maddubs_epi16(bytes, tap), ones));
+            buf += ADLER32_BLOCK_SIZE;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+        s1 = (s1 + adler32_hsum_sse2(_mm_add_epi32(
+            _mm256_castsi256_si128(v_s1),
+            _mm256_extracti128_si256(v_s1, 1)))) % BASE;
+        s2 = adler32_hsum_sse2(_mm_add_epi32(
+            _mm256_castsi256_si128(v_s2),
+            _mm256_extracti128_si256(v_s2, 1))) % BASE;
+    }
+    return s1 | (s2 << 16);
+}
+#endif /* ADLER32_SIMD */
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(uLong adler, const Bytef *buf, uInt len)
 {
@@ -79,6 +184,25 @@ uLong ZEXPORT adler32(uLong adler, const Bytef *buf, uInt len)
     if (buf == Z_NULL)
         return 1L;
 
+#ifdef ADLER32_SIMD
+    /* do whole blocks with SIMD, the rest of the bytes below */
+    if (len >= 64) {
+        n = len - len % ADLER32_BLOCK_SIZE;
+        if (__builtin_cpu_supports("avx2"))
+            adler = adler32_avx2(adler | (sum2 << 16), buf, n);
+        else if (__builtin_cpu_supports("ssse3"))
+            adler = adler32_ssse3(adler | (sum2 << 16), buf, n);
+        else
+            n = 0;
+        if (n) {
+            sum2 = adler >> 16;
+            adler &= 0xffff;
+            buf += n;
+            len -= n;
+        }
+    }
+#endif /* ADLER32_SIMD */
+
     /* in case short lengths are provided, keep it somewhat fast */
     if (len < 16) {
         while (len--) {
@@ -122,11 +246,18 @@ uLong ZEXPORT adler32(uLong adler, const Bytef *buf, uInt len)
     return adler | (sum2 << 16);
 }
 
-#ifndef NO_COMBINE64
-local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2);
+/* With NO_COMBINE64, only the z_off_t variant is compiled, and it doesn't
+   use 64-bit arithmetic (which needs ___moddi3 on some 32-bit targets). */
+#ifdef NO_COMBINE64
+#  define z_combine_off_t z_off_t
+#else
+#  define z_combine_off_t z_off64_t
+#endif
+
+local uLong adler32_combine_(uLong adler1, uLong adler2, z_combine_off_t len2);
 
 /* ========================================================================= */
-local uLong adler32_combine_(uLong adler1, uLong adler2, z_off64_t len2)
+local uLong adler32_combine_(uLong adler1, uLong adler2, z_combine_off_t len2)
 {
     unsigned long sum1;
     unsigned long sum2;
@@ -152,6 +283,7 @@ uLong ZEXPORT adler32_combine(uLong adler1, uLong adler2, z_off_t len2)
     return adler32_combine_(adler1, adler2, len2);
 }
 
+#ifndef NO_COMBINE64
 uLong ZEXPORT adler32_combine64(uLong adler1, uLong adler2, z_off64_t len2)
 {
     return adler32_combine_(adler1, adler2, len2);
@@ -214,6 +214,65 @@ const unsigned long FAR * ZEXPORT get_crc_table()
 #define DO1 crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8)
 #define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
 
+/* ========================================================================= */
+/* CRC folding with carry-less multiplication (PCLMULQDQ) for amd64, as
+ * described in Intel's paper "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction", selected at runtime by crc32(). The
+ * constants are from the paper (bit-reflected). Define NO_SIMD to disable.
+ */
+#if !defined(NO_SIMD) && defined(__SSE2__) && !defined(__TINYC__) && \
+    (defined(__clang__) ? __clang_major__ >= 8 : __GNUC__ >= 8)
+#  define CRC32_PCLMUL
+#  include <emmintrin.h>
+#  include <wmmintrin.h>  /* _mm_clmulepi64_si128() */
+
+/* Folds x by 128 bits with constants k, and xors y to it. */
+#define CRC32_FOLD(x, k, y) _mm_xor_si128(_mm_xor_si128( \
+    _mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), y)
+
+/* crc is not inverted. len must be at least 64 and divisible by 16. */
+local __attribute__((target("pclmul"))) unsigned long crc32_pclmul(
+    unsigned long crc, const unsigned char FAR *buf, unsigned len)
+{
+    const __m128i k1k2 = _mm_set_epi32(1, (int)0xc6e41596, 1, 0x54442bd4);
+    const __m128i k3k4 = _mm_set_epi32(0, (int)0xccaa009e, 1, 0x751997d0);
+    const __m128i k5k0 = _mm_set_epi32(0, 0, 1, 0x63cd6124);
+    const __m128i poly = _mm_set_epi32(1, (int)0xf7011641, 1, (int)0xdb710641);
+    const __m128i mask32 = _mm_set_epi32(0, -1, 0, -1);
+    __m128i x1, x2, x3, x4;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)buf),
+                       _mm_cvtsi32_si128((int)crc));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    /* Fold 4 * 128 bits in parallel. */
+    for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+        x1 = CRC32_FOLD(x1, k1k2, _mm_loadu_si128((const __m128i*)buf));
+        x2 = CRC32_FOLD(x2, k1k2, _mm_loadu_si128((const __m128i*)(buf + 16)));
+        x3 = CRC32_FOLD(x3, k1k2, _mm_loadu_si128((const __m128i*)(buf + 32)));
+        x4 = CRC32_FOLD(x4, k1k2, _mm_loadu_si128((const __m128i*)(buf + 48)));
+    }
+    /* Fold into 128 bits. */
+    x1 = CRC32_FOLD(x1, k3k4, x2);
+    x1 = CRC32_FOLD(x1, k3k4, x3);
+    x1 = CRC32_FOLD(x1, k3k4, x4);
+    for (; len >= 16; buf += 16, len -= 16) {
+        x1 = CRC32_FOLD(x1, k3k4, _mm_loadu_si128((const __m128i*)buf));
+    }
+    /* Fold 128 bits to 64 bits. */
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8),
+                       _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(
+        _mm_and_si128(x1, mask32), k5k0, 0x00));
+    /* Barrett reduction to 32 bits. */
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /* CRC32_PCLMUL */
+
 /* ========================================================================= */
 unsigned long ZEXPORT crc32(unsigned long crc, const unsigned char FAR *buf, uInt len)
 {
@@ -224,6 +283,15 @@ unsigned long ZEXPORT crc32(unsigned long crc, const unsigned char FAR *buf, uIn
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#ifdef CRC32_PCLMUL
+    /* do 16-byte blocks with PCLMULQDQ, the rest of the bytes below */
+    if (len >= 64 && __builtin_cpu_supports("pclmul")) {
+        crc = crc32_pclmul(crc ^ 0xffffffffUL, buf, len & ~15U) ^ 0xffffffffUL;
+        buf += len & ~15U;
+        len &= 15;
+    }
+#endif /* CRC32_PCLMUL */
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         u4 endian;
@@ -328,12 +396,18 @@ local unsigned long crc32_big(unsigned long crc, const unsigned char FAR *buf, u
 
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
-#ifndef NO_COMBINE64
+/* With NO_COMBINE64, only the z_off_t variant is compiled. */
+#ifdef NO_COMBINE64
+#  define z_combine_off_t z_off_t
+#else
+#  define z_combine_off_t z_off64_t
+#endif
+
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
                                          unsigned long vec));
 local void gf2_matrix_square OF((unsigned long *square, unsigned long *mat));
-local uLong crc32_combine_(uLong crc1, uLong crc2, z_off64_t len2);
+local uLong crc32_combine_(uLong crc1, uLong crc2, z_combine_off_t len2);
 
 /* ========================================================================= */
 local unsigned long gf2_matrix_times(unsigned long *mat, unsigned long vec)
@@ -360,7 +434,7 @@ local void gf2_matrix_square(unsigned long *square, unsigned long *mat)
 }
 
 /* ========================================================================= */
-local uLong crc32_combine_(uLong crc1, uLong crc2, z_off64_t len2)
+local uLong crc32_combine_(uLong crc1, uLong crc2, z_combine_off_t len2)
 {
     int n;
     unsigned long row;
@@ -418,6 +492,7 @@ uLong ZEXPORT crc32_combine(uLong crc1, uLong crc2, z_off_t len2)
     return crc32_combine_(crc1, crc2, len2);
 }
 
+#ifndef NO_COMBINE64
 uLong ZEXPORT crc32_combine64(uLong crc1, uLong crc2, z_off64_t len2)
 {
     return crc32_combine_(crc1, crc2, len2);